@@ -0,0 +1,41 @@
+/** \file
+ * Cycle counter timing and on-device benchmarks.
+ *
+ * Times are taken with the Cortex-M DWT cycle counter, which runs at
+ * F_CPU and wraps after 2^32 cycles (about 44 seconds at 96 MHz), so
+ * anything being timed must be shorter than that.
+ */
+#ifndef _bench_h_
+#define _bench_h_
+
+#include <stdint.h>
+
+/** Start the DWT cycle counter */
+void
+cycles_init(void);
+
+
+static inline uint32_t
+cycles_now(void)
+{
+	return ARM_DWT_CYCCNT;
+}
+
+
+static inline uint32_t
+cycles_to_us(
+	uint32_t cycles
+)
+{
+	return cycles / (F_CPU / 1000000);
+}
+
+
+/** Run the benchmarks selected by a bit mask.
+ * The results are printed one per line as
+ * "bench NAME n=N min_us=MIN mean_us=MEAN max_us=MAX [kBps=RATE]".
+ */
+void
+bench(void);
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ * \file On-device benchmarks
+ *
+ * kMASK [ADDR] runs the benchmarks in MASK:
+ *
+ *  1  read throughput with each read clock profile, for READ and
+ *     FAST_READ, over the 64 KB at ADDR
+ *  2  USB send: "bench usb-tx bytes=N" followed by N bytes of junk
+ *  4  USB receive: "bench usb-rx bytes=N" and then the host must
+ *     send N bytes
+ *  8  page program and 4K/32K/64K erase latency.  This erases the
+ *     64 KB block at ADDR, so point it at a scratch area.
+ */
+
+#include "bench.h"
+
+#define BENCH_REGION		0x10000
+#define BENCH_READ_PASSES	8
+#define BENCH_USB_BYTES		0x40000
+#define BENCH_ROUNDS		2
+#define BENCH_RX_TIMEOUT_MS	5000 // host silence that ends the usb-rx test
+
+typedef struct
+{
+	uint32_t n;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+} bench_stat_t;
+
+// shared by all of the benchmarks; only one runs at a time
+static uint8_t bench_buf[SPI_PAGE_SIZE];
+
+
+void
+cycles_init(void)
+{
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+}
+
+
+static void
+bench_reset(
+	bench_stat_t * const st
+)
+{
+	st->n = 0;
+	st->min = 0xFFFFFFFF;
+	st->max = 0;
+	st->sum = 0;
+}
+
+
+static void
+bench_add(
+	bench_stat_t * const st,
+	uint32_t cycles
+)
+{
+	st->n++;
+	st->sum += cycles;
+	if (cycles < st->min)
+		st->min = cycles;
+	if (cycles > st->max)
+		st->max = cycles;
+}
+
+
+/** Print the stats, and the rate if each sample moved bytes */
+static void
+bench_print(
+	const bench_stat_t * const st,
+	uint32_t bytes
+)
+{
+	if (st->n == 0)
+	{
+		Serial.print(" n=0\r\n");
+		return;
+	}
+
+	const uint64_t mean = st->sum / st->n;
+
+	Serial.print(" n=");
+	Serial.print(st->n);
+	Serial.print(" min_us=");
+	Serial.print(cycles_to_us(st->min));
+	Serial.print(" mean_us=");
+	Serial.print(cycles_to_us(mean));
+	Serial.print(" max_us=");
+	Serial.print(cycles_to_us(st->max));
+
+	if (bytes && mean)
+	{
+		const uint64_t rate = (uint64_t) bytes * (F_CPU / 1000) / mean;
+		Serial.print(" kBps=");
+		Serial.print((uint32_t) rate);
+	}
+
+	Serial.print("\r\n");
+}
+
+
+static void
+bench_read(
+	uint32_t addr
+)
+{
+	const uint8_t old_profile = spi_read_profile;
+	bench_stat_t st;
+
+	for (uint8_t profile = 0 ; profile < SPI_READ_PROFILES ; profile++)
+	{
+		for (uint8_t fast = 0 ; fast < 2 ; fast++)
+		{
+			spi_read_profile_set(profile);
+			spi_read_fast = fast;
+			bench_reset(&st);
+
+			for (uint8_t pass = 0 ; pass < BENCH_READ_PASSES ; pass++)
+			{
+				const uint32_t start = cycles_now();
+				for (uint32_t off = 0 ; off < BENCH_REGION ; off += sizeof(bench_buf))
+					spi_read_bulk(addr + off, bench_buf, sizeof(bench_buf));
+				bench_add(&st, cycles_now() - start);
+			}
+
+			Serial.print("bench read-");
+			Serial.print(fast ? "0B-" : "03-");
+			Serial.print(spi_read_profiles[profile].clock);
+			bench_print(&st, BENCH_REGION);
+		}
+	}
+
+	spi_read_profile_set(old_profile);
+}
+
+
+static void
+bench_usb_tx(void)
+{
+	bench_stat_t st;
+
+	memset(bench_buf, 0x55, sizeof(bench_buf));
+	bench_reset(&st);
+
+	Serial.print("bench usb-tx bytes=");
+	Serial.print(BENCH_USB_BYTES, HEX);
+	Serial.print("\r\n");
+	Serial.send_now();
+
+	for (uint32_t off = 0 ; off < BENCH_USB_BYTES ; off += sizeof(bench_buf))
+	{
+		const uint32_t start = cycles_now();
+		Serial.write(bench_buf, sizeof(bench_buf));
+		bench_add(&st, cycles_now() - start);
+	}
+
+	Serial.send_now();
+	Serial.print("\r\nbench usb-tx");
+	bench_print(&st, sizeof(bench_buf));
+}
+
+
+static void
+bench_usb_rx(void)
+{
+	bench_stat_t st;
+
+	bench_reset(&st);
+
+	Serial.print("bench usb-rx bytes=");
+	Serial.print(BENCH_USB_BYTES, HEX);
+	Serial.print("\r\n");
+	Serial.send_now();
+
+	// the first chunk includes the host's turnaround, so it is
+	// timed from when the first byte shows up
+	uint32_t last = millis();
+	while (!Serial.available())
+	{
+		if (millis() - last > BENCH_RX_TIMEOUT_MS)
+		{
+			Serial.print("bench usb-rx timeout\r\n");
+			return;
+		}
+	}
+
+	for (uint32_t off = 0 ; off < BENCH_USB_BYTES ; off += sizeof(bench_buf))
+	{
+		const uint32_t start = cycles_now();
+		uint16_t fill = 0;
+		while (fill < sizeof(bench_buf))
+		{
+			int avail = Serial.available();
+			if (avail <= 0)
+			{
+				if (millis() - last <= BENCH_RX_TIMEOUT_MS)
+					continue;
+				Serial.print("bench usb-rx timeout\r\n");
+				return;
+			}
+
+			last = millis();
+			if (avail > (int) sizeof(bench_buf) - fill)
+				avail = sizeof(bench_buf) - fill;
+			Serial.readBytes((char*) &bench_buf[fill], avail);
+			fill += avail;
+		}
+		bench_add(&st, cycles_now() - start);
+	}
+
+	Serial.print("bench usb-rx");
+	bench_print(&st, sizeof(bench_buf));
+}
+
+
+/** Time one erase of the given size at addr.
+ * \return 0 on success, -1 if the chip does not have it or timed out.
+ */
+static int
+bench_erase(
+	bench_stat_t * const st,
+	uint32_t addr,
+	uint32_t size
+)
+{
+	const spi_erase_type_t * const erase = spi_chip_erase_type(size);
+	if (!erase)
+		return -1;
+
+	spi_write_enable();
+	const uint32_t start = cycles_now();
+	const int rc = spi_erase(addr, erase);
+	const uint32_t end = cycles_now();
+
+	if (rc < 0)
+		return -1;
+
+	bench_add(st, end - start);
+	return 0;
+}
+
+
+static void
+bench_program_erase(
+	uint32_t addr
+)
+{
+	bench_stat_t st_page, st_4k, st_32k, st_64k;
+	const uint16_t page_size = spi_chip.page_size;
+
+	if ((addr & 0xFFFF) != 0)
+	{
+		Serial.print("bench program: ADDR must be 64K aligned\r\n");
+		return;
+	}
+
+	bench_reset(&st_page);
+	bench_reset(&st_4k);
+	bench_reset(&st_32k);
+	bench_reset(&st_64k);
+
+	for (uint16_t i = 0 ; i < sizeof(bench_buf) ; i++)
+		bench_buf[i] = i * 37 + 11;
+
+	for (uint8_t round = 0 ; round < BENCH_ROUNDS ; round++)
+	{
+		if (bench_erase(&st_64k, addr, 0x10000) < 0)
+			break;
+
+		// program the first sector a page at a time
+		for (uint16_t i = 0 ; i < SPI_PAGE_SIZE ; i += page_size)
+		{
+			spi_addr_prepare(addr + i);
+			spi_write_enable();
+			const uint32_t start = cycles_now();
+
+			spi_cs(1);
+			spi_write_command(addr + i);
+			for (uint16_t j = 0 ; j < page_size ; j++)
+				spi_send(bench_buf[i+j]);
+			spi_cs(0);
+
+			if (spi_wait(spi_chip.page_timeout_ms) < 0)
+				break;
+
+			bench_add(&st_page, cycles_now() - start);
+		}
+
+		for (uint32_t off = 0 ; off < 4 * SPI_PAGE_SIZE ; off += SPI_PAGE_SIZE)
+			bench_erase(&st_4k, addr + off, SPI_PAGE_SIZE);
+
+		bench_erase(&st_32k, addr, 0x8000);
+		bench_erase(&st_32k, addr + 0x8000, 0x8000);
+	}
+
+	Serial.print("bench page-program");
+	bench_print(&st_page, page_size);
+	Serial.print("bench erase-4k");
+	bench_print(&st_4k, 0);
+	Serial.print("bench erase-32k");
+	bench_print(&st_32k, 0);
+	Serial.print("bench erase-64k");
+	bench_print(&st_64k, 0);
+}
+
+
+void
+bench(void)
+{
+	const uint8_t mask = usb_serial_readhex();
+	uint32_t addr = 0;
+
+	if (usb_serial_term == ' ')
+		addr = usb_serial_readhex();
+
+	spi_chip_detect();
+	spi_bus_claim();
+
+	if (mask & 1)
+		bench_read(addr);
+	if (mask & 2)
+		bench_usb_tx();
+	if (mask & 4)
+		bench_usb_rx();
+	if (mask & 8)
+		bench_program_erase(addr);
+
+	spi_bus_release();
+}
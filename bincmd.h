@@ -0,0 +1,100 @@
+/** \file
+ * Binary command mode for host tools.
+ *
+ * Sending BINCMD_MAGIC at the menu switches to binary mode, which
+ * answers with a BINCMD_PING reply.  From then on the host sends
+ * fixed size requests and gets fixed size replies, with no echo and
+ * no text to parse, until it sends BINCMD_EXIT or closes the port
+ * (if it had raised DTR).
+ * All fields are little endian.
+ *
+ * Some requests are followed by data from the host (BINCMD_PROGRAM),
+ * and some replies by data from the device (BINCMD_READ and the
+ * BINCMD_HASH table).  Those are only sent if the reply status is
+ * BINCMD_OK.
+ *
+ * BINCMD_BATCH runs a queue of requests back to back.  Its len is the
+ * number of requests, which follow it as up to BINCMD_BATCH_MAX
+ * bincmd_req_t, and then the data for each BINCMD_PROGRAM in order.
+ * Every request is checked before any of them run.  The queue stops
+ * at the first failure, and the rest are marked BINCMD_ERR_SKIPPED.
+ * The device sends back one reply whose status is that of the first
+ * failure (or BINCMD_OK) and whose value is the number of requests
+ * that ran.  The reply is followed by one bincmd_result_t per
+ * request.  Inside a batch, BINCMD_READ returns the CRC-32 of the
+ * range in place of the data.
+ */
+#ifndef _bincmd_h_
+#define _bincmd_h_
+
+#include <stdint.h>
+
+#define BINCMD_MAGIC		0xFE // request start, and enters binary mode
+#define BINCMD_REPLY_MAGIC	0xFD
+#define BINCMD_VERSION		1
+#define BINCMD_TIMEOUT_MS	1000
+#define BINCMD_BATCH_MAX	64
+
+// Opcodes, with what they use from the request and return in the reply
+#define BINCMD_PING		0x00 // value = BINCMD_VERSION
+#define BINCMD_ID		0x01 // addr = chip size, value = RDID
+#define BINCMD_READ_STATUS	0x02 // value = status register
+#define BINCMD_WRITE_STATUS	0x03 // addr = new status register, value = status
+#define BINCMD_WRITE_ENABLE	0x04 // value = status register
+#define BINCMD_ERASE		0x05 // addr, len 4K aligned
+#define BINCMD_PROGRAM		0x06 // addr, len 4K aligned, then len bytes
+#define BINCMD_READ		0x07 // addr, len; reply, then len bytes and CRC-32
+#define BINCMD_HASH		0x08 // addr, len; value = CRC-32 of the range
+#define BINCMD_PROFILE		0x09 // addr = read profile, value = clock
+#define BINCMD_BATCH		0x0A // len = requests that follow
+#define BINCMD_RESUME		0x0B // addr = last upload start, value = first sector not done
+#define BINCMD_EXIT		0xFF // back to the menu
+
+// Request flags
+#define BINCMD_FLAG_ERASE	0x0001 // PROGRAM: erase each sector first
+#define BINCMD_FLAG_TABLE	0x0002 // HASH: reply, then a CRC-32 per 4K sector
+
+// Reply status
+#define BINCMD_OK		0
+#define BINCMD_ERR_OP		1 // unknown opcode
+#define BINCMD_ERR_RANGE	2 // bad address, length or alignment
+#define BINCMD_ERR_FLASH	3 // the flash timed out
+#define BINCMD_ERR_RX		4 // data from the host did not arrive
+#define BINCMD_ERR_WP		5 // WEL did not set
+#define BINCMD_ERR_SKIPPED	6 // not run, an earlier batch request failed
+
+typedef struct
+{
+	uint8_t magic; // BINCMD_MAGIC
+	uint8_t op;
+	uint16_t flags;
+	uint32_t addr;
+	uint32_t len;
+} __attribute__((__packed__))
+bincmd_req_t;
+
+typedef struct
+{
+	uint8_t magic; // BINCMD_REPLY_MAGIC
+	uint8_t op;
+	uint8_t status;
+	uint8_t reserved;
+	uint32_t addr;
+	uint32_t value;
+} __attribute__((__packed__))
+bincmd_reply_t;
+
+typedef struct
+{
+	uint8_t status;
+	uint8_t reserved[3];
+	uint32_t value;
+} __attribute__((__packed__))
+bincmd_result_t;
+
+
+/** Run binary commands until BINCMD_EXIT or the host goes away */
+void
+bincmd_loop(void);
+
+#endif
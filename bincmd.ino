@@ -0,0 +1,481 @@
+/**
+ * \file Binary command mode
+ *
+ * See bincmd.h for the packet formats.  Every command runs on the
+ * same code as its interactive version; only the parsing and the
+ * replies are different.
+ */
+
+#include "bincmd.h"
+
+
+static void
+bincmd_reply(
+	const bincmd_req_t * const req,
+	uint8_t status,
+	uint32_t value
+)
+{
+	bincmd_reply_t reply;
+	reply.magic = BINCMD_REPLY_MAGIC;
+	reply.op = req->op;
+	reply.status = status;
+	reply.reserved = 0;
+	reply.addr = req->addr;
+	reply.value = value;
+
+	Serial.write((const uint8_t*) &reply, sizeof(reply));
+	Serial.send_now();
+}
+
+
+/** Check that a range is inside the chip and aligned to align bytes */
+static bool
+bincmd_range_ok(
+	const bincmd_req_t * const req,
+	uint32_t align
+)
+{
+	if (req->len == 0 || ((req->addr | req->len) & (align - 1)) != 0)
+		return false;
+	if (req->addr >= spi_chip.size)
+		return false;
+	return req->len <= spi_chip.size - req->addr;
+}
+
+
+/** Erase a range, with block erases where the range covers a block */
+static uint8_t
+bincmd_erase(
+	const bincmd_req_t * const req
+)
+{
+	if (!bincmd_range_ok(req, SPI_PAGE_SIZE))
+		return BINCMD_ERR_RANGE;
+
+	const uint32_t end_addr = req->addr + req->len;
+
+	for (uint32_t addr = req->addr ; addr < end_addr ; )
+	{
+		const spi_erase_type_t * const erase
+			= spi_erase_plan_range(addr, end_addr);
+
+		spi_write_enable();
+		if (spi_erase(addr, erase) < 0)
+			return BINCMD_ERR_FLASH;
+
+		addr += 1ul << erase->shift;
+	}
+
+	return BINCMD_OK;
+}
+
+
+/** Program a range from data that follows the request.  The upload
+ * buffers and receive hook are reused so that the next sector arrives
+ * while this one is being programmed.
+ */
+static uint8_t
+bincmd_program(
+	const bincmd_req_t * const req
+)
+{
+	const uint16_t page_size = spi_chip.page_size;
+	if (!bincmd_range_ok(req, SPI_PAGE_SIZE)
+	|| page_size == 0 || page_size > SPI_PAGE_SIZE)
+		return BINCMD_ERR_RANGE;
+
+	upload_buf_t * cur = &upload_bufs[0];
+	upload_buf_t * next = &upload_bufs[1];
+	uint8_t status = BINCMD_OK;
+
+	upload_compressed = false;
+	upload_buf_reset(cur);
+	upload_rx = cur;
+	spi_wait_hook = upload_rx_poll;
+
+	for (uint32_t offset = 0 ; offset < req->len ; offset += SPI_PAGE_SIZE)
+	{
+		const uint32_t addr = req->addr + offset;
+		const uint32_t start = millis();
+
+		while (!upload_buf_done(cur))
+		{
+			upload_rx_poll();
+			if (millis() - start > BINCMD_TIMEOUT_MS)
+				break;
+		}
+
+		if (!upload_buf_done(cur))
+		{
+			status = BINCMD_ERR_RX;
+			break;
+		}
+
+		if (offset + SPI_PAGE_SIZE < req->len)
+		{
+			upload_buf_reset(next);
+			upload_rx = next;
+		} else {
+			upload_rx = NULL;
+		}
+
+		if (req->flags & BINCMD_FLAG_ERASE)
+		{
+			spi_write_enable();
+			if (spi_erase_sector(addr) < 0)
+			{
+				status = BINCMD_ERR_FLASH;
+				break;
+			}
+		}
+
+		if (!cur->all_ff
+		&& spi_write_sector(addr, cur->data, spi_chunk_mask_used(cur->data)) < 0)
+		{
+			status = BINCMD_ERR_FLASH;
+			break;
+		}
+
+		upload_buf_t * const tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	spi_wait_hook = NULL;
+	upload_rx = NULL;
+
+	// the rest of the data must not be taken as requests
+	if (status != BINCMD_OK)
+		upload_drain();
+
+	return status;
+}
+
+
+/** Send the CRC-32 of each 4K sector of a range after the reply */
+static void
+bincmd_hash_table(
+	const bincmd_req_t * const req
+)
+{
+	uint32_t table[64];
+	uint8_t n = 0;
+	const uint32_t count = req->len / SPI_PAGE_SIZE;
+
+	for (uint32_t i = 0 ; i < count ; i++)
+	{
+		table[n++] = spi_region_crc(req->addr + i * SPI_PAGE_SIZE, SPI_PAGE_SIZE, NULL);
+		if (n < sizeof(table) / sizeof(*table) && i != count - 1)
+			continue;
+
+		Serial.write((const uint8_t*) table, n * sizeof(*table));
+		n = 0;
+	}
+
+	Serial.send_now();
+}
+
+
+/** Check a request before it is run.
+ * \return BINCMD_OK or the status it would fail with.
+ */
+static uint8_t
+bincmd_check(
+	const bincmd_req_t * const req
+)
+{
+	const uint16_t page_size = spi_chip.page_size;
+
+	switch (req->op)
+	{
+	case BINCMD_PING:
+	case BINCMD_ID:
+	case BINCMD_RESUME:
+	case BINCMD_READ_STATUS:
+	case BINCMD_WRITE_STATUS:
+	case BINCMD_WRITE_ENABLE:
+		return BINCMD_OK;
+
+	case BINCMD_PROGRAM:
+		if (page_size == 0 || page_size > SPI_PAGE_SIZE)
+			return BINCMD_ERR_RANGE;
+		// fall through
+	case BINCMD_ERASE:
+		return bincmd_range_ok(req, SPI_PAGE_SIZE) ? BINCMD_OK : BINCMD_ERR_RANGE;
+
+	case BINCMD_HASH:
+		if (req->flags & BINCMD_FLAG_TABLE)
+			return bincmd_range_ok(req, SPI_PAGE_SIZE) ? BINCMD_OK : BINCMD_ERR_RANGE;
+		// fall through
+	case BINCMD_READ:
+		return bincmd_range_ok(req, 1) ? BINCMD_OK : BINCMD_ERR_RANGE;
+
+	case BINCMD_PROFILE:
+		return req->addr < SPI_READ_PROFILES ? BINCMD_OK : BINCMD_ERR_RANGE;
+
+	default:
+		return BINCMD_ERR_OP;
+	}
+}
+
+
+/** Run a checked request that has no data after its reply.
+ * \return the status, with the reply value in *value.
+ */
+static uint8_t
+bincmd_run(
+	const bincmd_req_t * const req,
+	uint32_t * const value
+)
+{
+	*value = 0;
+
+	switch (req->op)
+	{
+	case BINCMD_PING:
+		*value = BINCMD_VERSION;
+		return BINCMD_OK;
+
+	case BINCMD_ID:
+		*value = ((uint32_t) spi_chip.id[0] << 16)
+			| ((uint32_t) spi_chip.id[1] << 8)
+			| ((uint32_t) spi_chip.id[2] << 0);
+		return BINCMD_OK;
+
+	case BINCMD_READ_STATUS:
+		*value = spi_status();
+		return BINCMD_OK;
+
+	case BINCMD_RESUME:
+		*value = resume_next();
+		return BINCMD_OK;
+
+	case BINCMD_WRITE_STATUS:
+	{
+		spi_write_status(req->addr);
+		const int rc = spi_wait(SPI_TIMEOUT_WRSR_MS);
+		*value = spi_status();
+		return rc < 0 ? BINCMD_ERR_FLASH : BINCMD_OK;
+	}
+
+	case BINCMD_WRITE_ENABLE:
+		spi_write_enable();
+		*value = spi_status();
+		return (*value & SPI_WEL) ? BINCMD_OK : BINCMD_ERR_WP;
+
+	case BINCMD_ERASE:
+		return bincmd_erase(req);
+
+	case BINCMD_PROGRAM:
+		return bincmd_program(req);
+
+	case BINCMD_READ:
+	case BINCMD_HASH:
+		*value = spi_region_crc(req->addr, req->len, NULL);
+		return BINCMD_OK;
+
+	case BINCMD_PROFILE:
+		spi_read_profile_set(req->addr);
+		*value = spi_read_profiles[spi_read_profile].clock;
+		return BINCMD_OK;
+
+	default:
+		return BINCMD_ERR_OP;
+	}
+}
+
+
+static bincmd_req_t bincmd_batch_reqs[BINCMD_BATCH_MAX];
+static bincmd_result_t bincmd_batch_results[BINCMD_BATCH_MAX];
+
+
+/** Receive, check and run a queue of requests, then send one reply
+ * and the result of each.
+ */
+static void
+bincmd_batch(
+	const bincmd_req_t * const req
+)
+{
+	const uint32_t count = req->len;
+	if (count == 0 || count > BINCMD_BATCH_MAX)
+	{
+		upload_drain();
+		bincmd_reply(req, BINCMD_ERR_RANGE, 0);
+		return;
+	}
+
+	const size_t len = count * sizeof(*bincmd_batch_reqs);
+	if (Serial.readBytes((char*) bincmd_batch_reqs, len) != len)
+	{
+		bincmd_reply(req, BINCMD_ERR_RX, 0);
+		return;
+	}
+
+	uint8_t status = BINCMD_OK;
+	uint32_t ran = 0;
+	bool program_data = false;
+
+	for (uint32_t i = 0 ; i < count ; i++)
+	{
+		const bincmd_req_t * const r = &bincmd_batch_reqs[i];
+		bincmd_result_t * const res = &bincmd_batch_results[i];
+		memset(res, 0, sizeof(*res));
+
+		res->status = bincmd_check(r);
+		if (r->magic != BINCMD_MAGIC || r->op == BINCMD_BATCH)
+			res->status = BINCMD_ERR_OP;
+		if (r->op == BINCMD_PROGRAM)
+			program_data = true;
+
+		if (res->status != BINCMD_OK && status == BINCMD_OK)
+			status = res->status;
+	}
+
+	if (status != BINCMD_OK)
+	{
+		// nothing runs if any request is bad
+		if (program_data)
+			upload_drain();
+	} else {
+		for (ran = 0 ; ran < count ; ran++)
+		{
+			const bincmd_req_t * const r = &bincmd_batch_reqs[ran];
+			bincmd_result_t * const res = &bincmd_batch_results[ran];
+
+			uint32_t value;
+			res->status = bincmd_run(r, &value);
+			res->value = value;
+			if (res->status == BINCMD_OK)
+				continue;
+
+			status = res->status;
+			ran++;
+			break;
+		}
+
+		// only the skipped requests still have data on the way
+		program_data = false;
+		for (uint32_t i = ran ; i < count ; i++)
+		{
+			bincmd_batch_results[i].status = BINCMD_ERR_SKIPPED;
+			if (bincmd_batch_reqs[i].op == BINCMD_PROGRAM)
+				program_data = true;
+		}
+
+		if (program_data)
+			upload_drain();
+	}
+
+	bincmd_reply(req, status, ran);
+	Serial.write((const uint8_t*) bincmd_batch_results, count * sizeof(*bincmd_batch_results));
+	Serial.send_now();
+}
+
+
+/** Run one request and send its reply */
+static void
+bincmd_exec(
+	const bincmd_req_t * const req
+)
+{
+	if (req->op == BINCMD_BATCH)
+	{
+		bincmd_batch(req);
+		return;
+	}
+
+	const uint8_t status = bincmd_check(req);
+	if (status != BINCMD_OK)
+	{
+		bincmd_reply(req, status, 0);
+		return;
+	}
+
+	switch (req->op)
+	{
+	case BINCMD_ID:
+	case BINCMD_RESUME:
+	{
+		// these reply with an address of their own
+		bincmd_req_t r = *req;
+		uint32_t value;
+		r.addr = req->op == BINCMD_ID ? spi_chip.size : resume_start();
+		const uint8_t rc = bincmd_run(req, &value);
+		bincmd_reply(&r, rc, value);
+		break;
+	}
+
+	case BINCMD_READ:
+	{
+		bincmd_reply(req, BINCMD_OK, req->len);
+		const uint32_t crc = spi_dump(req->addr, req->len);
+		Serial.write((const uint8_t*) &crc, sizeof(crc));
+		Serial.send_now();
+		break;
+	}
+
+	case BINCMD_HASH:
+		if (req->flags & BINCMD_FLAG_TABLE)
+		{
+			bincmd_reply(req, BINCMD_OK, req->len / SPI_PAGE_SIZE);
+			bincmd_hash_table(req);
+			break;
+		}
+		// fall through
+
+	default:
+	{
+		uint32_t value;
+		const uint8_t rc = bincmd_run(req, &value);
+		bincmd_reply(req, rc, value);
+		break;
+	}
+	}
+}
+
+
+void
+bincmd_loop(void)
+{
+	bincmd_req_t req;
+
+	spi_chip_detect();
+	spi_bus_claim();
+
+	memset(&req, 0, sizeof(req));
+	req.op = BINCMD_PING;
+	bincmd_reply(&req, BINCMD_OK, BINCMD_VERSION);
+
+	// closing the port drops DTR, but a host that never raised it
+	// can only leave with BINCMD_EXIT
+	bool dtr_seen = false;
+
+	for (;;)
+	{
+		if (Serial.dtr())
+			dtr_seen = true;
+		else if (dtr_seen)
+			break;
+
+		const int c = Serial.read();
+		if (c != BINCMD_MAGIC)
+			continue; // nothing yet, or junk between requests
+
+		req.magic = c;
+		const size_t rest = sizeof(req) - 1;
+		if (Serial.readBytes((char*) &req + 1, rest) != rest)
+			continue;
+
+		if (req.op == BINCMD_EXIT)
+		{
+			bincmd_reply(&req, BINCMD_OK, 0);
+			break;
+		}
+
+		bincmd_exec(&req);
+	}
+
+	spi_bus_release();
+}
@@ -0,0 +1,140 @@
+/** \file
+ * Flash chip descriptor.
+ *
+ * Filled in from the JEDEC SFDP tables when the chip has them,
+ * or guessed from the RDID capacity byte when it does not.
+ * The dump, upload and erase engines use it instead of fixed
+ * sizes and opcodes.
+ */
+#ifndef _chip_h_
+#define _chip_h_
+
+#include <stdint.h>
+
+#define SPI_CHIP_ERASE_TYPES	4
+
+// Address modes from SFDP DWORD 1 bits 18:17
+#define SPI_ADDR_3		0 // 3-byte addresses only
+#define SPI_ADDR_3OR4		1 // 3-byte by default, 4-byte mode available
+#define SPI_ADDR_4		2 // 4-byte addresses only
+
+// How addresses above 16 MB are sent, picked at detect time
+#define SPI_ADDR_METHOD_3	0 // 3-byte addresses, 16 MB or smaller
+#define SPI_ADDR_METHOD_4OP	1 // 4-byte address opcodes (0x13, 0x12, 0x21, ...)
+#define SPI_ADDR_METHOD_EN4B	2 // enter 4-byte mode (0xB7), then the usual opcodes
+#define SPI_ADDR_METHOD_BANK	3 // 3-byte addresses and the bank register (BRWR)
+#define SPI_ADDR_METHODS	4
+
+// Ways to enter 4-byte addressing from SFDP DWORD 16 bits 31:24
+#define SFDP_ENTER_4B		0x01 // 0xB7
+#define SFDP_ENTER_4B_WREN	0x02 // WREN, then 0xB7
+#define SFDP_ENTER_EAR		0x04 // extended address register
+#define SFDP_ENTER_BANK		0x08 // bank register, 0x16 and 0x17
+#define SFDP_ENTER_NVCR		0x10 // nonvolatile configuration register
+#define SFDP_ENTER_4OP		0x20 // dedicated 4-byte address opcodes
+#define SFDP_ENTER_ALWAYS	0x40 // always 4-byte addresses
+
+// How to set the Quad Enable bit before a 1-1-4 or 1-4-4 read,
+// from the SFDP DWORD 15 bits 22:20 values that can be read back
+#define SPI_QE_UNKNOWN		0 // no SFDP, or a method that is not handled
+#define SPI_QE_NONE		1 // no QE bit, or IO2/IO3 are always quad
+#define SPI_QE_SR1_BIT6		2 // status register bit 6, written with WRSR
+#define SPI_QE_SR2_BIT1		3 // read with 0x35, written as WRSR's second byte
+#define SPI_QE_SR2_BIT1_31	4 // read with 0x35, written with 0x31
+
+// Timeouts for parts without SFDP timing, from the worst case
+// numbers of common datasheets
+#define SPI_TIMEOUT_PAGE_MS	10
+#define SPI_TIMEOUT_4K_MS	500
+#define SPI_TIMEOUT_32K_MS	2000
+#define SPI_TIMEOUT_64K_MS	3000
+#define SPI_TIMEOUT_CHIP_MS	400000
+#define SPI_TIMEOUT_WRSR_MS	100
+
+typedef struct
+{
+	uint8_t shift; // erase size is 1 << shift, 0 for an unused type
+	uint8_t opcode;
+	uint32_t timeout_ms;
+} spi_erase_type_t;
+
+typedef struct
+{
+	uint8_t opcode; // 0 if the mode is not supported
+	uint8_t dummy; // dummy and mode clocks after the address
+} spi_fast_read_t;
+
+typedef struct
+{
+	uint8_t valid; // detected, or the size was set by hand
+	uint8_t sfdp; // read from the SFDP table rather than guessed
+	uint8_t id[3]; // RDID manufacturer, type and capacity
+	uint8_t addr_mode;
+	uint8_t addr_method; // SPI_ADDR_METHOD_*
+	uint8_t addr_enter; // SFDP_ENTER_* bits, 0 if not known
+	uint32_t size; // in bytes
+	uint16_t page_size;
+
+	// how long to wait for WIP to clear before giving up
+	uint16_t page_timeout_ms;
+	uint32_t chip_erase_timeout_ms;
+
+	// sorted from smallest to largest
+	spi_erase_type_t erase[SPI_CHIP_ERASE_TYPES];
+
+	spi_fast_read_t read_112;
+	spi_fast_read_t read_122;
+	spi_fast_read_t read_114;
+	spi_fast_read_t read_144;
+	uint8_t quad_enable; // SPI_QE_*
+
+	// the write enable for a volatile status register write, 0x50
+	// or 0x06, so that QE can be set without wearing the nonvolatile
+	// register.  0 if SFDP does not say there is one.
+	uint8_t sr_volatile_wren;
+} spi_chip_t;
+
+extern spi_chip_t spi_chip;
+
+
+/** Pick the address method from the size and what the chip says it
+ * supports.  Done by the probe; call it again after changing the size.
+ */
+void
+spi_chip_addr_auto(void);
+
+
+/** Reset the descriptor to the defaults for an 8 MB part
+ * with 4K, 32K and 64K erases and 256-byte pages.
+ */
+void
+spi_chip_default(void);
+
+
+/** Read RDID and SFDP and fill in spi_chip.
+ * \return 0 if a chip was found, -1 if it did not answer.
+ */
+int
+spi_chip_probe(void);
+
+
+/** Probe the chip if that has not been done yet. */
+void
+spi_chip_detect(void);
+
+
+/** Find the erase type for a given size.
+ * \return the erase type, or NULL if the chip does not have it or
+ * it has no 4-byte opcode and the chip is addressed with those.
+ */
+const spi_erase_type_t *
+spi_chip_erase_type(
+	uint32_t size
+);
+
+
+/** Print the descriptor to the serial port. */
+void
+spi_chip_print(void);
+
+#endif
@@ -0,0 +1,21 @@
+/** \file
+ * CRC-32 for checking data read from the flash.
+ */
+#ifndef _crc_h_
+#define _crc_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** Update a CRC-32 (the zlib/ethernet polynomial) with more data.
+ * Start with crc = 0; the pre and post inversion is handled here
+ * so that calls can be chained across buffers.
+ */
+uint32_t
+crc32_update(
+	uint32_t crc,
+	const uint8_t * buf,
+	size_t len
+);
+
+#endif
@@ -0,0 +1,88 @@
+/** \file
+ * Dual and quad output reads with FlexSPI2 on the Teensy 4.1.
+ * The FlexSPI2 driver is only built with -DCONFIG_FLEXSPI; without
+ * it Q replies "!".
+ *
+ * This is only the Q command, not a backend of the read, program and
+ * erase engines: d, F, h, the uploads and bincmd all still go through
+ * spi_read_bulk() and LPSPI.  Handing the pads back and forth between
+ * LPSPI and FlexSPI2 for each command, and programming and erasing
+ * with FlexSPI2 LUT sequences, are left for when the driver has been
+ * tried on a board.
+ *
+ * LPSPI only has one data line in each direction.  The Teensy 4.1
+ * brings FlexSPI2 out to the memory pads on the bottom, so with the
+ * PSRAM pads left empty and WP# and HOLD# wired as IO2 and IO3, a
+ * chip can be read two or four bits per clock.  CS#, SCLK, SI and SO
+ * stay wired to the LPSPI pins as well; only one of the two buses
+ * drives them at a time, and everything except Q uses LPSPI.
+ *
+ *   CS#          pin 48  EMC_24  FLEXSPI2_A_SS0_B (also pin 10)
+ *   SCLK         pin 53  EMC_25  FLEXSPI2_A_SCLK  (also pin 13)
+ *   SI    IO0    pin 52  EMC_26  FLEXSPI2_A_DATA0 (also pin 11)
+ *   SO    IO1    pin 49  EMC_27  FLEXSPI2_A_DATA1 (also pin 12)
+ *   WP#   IO2    pin 50  EMC_28  FLEXSPI2_A_DATA2
+ *   HOLD# IO3    pin 54  EMC_29  FLEXSPI2_A_DATA3
+ *
+ * IO2 and IO3 are left floating outside of Q, so the board has to
+ * pull WP# and HOLD# high the way it does for the other commands.
+ *
+ * The Teensy startup code muxes EMC_24 to EMC_29 to FlexSPI2 and
+ * probes for PSRAM before setup() runs, so a chip that is already
+ * wired up sees that traffic on every boot: 0xF5 on four pads (exit
+ * QPI), then 0x66 and 0x99 (reset enable and reset) and 0x9F (read
+ * ID).  A chip that has the 0x66/0x99 reset loses its volatile state,
+ * like 4-byte address mode, but nothing is written.  If nobody
+ * answers as a PSRAM, the pads are left as FlexSPI2 outputs, where
+ * they would fight LPSPI on pins 10 to 13; setup() gives them back
+ * with flexspi_end() in every Teensy 4 build.
+ *
+ * 1-1-4 and 1-4-4 reads need the chip's Quad Enable bit.  Q only sets
+ * it with a volatile status register write (0x50, or 0x06 for a
+ * register that is volatile anyway), from where SFDP DWORD 15 puts
+ * QE and DWORD 16 (or DWORD 1) says the volatile write is available,
+ * and puts it back afterwards.  The nonvolatile register is never
+ * written by Q; for chips without the volatile write, QE has to be
+ * set by hand with X.  The first bytes are read with LPSPI as well,
+ * and nothing is sent if the quad read does not match them.
+ */
+#ifndef _flexspi_h_
+#define _flexspi_h_
+
+#include <stdint.h>
+
+// Read modes for Q, named by the pads used for the opcode,
+// the address and the data
+#define QUAD_MODE_112		0x2 // 0x3B, or 0x3C with a 4-byte address
+#define QUAD_MODE_114		0x4 // 0x6B, or 0x6C
+#define QUAD_MODE_144		0x44 // 0xEB, or 0xEC
+
+// Bytes per IP command and per Serial.write().  usb_serial_write()
+// on the Teensy 4 copies into its transmit buffers and returns, so
+// the next FlexSPI read runs while the USB sends the last one.
+#define QUAD_CHUNK_SIZE		0x4000
+
+// Bytes at the start of the range compared with an LPSPI read
+#define QUAD_CHECK_SIZE		0x100
+
+
+/** QADDR LEN [MODE]: send a range read with FlexSPI2.  The reply is
+ * the same as for d, with a "Q start len" line, or "!" if the range
+ * does not fit, the board has no FlexSPI2, the QE bit could not be
+ * set or the quad read does not match.  MODE is one of the
+ * QUAD_MODE_* values, 1-1-4 by default.  The CRC is inverted if a
+ * read failed or QE could not be put back.
+ */
+void
+quad_dump_interactive(void);
+
+
+#if defined(__IMXRT1062__)
+/** Give the FlexSPI2 pads back to GPIO as inputs, so that LPSPI (or
+ * the motherboard) can drive the chip.
+ */
+void
+flexspi_end(void);
+#endif
+
+#endif
@@ -0,0 +1,541 @@
+/**
+ * \file Dual and quad output reads with FlexSPI2
+ *
+ * See flexspi.h for the wiring, and for why only Q uses it.
+ * FlexSPI2 is only used for IP commands: one LUT sequence for the read, and the data is
+ * drained from the IP RX FIFO 64 bytes at a time.  The command
+ * and address are sent with the pads and dummy clocks that SFDP
+ * gave for the mode, or the usual ones for parts without SFDP.
+ */
+
+#include "flexspi.h"
+
+#if defined(__IMXRT1062__)
+
+// The pads that FlexSPI2 drives, as Teensy pin numbers.
+// Pin 51 is the other memory pad's chip select and is not used.
+static const uint8_t flexspi_pins[] = { 48, 49, 50, 52, 53, 54 };
+
+
+void
+flexspi_end(void)
+{
+	for (uint8_t i = 0 ; i < sizeof(flexspi_pins) ; i++)
+		pinMode(flexspi_pins[i], INPUT);
+}
+
+#endif
+
+
+#if defined(__IMXRT1062__) && defined(CONFIG_FLEXSPI)
+
+#define SPI_CMD_RDSR2		0x35 // Read status register 2
+#define SPI_CMD_WRSR2		0x31 // Write status register 2
+
+#define SPI_QE_SR1		0x40 // QE in status register 1
+#define SPI_QE_SR2		0x02 // QE in status register 2
+
+// The same clock source the Teensy startup code uses for the PSRAM,
+// where a divider of 6 gives 88 MHz.  The slowest divider is 8,
+// for 66 MHz, which leaves more margin on the clip leads.
+#define FLEXSPI_CLK_SEL		3
+#define FLEXSPI_CLK_PODF	7 // divide by PODF + 1
+
+#define FLEXSPI_SEQ_READ	0 // LUT sequence number for the read
+#define FLEXSPI_RX_WATERMARK	64 // bytes per RX FIFO watermark
+#define FLEXSPI_TIMEOUT_MS	100
+
+// EMC_23 to EMC_29, DQS to DATA3: strong drive, max speed and
+// hysteresis, with pullups on CS# and the data lines
+#define FLEXSPI_PAD_CS		0x1B0F9
+#define FLEXSPI_PAD_SCLK	0x100F9
+#define FLEXSPI_PAD_DATA	0x170F9
+#define FLEXSPI_PAD_DQS		0x110F9
+
+#define FLEXSPI_LUT0(opcode, pads, operand) \
+	FLEXSPI_LUT_INSTRUCTION((opcode), (pads), (operand))
+#define FLEXSPI_LUT1(opcode, pads, operand) \
+	(FLEXSPI_LUT_INSTRUCTION((opcode), (pads), (operand)) << 16)
+
+typedef struct
+{
+	uint8_t opcode;
+	uint8_t addr_bits; // 24 or 32
+	uint8_t addr_pads; // FLEXSPI_LUT_NUM_PADS_*
+	uint8_t data_pads;
+	uint8_t mode_clocks; // clocks of mode bits before the dummy clocks
+	uint8_t dummy; // dummy clocks, not counting the mode bits
+} quad_read_t;
+
+
+/** Fill in the read command for a QUAD_MODE_*.
+ * \return 0, or -1 if the mode is unknown or SFDP says the chip
+ * does not have it.
+ */
+static int
+quad_read_select(
+	quad_read_t * const read,
+	uint8_t mode,
+	bool addr4
+)
+{
+	const spi_fast_read_t * sfdp;
+	uint8_t opcode4;
+
+	read->addr_bits = addr4 ? 32 : 24;
+	read->addr_pads = FLEXSPI_LUT_NUM_PADS_1;
+	read->data_pads = FLEXSPI_LUT_NUM_PADS_4;
+	read->mode_clocks = 0;
+	read->dummy = 8;
+
+	switch (mode)
+	{
+	case QUAD_MODE_112:
+		sfdp = &spi_chip.read_112;
+		read->opcode = 0x3B;
+		opcode4 = 0x3C;
+		read->data_pads = FLEXSPI_LUT_NUM_PADS_2;
+		break;
+	case QUAD_MODE_114:
+		sfdp = &spi_chip.read_114;
+		read->opcode = 0x6B;
+		opcode4 = 0x6C;
+		break;
+	case QUAD_MODE_144:
+		sfdp = &spi_chip.read_144;
+		read->opcode = 0xEB;
+		opcode4 = 0xEC;
+		read->addr_pads = FLEXSPI_LUT_NUM_PADS_4;
+		read->mode_clocks = 2;
+		read->dummy = 4;
+		break;
+	default:
+		return -1;
+	}
+
+	if (sfdp->opcode)
+	{
+		read->opcode = sfdp->opcode;
+		if (sfdp->dummy < read->mode_clocks)
+			return -1;
+		read->dummy = sfdp->dummy - read->mode_clocks;
+	} else
+	if (spi_chip.sfdp)
+		return -1;
+
+	// the 4-byte opcodes take the same dummy clocks
+	if (addr4)
+		read->opcode = opcode4;
+
+	return 0;
+}
+
+
+/** Read the status register that has the QE bit */
+static uint8_t
+quad_qe_read(void)
+{
+	if (spi_chip.quad_enable == SPI_QE_SR1_BIT6)
+		return spi_status();
+
+	spi_cs(1);
+	spi_send(SPI_CMD_RDSR2);
+	const uint8_t sr2 = spi_send(0x00);
+	spi_cs(0);
+	return sr2;
+}
+
+
+/** Write the status register that has the QE bit, as a volatile
+ * write so the nonvolatile register is not worn or changed.
+ * \return 0, or -1 if the chip has no volatile write or timed out.
+ */
+static int
+quad_qe_write(
+	uint8_t sr
+)
+{
+	if (spi_chip.sr_volatile_wren == 0)
+		return -1;
+
+	const uint8_t sr1 = spi_status();
+
+	spi_cs(1);
+	spi_send(spi_chip.sr_volatile_wren);
+	spi_cs(0);
+
+	spi_cs(1);
+
+	switch (spi_chip.quad_enable)
+	{
+	case SPI_QE_SR1_BIT6:
+		spi_send(SPI_CMD_WRSR);
+		spi_send(sr);
+		break;
+	case SPI_QE_SR2_BIT1:
+		// WRSR with a second byte writes status register 2
+		spi_send(SPI_CMD_WRSR);
+		spi_send(sr1);
+		spi_send(sr);
+		break;
+	default:
+		spi_send(SPI_CMD_WRSR2);
+		spi_send(sr);
+		break;
+	}
+
+	spi_cs(0);
+	return spi_wait(SPI_TIMEOUT_WRSR_MS);
+}
+
+
+/** Set the QE bit, if the mode needs it, SFDP said where it is and
+ * the chip has a volatile status register write.  Otherwise it is
+ * left to X, and the check read shows if it was not set.
+ * \return the old register for quad_restore(), -1 if nothing was
+ * changed, or -2 if the write failed.
+ */
+static int
+quad_enable(
+	uint8_t mode
+)
+{
+	const uint8_t qe = spi_chip.quad_enable;
+	if (mode == QUAD_MODE_112 || qe == SPI_QE_NONE || qe == SPI_QE_UNKNOWN)
+		return -1;
+
+	const uint8_t bit = qe == SPI_QE_SR1_BIT6 ? SPI_QE_SR1 : SPI_QE_SR2;
+	const uint8_t sr = quad_qe_read();
+	if ((sr & bit) || spi_chip.sr_volatile_wren == 0)
+		return -1;
+
+	if (quad_qe_write(sr | bit) < 0 || (quad_qe_read() & bit) == 0)
+	{
+		quad_qe_write(sr);
+		return -2;
+	}
+
+	return sr;
+}
+
+
+/** Put back the register that quad_enable() changed.
+ * \return 0, or -1 if the write failed.
+ */
+static int
+quad_restore(
+	int sr
+)
+{
+	if (sr < 0)
+		return 0;
+	return quad_qe_write(sr);
+}
+
+
+static void
+flexspi_pins_mux(void)
+{
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_23 = FLEXSPI_PAD_DQS;
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_24 = FLEXSPI_PAD_CS;
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_25 = FLEXSPI_PAD_SCLK;
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_26 = FLEXSPI_PAD_DATA;
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_27 = FLEXSPI_PAD_DATA;
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_28 = FLEXSPI_PAD_DATA;
+	IOMUXC_SW_PAD_CTL_PAD_GPIO_EMC_29 = FLEXSPI_PAD_DATA;
+
+	// ALT8 is FlexSPI2 port A, with the input path forced on
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_23 = 8 | 0x10; // DQS
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_24 = 8 | 0x10; // SS0_B
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_25 = 8 | 0x10; // SCLK
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_26 = 8 | 0x10; // DATA0
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_27 = 8 | 0x10; // DATA1
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_28 = 8 | 0x10; // DATA2
+	IOMUXC_SW_MUX_CTL_PAD_GPIO_EMC_29 = 8 | 0x10; // DATA3
+
+	IOMUXC_FLEXSPI2_IPP_IND_DQS_FA_SELECT_INPUT = 1;
+	IOMUXC_FLEXSPI2_IPP_IND_IO_FA_BIT0_SELECT_INPUT = 1;
+	IOMUXC_FLEXSPI2_IPP_IND_IO_FA_BIT1_SELECT_INPUT = 1;
+	IOMUXC_FLEXSPI2_IPP_IND_IO_FA_BIT2_SELECT_INPUT = 1;
+	IOMUXC_FLEXSPI2_IPP_IND_IO_FA_BIT3_SELECT_INPUT = 1;
+	IOMUXC_FLEXSPI2_IPP_IND_SCK_FA_SELECT_INPUT = 1;
+}
+
+
+
+/** Set up FlexSPI2 for IP reads with one read sequence.
+ * This replaces the Teensy startup code's PSRAM setup, so EXTMEM
+ * can not be used by the sketch.
+ */
+static void
+flexspi_begin(
+	const quad_read_t * const read
+)
+{
+	// the root clock can only be changed with the module
+	// disabled and its clock gated off
+	FLEXSPI2_MCR0 |= FLEXSPI_MCR0_MDIS;
+	CCM_CCGR7 &= ~CCM_CCGR7_FLEXSPI2(CCM_CCGR_ON);
+	CCM_CBCMR = (CCM_CBCMR & ~(CCM_CBCMR_FLEXSPI2_PODF_MASK | CCM_CBCMR_FLEXSPI2_CLK_SEL_MASK))
+		| CCM_CBCMR_FLEXSPI2_PODF(FLEXSPI_CLK_PODF)
+		| CCM_CBCMR_FLEXSPI2_CLK_SEL(FLEXSPI_CLK_SEL);
+	CCM_CCGR7 |= CCM_CCGR7_FLEXSPI2(CCM_CCGR_ON);
+
+	flexspi_pins_mux();
+
+	// read data is sampled with the clock looped back from DQS
+	FLEXSPI2_MCR0 = FLEXSPI_MCR0_AHBGRANTWAIT(0xFF)
+		| FLEXSPI_MCR0_IPGRANTWAIT(0xFF)
+		| FLEXSPI_MCR0_RXCLKSRC(1)
+		| FLEXSPI_MCR0_MDIS;
+	FLEXSPI2_MCR1 = FLEXSPI_MCR1_SEQWAIT(0xFFFF) | FLEXSPI_MCR1_AHBBUSWAIT(0xFFFF);
+
+	// only A1 (SS0) is used; its size is in KB
+	FLEXSPI2_FLSHA1CR0 = spi_chip.size >> 10;
+	FLEXSPI2_FLSHA2CR0 = 0;
+	FLEXSPI2_FLSHB1CR0 = 0;
+	FLEXSPI2_FLSHB2CR0 = 0;
+	FLEXSPI2_FLSHA1CR1 = FLEXSPI_FLSHCR1_CSINTERVAL(2)
+		| FLEXSPI_FLSHCR1_TCSH(3)
+		| FLEXSPI_FLSHCR1_TCSS(3);
+
+	FLEXSPI2_MCR0 &= ~FLEXSPI_MCR0_MDIS;
+	FLEXSPI2_MCR0 |= FLEXSPI_MCR0_SWRESET;
+	while (FLEXSPI2_MCR0 & FLEXSPI_MCR0_SWRESET)
+		;
+
+	volatile uint32_t * const lut = &FLEXSPI2_LUT0 + 4 * FLEXSPI_SEQ_READ;
+
+	FLEXSPI2_LUTKEY = FLEXSPI_LUTKEY_VALUE;
+	FLEXSPI2_LUTCR = FLEXSPI_LUTCR_UNLOCK;
+
+	lut[0] = FLEXSPI_LUT0(FLEXSPI_LUT_OPCODE_CMD_SDR, FLEXSPI_LUT_NUM_PADS_1, read->opcode)
+		| FLEXSPI_LUT1(FLEXSPI_LUT_OPCODE_RADDR_SDR, read->addr_pads, read->addr_bits);
+
+	if (read->mode_clocks)
+	{
+		// mode bits of 0 so that the chip does not stay in
+		// continuous read mode after the command
+		lut[1] = FLEXSPI_LUT0(FLEXSPI_LUT_OPCODE_MODE8_SDR, read->addr_pads, 0x00)
+			| FLEXSPI_LUT1(FLEXSPI_LUT_OPCODE_DUMMY_SDR, read->data_pads, read->dummy);
+		lut[2] = FLEXSPI_LUT0(FLEXSPI_LUT_OPCODE_READ_SDR, read->data_pads, 1);
+	} else {
+		lut[1] = FLEXSPI_LUT0(FLEXSPI_LUT_OPCODE_DUMMY_SDR, read->data_pads, read->dummy)
+			| FLEXSPI_LUT1(FLEXSPI_LUT_OPCODE_READ_SDR, read->data_pads, 1);
+		lut[2] = 0;
+	}
+	lut[3] = 0;
+
+	FLEXSPI2_LUTKEY = FLEXSPI_LUTKEY_VALUE;
+	FLEXSPI2_LUTCR = FLEXSPI_LUTCR_LOCK;
+}
+
+
+/** Copy n bytes out of the top of the IP RX FIFO */
+static void
+flexspi_rx_copy(
+	uint8_t * buf,
+	uint32_t n
+)
+{
+	volatile uint32_t * const fifo = &FLEXSPI2_RFDR0;
+
+	for (uint32_t i = 0 ; i < n ; i += 4)
+	{
+		const uint32_t w = fifo[i / 4];
+		memcpy(buf + i, &w, n - i < 4 ? n - i : 4);
+	}
+}
+
+
+/** Read len bytes (at most 64K) with one IP command.
+ * \return 0, or -1 if FlexSPI2 flagged an error or timed out.
+ */
+static int
+flexspi_read(
+	uint32_t addr,
+	uint8_t * buf,
+	uint32_t len
+)
+{
+	const uint32_t start = millis();
+	uint32_t off = 0;
+
+	FLEXSPI2_IPRXFCR = FLEXSPI_IPRXFCR_CLRIPRXF
+		| FLEXSPI_IPRXFCR_RXWMRK(FLEXSPI_RX_WATERMARK / 8 - 1);
+	FLEXSPI2_INTR = FLEXSPI_INTR_IPCMDDONE | FLEXSPI_INTR_IPCMDERR | FLEXSPI_INTR_IPRXWA;
+
+	FLEXSPI2_IPCR0 = addr;
+	FLEXSPI2_IPCR1 = FLEXSPI_IPCR1_ISEQID(FLEXSPI_SEQ_READ) | FLEXSPI_IPCR1_IDATSZ(len);
+	FLEXSPI2_IPCMD = FLEXSPI_IPCMD_TRG;
+
+	while (off < len)
+	{
+		const uint32_t intr = FLEXSPI2_INTR;
+
+		if (intr & FLEXSPI_INTR_IPCMDERR)
+			break;
+
+		if (millis() - start > FLEXSPI_TIMEOUT_MS)
+			break;
+
+		if (intr & FLEXSPI_INTR_IPRXWA)
+		{
+			const uint32_t n = len - off < FLEXSPI_RX_WATERMARK
+				? len - off : FLEXSPI_RX_WATERMARK;
+			flexspi_rx_copy(buf + off, n);
+			off += n;
+
+			// pop the watermark's worth of data
+			FLEXSPI2_INTR = FLEXSPI_INTR_IPRXWA;
+			continue;
+		}
+
+		// once the command is done, anything below the
+		// watermark is the tail of the read
+		if (intr & FLEXSPI_INTR_IPCMDDONE)
+		{
+			flexspi_rx_copy(buf + off, len - off);
+			off = len;
+		}
+	}
+
+	while (!(FLEXSPI2_INTR & FLEXSPI_INTR_IPCMDDONE))
+	{
+		if (millis() - start > FLEXSPI_TIMEOUT_MS)
+			break;
+	}
+
+	const uint32_t intr = FLEXSPI2_INTR;
+	FLEXSPI2_INTR = FLEXSPI_INTR_IPCMDDONE | FLEXSPI_INTR_IPCMDERR | FLEXSPI_INTR_IPRXWA;
+
+	if (off < len || (intr & FLEXSPI_INTR_IPCMDERR))
+		return -1;
+	return 0;
+}
+
+
+static void
+quad_dump(
+	uint32_t start,
+	uint32_t len,
+	uint8_t mode
+)
+{
+	static uint8_t buf[QUAD_CHUNK_SIZE];
+	uint8_t check[QUAD_CHECK_SIZE];
+	quad_read_t read;
+
+	spi_chip_detect();
+
+	// FlexSPI2 only knows the 4-byte opcodes, not 4-byte mode or
+	// the bank register, which are put back to 3-byte addresses
+	// when LPSPI lets go of the bus
+	const bool addr4 = spi_chip.addr_method == SPI_ADDR_METHOD_4OP;
+
+	if (len == 0 || start >= spi_chip.size || len > spi_chip.size - start
+	|| (!addr4 && start + len > SPI_BANK_SIZE)
+	|| quad_read_select(&read, mode, addr4) < 0)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	const uint32_t check_len = len < sizeof(check) ? len : sizeof(check);
+
+	spi_bus_claim();
+	spi_read_bulk(start, check, check_len);
+	const int qe = quad_enable(mode);
+	spi_bus_release();
+
+	if (qe == -2)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	// hand CS#, SCLK and SI over to FlexSPI2
+	spi_bus_tristate();
+	pinMode(SPI_SCLK, INPUT);
+	pinMode(SPI_MOSI, INPUT);
+	flexspi_begin(&read);
+
+	// if IO2 and IO3 are not wired, or the QE bit is not set,
+	// this is where it shows up
+	if (flexspi_read(start, buf, check_len) < 0
+	|| memcmp(buf, check, check_len) != 0)
+	{
+		flexspi_end();
+		quad_restore(qe);
+		Serial.print("!\r\n");
+		return;
+	}
+
+	Serial.print("Q ");
+	Serial.print(start, HEX);
+	Serial.print(' ');
+	Serial.print(len, HEX);
+	Serial.print("\r\n");
+
+	uint32_t crc = 0;
+	bool failed = false;
+
+	while (len)
+	{
+		const uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+		if (flexspi_read(start, buf, n) < 0)
+			failed = true;
+
+		Serial.write(buf, n);
+		crc = crc32_update(crc, buf, n);
+
+		start += n;
+		len -= n;
+	}
+
+	flexspi_end();
+
+	// the length has been promised, so a failed read is still
+	// sent, but with a CRC that will not match.  so is a QE bit
+	// that could not be put back.
+	if (quad_restore(qe) < 0)
+		failed = true;
+	if (failed)
+		crc = ~crc;
+
+	Serial.write((const uint8_t*) &crc, sizeof(crc));
+	Serial.send_now();
+}
+
+#else
+
+static void
+quad_dump(
+	uint32_t start,
+	uint32_t len,
+	uint8_t mode
+)
+{
+	(void) start;
+	(void) len;
+	(void) mode;
+
+	// no FlexSPI on this board, or not built with CONFIG_FLEXSPI
+	Serial.print("!\r\n");
+}
+
+#endif
+
+
+void
+quad_dump_interactive(void)
+{
+	const uint32_t start = usb_serial_readhex();
+	const uint32_t len = usb_serial_readhex();
+	uint8_t mode = QUAD_MODE_114;
+
+	if (usb_serial_term == ' ')
+		mode = usb_serial_readhex();
+
+	quad_dump(start, len, mode);
+}
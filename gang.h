@@ -0,0 +1,21 @@
+/** \file
+ * Gang programming: one upload written to several chips of the same
+ * type, each with its own chip select on the shared SPI bus.
+ *
+ * The image is sent once, one 4K sector at a time.  Each chip erases
+ * and programs the sector as its own little state machine, and the
+ * scheduler goes round them issuing the next erase or page program to
+ * whichever chip is idle, so that one chip's erase overlaps the other
+ * chips' page programs and the host sending the next sector.  Every
+ * sector is read back and checked on every chip.
+ */
+#ifndef _gang_h_
+#define _gang_h_
+
+/** Parse "ADDR LEN" and run a gang upload on every chip that has the
+ * same RDID as chip 0, then report the status of each.
+ */
+void
+gang_upload(void);
+
+#endif
@@ -0,0 +1,313 @@
+/**
+ * \file Gang programming
+ *
+ * See gang.h.  The chips are assumed to be the same part, so they all
+ * share the descriptor probed from chip 0.
+ */
+
+#include "gang.h"
+
+enum {
+	GANG_START, // erase not issued yet
+	GANG_BUSY, // erase or page program running
+	GANG_DONE, // sector finished
+};
+
+typedef struct
+{
+	bool present; // answered RDID with the same id as chip 0
+	bool failed; // timed out, and left alone for the rest of the upload
+	bool retried; // this sector has been erased and written again
+	uint8_t state;
+	uint16_t page; // offset of the next page to program
+	uint32_t start_ms;
+	uint32_t timeout_ms;
+
+	uint32_t sectors; // checked and correct
+	uint32_t bad; // still wrong after a retry
+	uint32_t bad_addr; // first bad sector, or where it timed out
+} gang_chip_t;
+
+static gang_chip_t gang_chips[SPI_CS_COUNT];
+
+
+/** Move one chip through a sector as far as it can go without waiting.
+ * \return true once the chip is finished with the sector.
+ */
+static bool
+gang_step(
+	uint8_t n,
+	uint32_t addr,
+	const uint8_t * const buf,
+	uint16_t mask,
+	uint32_t crc
+)
+{
+	gang_chip_t * const g = &gang_chips[n];
+	if (g->state == GANG_DONE)
+		return true;
+
+	spi_cs_select(n);
+
+	if (g->state == GANG_BUSY && (spi_status() & SPI_WIP))
+	{
+		if (millis() - g->start_ms <= g->timeout_ms)
+			return false;
+
+		g->failed = true;
+		g->bad_addr = addr;
+		g->state = GANG_DONE;
+		return true;
+	}
+
+	if (g->state == GANG_START)
+	{
+		const spi_erase_type_t * const erase = spi_sector_erase_type();
+
+		spi_addr_prepare(addr);
+		spi_write_enable_fast();
+		spi_cs(1);
+		spi_erase_command(addr, erase);
+		spi_cs(0);
+
+		g->state = GANG_BUSY;
+		g->page = 0;
+		g->start_ms = millis();
+		g->timeout_ms = erase->timeout_ms;
+		return false;
+	}
+
+	// idle after the erase or a page; find the next page with data
+	const uint16_t page_size = spi_chip.page_size;
+	while (g->page < SPI_PAGE_SIZE)
+	{
+		if (mask & spi_page_mask(g->page, page_size))
+			break;
+		g->page += page_size;
+	}
+
+	if (g->page < SPI_PAGE_SIZE)
+	{
+		const uint32_t page_addr = addr + g->page;
+
+		spi_addr_prepare(page_addr);
+		spi_write_enable_fast();
+		spi_cs(1);
+		spi_write_command(page_addr);
+		SPI.transfer(&buf[g->page], NULL, page_size);
+		spi_cs(0);
+
+		g->page += page_size;
+		g->start_ms = millis();
+		g->timeout_ms = spi_chip.page_timeout_ms;
+		return false;
+	}
+
+	// everything is written; read it back
+	if (spi_region_crc(addr, SPI_PAGE_SIZE, NULL) == crc)
+	{
+		g->sectors++;
+		g->state = GANG_DONE;
+		return true;
+	}
+
+	if (!g->retried)
+	{
+		g->retried = true;
+		g->state = GANG_START;
+		return false;
+	}
+
+	if (g->bad++ == 0)
+		g->bad_addr = addr;
+	g->state = GANG_DONE;
+	return true;
+}
+
+
+/** Probe chip 0 and check that the others are the same part.
+ * \return the number of chips that will be programmed.
+ */
+static uint8_t
+gang_probe(void)
+{
+	uint8_t count = 0;
+
+	spi_cs_select(0);
+	spi_chip_probe();
+
+	for (uint8_t n = 0 ; n < SPI_CS_COUNT ; n++)
+	{
+		gang_chip_t * const g = &gang_chips[n];
+		memset(g, 0, sizeof(*g));
+
+		uint8_t id[3];
+		spi_cs_select(n);
+		spi_cs(1);
+		spi_send(SPI_CMD_RDID);
+		for (uint8_t i = 0 ; i < 3 ; i++)
+			id[i] = spi_send(0);
+		spi_cs(0);
+
+		g->present = spi_chip.valid && memcmp(id, spi_chip.id, sizeof(id)) == 0;
+		if (g->present)
+			count++;
+
+		Serial.print("chip ");
+		Serial.print(n);
+		Serial.print(" id ");
+		for (uint8_t i = 0 ; i < 3 ; i++)
+		{
+			Serial.print(hexdigit(id[i] >> 4));
+			Serial.print(hexdigit(id[i] >> 0));
+		}
+		Serial.println(g->present ? "" : " skipped");
+	}
+
+	return count;
+}
+
+
+static void
+gang_print(void)
+{
+	for (uint8_t n = 0 ; n < SPI_CS_COUNT ; n++)
+	{
+		const gang_chip_t * const g = &gang_chips[n];
+		if (!g->present)
+			continue;
+
+		Serial.print("chip ");
+		Serial.print(n);
+		Serial.print(g->failed ? " timeout" : g->bad ? " bad" : " ok");
+		Serial.print(" sectors: ");
+		Serial.print(g->sectors);
+		Serial.print(" bad: ");
+		Serial.print(g->bad);
+		if (g->failed || g->bad)
+		{
+			Serial.print(" at ");
+			Serial.print(g->bad_addr, HEX);
+		}
+		Serial.print("\r\n");
+	}
+}
+
+
+void
+gang_upload(void)
+{
+	uint32_t addr = usb_serial_readhex();
+	const uint32_t len = usb_serial_readhex();
+	const uint8_t selected = spi_cs_pin;
+
+	spi_bus_claim();
+	const uint8_t count = gang_probe();
+	const uint16_t page_size = spi_chip.page_size;
+
+	const bool fail = count == 0
+		|| ((addr | len) & SPI_PAGE_MASK) != 0
+		|| len == 0 || addr + len > spi_chip.size
+		|| page_size == 0 || page_size > SPI_PAGE_SIZE;
+
+	Serial.print(fail ? "! " : "G ");
+	Serial.print(addr, HEX);
+	Serial.print(' ');
+	Serial.print(len, HEX);
+	Serial.print("\r\n");
+
+	if (fail)
+	{
+		spi_bus_release();
+		return;
+	}
+
+	upload_buf_t * cur = &upload_bufs[0];
+	upload_buf_t * next = &upload_bufs[1];
+	bool rx_timeout = false;
+
+	upload_compressed = false;
+	upload_buf_reset(cur);
+	upload_rx = cur;
+
+	for (uint32_t offset = 0 ; offset < len ; offset += SPI_PAGE_SIZE, addr += SPI_PAGE_SIZE)
+	{
+		upload_rx_wait_begin();
+		while (!upload_buf_done(cur) && !upload_rx_timeout())
+			upload_rx_poll();
+
+		if (!upload_buf_done(cur))
+		{
+			rx_timeout = true;
+			break;
+		}
+
+		if (offset + SPI_PAGE_SIZE < len)
+		{
+			upload_buf_reset(next);
+			upload_rx = next;
+		} else {
+			upload_rx = NULL;
+		}
+
+		const uint8_t * const buf = cur->data;
+		const uint16_t mask = spi_chunk_mask_used(buf);
+		const uint32_t crc = crc32_update(0, buf, SPI_PAGE_SIZE);
+		uint32_t bad_before = 0;
+
+		for (uint8_t n = 0 ; n < SPI_CS_COUNT ; n++)
+		{
+			gang_chip_t * const g = &gang_chips[n];
+			g->state = g->present && !g->failed ? GANG_START : GANG_DONE;
+			g->retried = false;
+			bad_before += g->bad + g->failed;
+		}
+
+		// go round the chips until they have all finished this
+		// sector, taking in the next one from the host meanwhile
+		while (1)
+		{
+			bool busy = false;
+			for (uint8_t n = 0 ; n < SPI_CS_COUNT ; n++)
+				if (!gang_step(n, addr, buf, mask, crc))
+					busy = true;
+
+			upload_rx_poll();
+			if (!busy)
+				break;
+		}
+
+		uint32_t bad_after = 0;
+		for (uint8_t n = 0 ; n < SPI_CS_COUNT ; n++)
+			bad_after += gang_chips[n].bad + gang_chips[n].failed;
+
+		Serial.print(bad_after != bad_before ? 'x' : mask ? 'w' : 'e');
+		if ((addr & ((64 * SPI_PAGE_SIZE) - 1)) == (63 * SPI_PAGE_SIZE))
+			Serial.print("\r\n");
+
+		upload_buf_t * const tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	upload_rx = NULL;
+
+	// back to the chip that was selected before, which
+	// needs probing again if it was not chip 0
+	for (uint8_t n = 0 ; n < SPI_CS_COUNT ; n++)
+		if (spi_cs_pins[n] == selected)
+			spi_cs_select(n);
+	if (selected != spi_cs_pins[0])
+		spi_chip.valid = 0;
+
+	spi_bus_release();
+
+	if (rx_timeout)
+	{
+		Serial.print("\r\nrx timeout\r\n");
+		return;
+	}
+
+	Serial.print("\r\n");
+	gang_print();
+}
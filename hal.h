@@ -0,0 +1,31 @@
+/** \file
+ * Hardware access for the sketch.
+ *
+ * Everything the sketch does to the outside world goes through this
+ * short list of Teensyduino calls, and nothing else:
+ *
+ *   SPI     begin, end, beginTransaction, endTransaction, transfer
+ *   Serial  begin, read, readBytes, available, write, print, println,
+ *           flush, send_now, dtr
+ *   pins    pinMode, digitalWrite, digitalWriteFast (the chip selects)
+ *   time    millis, micros, delay, delayMicroseconds and the
+ *           ARM_DWT_CYCCNT cycle counter
+ *
+ * On the Teensy they come from the core library.  The host build
+ * (SPIFLASH_HOST) gets them from host/sim/arduino.h instead, which
+ * passes them on to a hal_bus_t, hal_link_t and hal_clock_t, so that
+ * the sketch can run unchanged against simulated hardware.  Anything
+ * new that touches the hardware should stick to this list, or add to
+ * both sides.
+ */
+#ifndef _hal_h_
+#define _hal_h_
+
+#ifdef SPIFLASH_HOST
+#include "host/sim/arduino.h"
+#else
+#include <Arduino.h>
+#include <SPI.h>
+#endif
+
+#endif
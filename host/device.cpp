@@ -0,0 +1,456 @@
+/**
+ * \file Binary command and stream protocol client
+ */
+
+#include "device.h"
+#include "crc.h"
+#include "lz.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+bool Progress::quiet;
+
+
+Progress::Progress(
+	const char * const what,
+	uint64_t total
+) :
+	what(what),
+	total(total),
+	start_ms(now_ms())
+{
+}
+
+
+void
+Progress::update(
+	uint64_t new_done
+)
+{
+	done = new_done;
+	if (quiet)
+		return;
+
+	const uint64_t now = now_ms();
+	if (now - last_ms < 250 && done < total)
+		return;
+	last_ms = now;
+
+	const uint64_t ms = now - start_ms;
+	const double kbps = ms ? done / 1.024 / ms : 0;
+
+	fprintf(stderr, "\r%s: %3u%% %llu/%llu bytes %.0f KB/s",
+		what,
+		total ? (unsigned)(done * 100 / total) : 100,
+		(unsigned long long) done,
+		(unsigned long long) total,
+		kbps
+	);
+
+	if (kbps > 0 && done < total)
+		fprintf(stderr, " %us left  ",
+			(unsigned)((total - done) / 1024 / kbps));
+	else
+		fprintf(stderr, "           ");
+}
+
+
+void
+Progress::finish()
+{
+	if (quiet)
+		return;
+
+	last_ms = 0;
+	update(done);
+	fprintf(stderr, " %.1fs\n", (now_ms() - start_ms) / 1000.0);
+}
+
+
+const char *
+bincmd_status_name(
+	int status
+)
+{
+	switch (status)
+	{
+	case BINCMD_OK: return "ok";
+	case BINCMD_ERR_OP: return "unknown opcode";
+	case BINCMD_ERR_RANGE: return "bad range";
+	case BINCMD_ERR_FLASH: return "flash timeout";
+	case BINCMD_ERR_RX: return "data did not arrive";
+	case BINCMD_ERR_WP: return "write protected";
+	case BINCMD_ERR_SKIPPED: return "skipped";
+	default: return "no reply";
+	}
+}
+
+
+int
+Device::enter()
+{
+	for (int tries = 0 ; tries < 3 ; tries++)
+	{
+		// a CR finishes anything half typed at the menu
+		port.send("\r", 1);
+		port.drain(100);
+
+		const uint8_t magic = BINCMD_MAGIC;
+		port.send(&magic, 1);
+
+		bincmd_reply_t r;
+		if (reply(&r, 2000) < 0)
+			continue;
+		if (r.op != BINCMD_PING || r.value != BINCMD_VERSION)
+		{
+			fprintf(stderr, "device speaks binary version %u\n",
+				(unsigned) r.value);
+			return -1;
+		}
+
+		in_binary = true;
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int
+Device::exit()
+{
+	if (!in_binary)
+		return 0;
+
+	bincmd_reply_t r;
+	const int rc = request(BINCMD_EXIT, 0, 0, 0, &r);
+	in_binary = false;
+
+	// the menu prompt follows
+	port.drain(50);
+	return rc == BINCMD_OK ? 0 : -1;
+}
+
+
+void
+Device::queue(
+	uint8_t op,
+	uint16_t flags,
+	uint32_t addr,
+	uint32_t len,
+	const void * const data
+)
+{
+	bincmd_req_t req;
+	req.magic = BINCMD_MAGIC;
+	req.op = op;
+	req.flags = flags;
+	req.addr = addr;
+	req.len = len;
+
+	port.send(&req, sizeof(req));
+	if (data)
+		port.send(data, len);
+}
+
+
+int
+Device::reply(
+	bincmd_reply_t * const r,
+	int timeout_ms
+)
+{
+	const uint64_t end = now_ms() + timeout_ms;
+
+	while (1)
+	{
+		// anything before the reply magic is junk from the menu
+		while (port.available() && port.data()[0] != BINCMD_REPLY_MAGIC)
+			port.consume(1);
+
+		if (port.available() >= sizeof(*r))
+			break;
+
+		const int64_t left = end - now_ms();
+		if (left <= 0 || port.pump(left) < 0)
+			return -1;
+	}
+
+	memcpy(r, port.data(), sizeof(*r));
+	port.consume(sizeof(*r));
+	return 0;
+}
+
+
+int
+Device::request(
+	uint8_t op,
+	uint16_t flags,
+	uint32_t addr,
+	uint32_t len,
+	bincmd_reply_t * const r
+)
+{
+	queue(op, flags, addr, len);
+	if (reply(r) < 0)
+		return -1;
+	if (r->op != op)
+		return -1;
+	return r->status;
+}
+
+
+int
+Device::hash_table(
+	uint32_t addr,
+	uint32_t len,
+	std::vector<uint32_t> & crcs
+)
+{
+	bincmd_reply_t r;
+	const int rc = request(BINCMD_HASH, BINCMD_FLAG_TABLE, addr, len, &r);
+	if (rc != BINCMD_OK)
+	{
+		fprintf(stderr, "hash %08x+%x: %s\n", addr, len,
+			bincmd_status_name(rc));
+		return -1;
+	}
+
+	// a table for some other range would be compared sector by
+	// sector against the wrong data
+	if (r.value != len / HOST_SECTOR_SIZE)
+	{
+		fprintf(stderr, "hash %08x+%x: %u sectors, expected %u\n",
+			addr, len, r.value, len / HOST_SECTOR_SIZE);
+		return -1;
+	}
+
+	// each sector takes a flash read, so allow for large ranges
+	crcs.resize(r.value);
+	const int timeout_ms = HOST_REPLY_TIMEOUT_MS + r.value;
+	if (port.read(crcs.data(), r.value * sizeof(uint32_t), timeout_ms) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+/** Expand one checked frame into its place in the output */
+static int
+stream_expand(
+	const stream_header_t * const hdr,
+	const uint8_t * const data,
+	uint8_t * const out,
+	uint32_t frame_len
+)
+{
+	if (hdr->type == STREAM_DATA)
+	{
+		if (hdr->len != frame_len)
+			return -1;
+		memcpy(out, data, frame_len);
+		return 0;
+	}
+
+	if (hdr->type == STREAM_FILL)
+	{
+		if (hdr->len != 1)
+			return -1;
+		memset(out, data[0], frame_len);
+		return 0;
+	}
+
+	// STREAM_LZ
+	lz_decoder_t d;
+	int out_len = 0;
+	lz_decode_init(&d);
+
+	for (uint16_t i = 0 ; i < hdr->len ; i++)
+	{
+		out_len = lz_decode(&d, data[i], out, out_len, frame_len);
+		if (out_len < 0)
+			return -1;
+	}
+
+	return (uint32_t) out_len == frame_len ? 0 : -1;
+}
+
+
+static void
+stream_reply(
+	SerialPort & port,
+	uint8_t type,
+	uint32_t seq
+)
+{
+	uint8_t buf[5] = { type };
+	memcpy(&buf[1], &seq, sizeof(seq));
+	port.send(buf, sizeof(buf));
+}
+
+
+int
+Device::stream(
+	uint32_t addr,
+	uint32_t len,
+	uint8_t window,
+	uint8_t flags,
+	std::vector<uint8_t> & out,
+	Progress & progress
+)
+{
+	const uint32_t frames = (len + STREAM_FRAME_SIZE - 1) / STREAM_FRAME_SIZE;
+	std::vector<bool> have(frames);
+	uint32_t base = 0; // first frame not yet received
+	uint32_t nak_next = 0; // frames before this have been asked for
+	uint64_t last_heard = now_ms();
+
+	out.assign(len, 0);
+	wire_bytes = 0;
+	resent = 0;
+
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "F%x %x %x %x\r", addr, len, window, flags);
+	port.drain(50);
+	port.send(cmd, strlen(cmd));
+
+	while (1)
+	{
+		if (port.pump(100) < 0)
+			return -1;
+
+		// the device resends on its own after a second of silence,
+		// so only give up once that has clearly not happened
+		if (port.available())
+			last_heard = now_ms();
+		else
+		if (now_ms() - last_heard > 5 * STREAM_TIMEOUT_MS)
+		{
+			fprintf(stderr, "\nstream: no data from the device\n");
+			return -1;
+		}
+
+		while (1)
+		{
+			// resync on the magic byte; the command echo comes first
+			while (port.available() && port.data()[0] != STREAM_MAGIC)
+				port.consume(1);
+
+			stream_header_t hdr;
+			if (port.available() < sizeof(hdr))
+				break;
+			memcpy(&hdr, port.data(), sizeof(hdr));
+
+			const bool known = hdr.type == STREAM_DATA
+				|| hdr.type == STREAM_FILL
+				|| hdr.type == STREAM_LZ
+				|| hdr.type == STREAM_END;
+			if (!known || hdr.len > STREAM_FRAME_SIZE)
+			{
+				port.consume(1);
+				continue;
+			}
+
+			const size_t frame_size = sizeof(hdr) + hdr.len + sizeof(uint32_t);
+			if (port.available() < frame_size)
+				break;
+
+			const uint8_t * const p = port.data();
+			uint32_t crc;
+			memcpy(&crc, p + sizeof(hdr) + hdr.len, sizeof(crc));
+			if (crc32_update(0, p, sizeof(hdr) + hdr.len) != crc)
+			{
+				// the header may be bad too, so ask for the oldest
+				// missing frame rather than the one it claims to be
+				port.consume(1);
+				if (base < frames)
+					stream_reply(port, STREAM_NAK, base);
+				resent++;
+				continue;
+			}
+
+			wire_bytes += frame_size;
+			const uint8_t * const data = p + sizeof(hdr);
+
+			if (hdr.type == STREAM_END)
+			{
+				if (hdr.seq != frames || base != frames || hdr.len != 4)
+				{
+					port.consume(frame_size);
+					continue;
+				}
+
+				uint32_t range_crc;
+				memcpy(&range_crc, data, sizeof(range_crc));
+				port.consume(frame_size);
+
+				stream_reply(port, STREAM_ACK, frames + 1);
+				port.drain(50);
+				progress.finish();
+
+				if (crc32_update(0, out.data(), len) != range_crc)
+				{
+					fprintf(stderr, "stream: range CRC mismatch\n");
+					return -1;
+				}
+				return 0;
+			}
+
+			const uint32_t seq = hdr.seq;
+			const uint32_t offset = seq * STREAM_FRAME_SIZE;
+			if (seq >= frames
+			||  hdr.addr != addr + offset)
+			{
+				port.consume(frame_size);
+				continue;
+			}
+
+			if (have[seq])
+			{
+				// a resend of something that already arrived
+				port.consume(frame_size);
+				continue;
+			}
+
+			uint32_t frame_len = len - offset;
+			if (frame_len > STREAM_FRAME_SIZE)
+				frame_len = STREAM_FRAME_SIZE;
+
+			if (stream_expand(&hdr, data, &out[offset], frame_len) < 0)
+			{
+				port.consume(frame_size);
+				stream_reply(port, STREAM_NAK, seq);
+				resent++;
+				continue;
+			}
+
+			port.consume(frame_size);
+			have[seq] = true;
+
+			// anything skipped over was lost on the way
+			if (nak_next < base)
+				nak_next = base;
+			for ( ; nak_next < seq ; nak_next++)
+			{
+				if (have[nak_next])
+					continue;
+				stream_reply(port, STREAM_NAK, nak_next);
+				resent++;
+			}
+			if (nak_next == seq)
+				nak_next++;
+
+			const uint32_t old_base = base;
+			while (base < frames && have[base])
+				base++;
+			if (base != old_base)
+			{
+				stream_reply(port, STREAM_ACK, base);
+				progress.update((uint64_t) base * STREAM_FRAME_SIZE > len
+					? len : (uint64_t) base * STREAM_FRAME_SIZE);
+			}
+		}
+	}
+}
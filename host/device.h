@@ -0,0 +1,113 @@
+/** \file
+ * Host side of the binary command and stream protocols.
+ *
+ * Requests can be queued ahead of their replies: the serial port
+ * keeps sending while the device works on the earlier ones, and the
+ * replies are matched up in order as they arrive.
+ */
+#ifndef _host_device_h_
+#define _host_device_h_
+
+#include "serial.h"
+#include "bincmd.h"
+#include "stream.h"
+
+#include <string>
+#include <vector>
+
+#define HOST_SECTOR_SIZE	4096
+#define HOST_REPLY_TIMEOUT_MS	30000
+
+
+/** Rate and percentage on stderr, at most a few times a second */
+class Progress
+{
+public:
+	Progress(const char * what, uint64_t total);
+	void update(uint64_t done);
+	void finish();
+
+	/** Set to keep stderr quiet, as the benchmarks do */
+	static bool quiet;
+
+private:
+	const char * what;
+	uint64_t total;
+	uint64_t start_ms;
+	uint64_t last_ms = 0;
+	uint64_t done = 0;
+};
+
+
+class Device
+{
+public:
+	Device(SerialPort & port) : port(port) {}
+
+	/** Switch to binary mode and wait for the PING reply.
+	 * \return 0 or -1.
+	 */
+	int enter();
+
+	/** Back to the text menu */
+	int exit();
+
+	bool binary() const { return in_binary; }
+
+	/** Queue a request, and any data that goes with it */
+	void queue(
+		uint8_t op,
+		uint16_t flags,
+		uint32_t addr,
+		uint32_t len,
+		const void * data = NULL
+	);
+
+	/** Wait for the next reply.
+	 * \return 0 or -1 on a timeout or lost port.
+	 */
+	int reply(bincmd_reply_t * r, int timeout_ms = HOST_REPLY_TIMEOUT_MS);
+
+	/** Queue one request and wait for its reply.
+	 * \return the reply status, or -1.
+	 */
+	int request(
+		uint8_t op,
+		uint16_t flags,
+		uint32_t addr,
+		uint32_t len,
+		bincmd_reply_t * r
+	);
+
+	/** CRC-32 of every 4K sector of a range */
+	int hash_table(uint32_t addr, uint32_t len, std::vector<uint32_t> & crcs);
+
+	/** Read a range with the windowed stream protocol.
+	 * \return 0, or -1 if it could not be read or the range CRC
+	 * did not match.
+	 */
+	int stream(
+		uint32_t addr,
+		uint32_t len,
+		uint8_t window,
+		uint8_t flags,
+		std::vector<uint8_t> & out,
+		Progress & progress
+	);
+
+	/** Stream statistics from the last stream() */
+	uint64_t wire_bytes = 0;
+	uint32_t resent = 0;
+
+	SerialPort & port;
+
+private:
+	bool in_binary = false;
+};
+
+
+/** Printable name of a reply status */
+const char *
+bincmd_status_name(int status);
+
+#endif
@@ -0,0 +1,326 @@
+/**
+ * \file Delta flashing
+ *
+ * The device's table of sector CRCs says which sectors need to be
+ * written.  They are grouped into runs that do not cross a 64K block,
+ * so that the device can use block erases, and each run is sent as an
+ * erase and a program request with several runs queued ahead of
+ * their replies.  Afterwards the table is fetched again to check
+ * them, which also makes an interrupted write resume where it left
+ * off the next time it is run.
+ */
+
+#include "flash.h"
+#include "crc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct
+{
+	uint32_t first; // sector within the image
+	uint32_t count;
+} run_t;
+
+
+int
+flash_diff(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	std::vector<uint32_t> & dirty
+)
+{
+	std::vector<uint32_t> remote;
+	if (dev.hash_table(addr, image.size(), remote) < 0)
+		return -1;
+	if (remote.size() != image.size() / HOST_SECTOR_SIZE)
+		return -1;
+
+	dirty.clear();
+	for (uint32_t i = 0 ; i < remote.size() ; i++)
+	{
+		const uint32_t crc = crc32_update(0,
+			&image[i * HOST_SECTOR_SIZE], HOST_SECTOR_SIZE);
+		if (crc != remote[i])
+			dirty.push_back(i);
+	}
+
+	return 0;
+}
+
+
+/** Group the sectors into runs that do not cross a 64K block */
+static std::vector<run_t>
+flash_runs(
+	uint32_t addr,
+	const std::vector<uint32_t> & dirty
+)
+{
+	std::vector<run_t> runs;
+	const uint32_t first_sector = addr / HOST_SECTOR_SIZE;
+
+	for (uint32_t sector : dirty)
+	{
+		if (!runs.empty())
+		{
+			run_t & run = runs.back();
+			const uint32_t next = run.first + run.count;
+			if (next == sector
+			&&  run.count < FLASH_RUN_SECTORS
+			&&  (first_sector + next) % FLASH_RUN_SECTORS != 0)
+			{
+				run.count++;
+				continue;
+			}
+		}
+
+		runs.push_back({ sector, 1 });
+	}
+
+	return runs;
+}
+
+
+/** After a failure, throw away what was queued and get back in step */
+static int
+flash_resync(
+	Device & dev
+)
+{
+	bincmd_reply_t r;
+
+	dev.port.cancel();
+	dev.port.drain(300);
+	return dev.request(BINCMD_PING, 0, 0, 0, &r) == BINCMD_OK ? 0 : -1;
+}
+
+
+static uint64_t
+flash_run_bytes(
+	const std::vector<run_t> & runs,
+	size_t first,
+	size_t last
+)
+{
+	uint64_t bytes = 0;
+	for (size_t i = first ; i < last ; i++)
+		bytes += runs[i].count * HOST_SECTOR_SIZE;
+	return bytes;
+}
+
+
+/** Erase and program the runs, with up to FLASH_PIPELINE of them in flight.
+ * \return 0, 1 if a run failed and the device is ready for more,
+ * or -1 if it has stopped answering.
+ */
+static int
+flash_program(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	const std::vector<run_t> & runs
+)
+{
+	Progress progress("write", flash_run_bytes(runs, 0, runs.size()));
+	size_t sent = 0;
+	size_t done = 0;
+	bool erased = false; // the erase of runs[done] has been answered
+
+	while (done < runs.size())
+	{
+		while (sent < runs.size() && sent - done < FLASH_PIPELINE)
+		{
+			const run_t & run = runs[sent++];
+			const uint32_t offset = run.first * HOST_SECTOR_SIZE;
+			const uint32_t len = run.count * HOST_SECTOR_SIZE;
+
+			dev.queue(BINCMD_ERASE, 0, addr + offset, len);
+			dev.queue(BINCMD_PROGRAM, 0, addr + offset, len, &image[offset]);
+		}
+
+		bincmd_reply_t r;
+		const run_t & run = runs[done];
+		const uint32_t run_addr = addr + run.first * HOST_SECTOR_SIZE;
+		const uint8_t op = erased ? BINCMD_PROGRAM : BINCMD_ERASE;
+
+		if (dev.reply(&r) < 0)
+		{
+			fprintf(stderr, "\n%08x: no reply\n", run_addr);
+			return -1;
+		}
+
+		if (r.op != op || r.addr != run_addr)
+		{
+			fprintf(stderr, "\n%08x: out of step\n", run_addr);
+			return flash_resync(dev) < 0 ? -1 : 1;
+		}
+
+		if (r.status != BINCMD_OK)
+		{
+			fprintf(stderr, "\n%08x: %s failed: %s\n",
+				run_addr,
+				op == BINCMD_ERASE ? "erase" : "program",
+				bincmd_status_name(r.status));
+			return flash_resync(dev) < 0 ? -1 : 1;
+		}
+
+		if (!erased)
+		{
+			erased = true;
+			continue;
+		}
+
+		erased = false;
+		done++;
+		progress.update(flash_run_bytes(runs, 0, done));
+	}
+
+	progress.finish();
+	return 0;
+}
+
+
+/** Queue up to FLASH_BATCH_RUNS runs as one BINCMD_BATCH.
+ * \return the number of runs in it.
+ */
+static size_t
+flash_batch_queue(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	const std::vector<run_t> & runs,
+	size_t first
+)
+{
+	size_t count = runs.size() - first;
+	if (count > FLASH_BATCH_RUNS)
+		count = FLASH_BATCH_RUNS;
+
+	dev.queue(BINCMD_BATCH, 0, addr + runs[first].first * HOST_SECTOR_SIZE, 2 * count);
+
+	for (size_t i = first ; i < first + count ; i++)
+	{
+		const uint32_t offset = runs[i].first * HOST_SECTOR_SIZE;
+		const uint32_t len = runs[i].count * HOST_SECTOR_SIZE;
+		dev.queue(BINCMD_ERASE, 0, addr + offset, len);
+		dev.queue(BINCMD_PROGRAM, 0, addr + offset, len);
+	}
+
+	for (size_t i = first ; i < first + count ; i++)
+	{
+		const uint32_t offset = runs[i].first * HOST_SECTOR_SIZE;
+		dev.port.send(&image[offset], runs[i].count * HOST_SECTOR_SIZE);
+	}
+
+	return count;
+}
+
+
+/** The same as flash_program(), as BINCMD_BATCH queues with the next
+ * one sent while the device runs the current one.
+ */
+static int
+flash_program_batch(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	const std::vector<run_t> & runs
+)
+{
+	Progress progress("write", flash_run_bytes(runs, 0, runs.size()));
+	std::vector<size_t> in_flight;
+	size_t sent = 0;
+	size_t done = 0;
+
+	while (done < runs.size())
+	{
+		while (sent < runs.size() && in_flight.size() < 2)
+		{
+			const size_t count = flash_batch_queue(dev, addr, image, runs, sent);
+			in_flight.push_back(count);
+			sent += count;
+		}
+
+		const size_t count = in_flight.front();
+		const uint32_t batch_addr = addr + runs[done].first * HOST_SECTOR_SIZE;
+		in_flight.erase(in_flight.begin());
+
+		bincmd_reply_t r;
+		std::vector<bincmd_result_t> results(2 * count);
+		if (dev.reply(&r) < 0
+		||  r.op != BINCMD_BATCH
+		||  dev.port.read(results.data(), results.size() * sizeof(results[0]),
+			HOST_REPLY_TIMEOUT_MS) < 0)
+		{
+			fprintf(stderr, "\n%08x: no batch reply\n", batch_addr);
+			return -1;
+		}
+
+		if (r.status != BINCMD_OK)
+		{
+			const uint32_t failed = r.value ? r.value - 1 : 0;
+			fprintf(stderr, "\n%08x: batch request %u failed: %s\n",
+				batch_addr, failed, bincmd_status_name(r.status));
+			return flash_resync(dev) < 0 ? -1 : 1;
+		}
+
+		done += count;
+		progress.update(flash_run_bytes(runs, 0, done));
+	}
+
+	progress.finish();
+	return 0;
+}
+
+
+int
+flash_write(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	const flash_options_t & options
+)
+{
+	const uint32_t sectors = image.size() / HOST_SECTOR_SIZE;
+	std::vector<uint32_t> dirty;
+
+	for (unsigned pass = 0 ; ; pass++)
+	{
+		if (flash_diff(dev, addr, image, dirty) < 0)
+			return -1;
+
+		if (dirty.empty())
+		{
+			if (!Progress::quiet)
+				fprintf(stderr, pass ? "verified %u sectors\n"
+					: "all %u sectors already match\n", sectors);
+			return 0;
+		}
+
+		if (!Progress::quiet)
+			fprintf(stderr, "%zu of %u sectors differ\n", dirty.size(), sectors);
+
+		if (options.dry_run)
+		{
+			for (uint32_t sector : dirty)
+				printf("%08x\n", addr + sector * HOST_SECTOR_SIZE);
+			return 0;
+		}
+
+		if (pass == FLASH_PASSES)
+			break;
+
+		const std::vector<run_t> runs = flash_runs(addr, dirty);
+		const int rc = options.batch
+			? flash_program_batch(dev, addr, image, runs)
+			: flash_program(dev, addr, image, runs);
+		if (rc < 0)
+			return -1;
+	}
+
+	for (uint32_t sector : dirty)
+		fprintf(stderr, "%08x: bad\n", addr + sector * HOST_SECTOR_SIZE);
+	return -1;
+}
@@ -0,0 +1,44 @@
+/** \file
+ * Delta flashing over the binary command protocol.
+ */
+#ifndef _host_flash_h_
+#define _host_flash_h_
+
+#include "device.h"
+
+#define FLASH_RUN_SECTORS	16 // 64K, so whole blocks get a block erase
+#define FLASH_PIPELINE		4 // runs queued ahead of their replies
+#define FLASH_BATCH_RUNS	8 // erase and program pairs per BINCMD_BATCH
+#define FLASH_PASSES		3
+
+typedef struct
+{
+	bool dry_run; // only print the sectors that differ
+	bool batch; // send the runs as BINCMD_BATCH queues
+} flash_options_t;
+
+
+/** Sectors of the image whose CRC does not match the device's */
+int
+flash_diff(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	std::vector<uint32_t> & dirty
+);
+
+
+/** Program the sectors that differ, then check and retry them.
+ * The image must be a whole number of sectors.
+ * \return 0, or -1 if the device stopped answering or sectors were
+ * still bad after FLASH_PASSES.
+ */
+int
+flash_write(
+	Device & dev,
+	uint32_t addr,
+	const std::vector<uint8_t> & image,
+	const flash_options_t & options
+);
+
+#endif
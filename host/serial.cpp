@@ -0,0 +1,182 @@
+/**
+ * \file Non-blocking serial port
+ *
+ * The Teensy is a USB CDC device, so the baud rate does not matter,
+ * but the tty still has to be put in raw mode.
+ */
+
+#include "serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+uint64_t (*now_ms_hook)(void);
+
+
+uint64_t
+now_ms()
+{
+	if (now_ms_hook)
+		return now_ms_hook();
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+SerialPort::~SerialPort()
+{
+	close();
+}
+
+
+int
+SerialPort::open(
+	const char * const path
+)
+{
+	fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	struct termios t;
+	if (tcgetattr(fd, &t) == 0)
+	{
+		cfmakeraw(&t);
+		cfsetspeed(&t, B115200);
+		t.c_cflag |= CLOCAL | CREAD;
+		t.c_cc[VMIN] = 0;
+		t.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSANOW, &t);
+	}
+
+	return 0;
+}
+
+
+void
+SerialPort::close()
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+}
+
+
+void
+SerialPort::send(
+	const void * const buf,
+	size_t len
+)
+{
+	const uint8_t * const p = (const uint8_t *) buf;
+	tx.insert(tx.end(), p, p + len);
+}
+
+
+void
+SerialPort::cancel()
+{
+	tx.clear();
+	tx_off = 0;
+}
+
+
+void
+SerialPort::consume(
+	size_t n
+)
+{
+	rx_off += n;
+	if (rx_off < rx.size() && rx_off < 65536)
+		return;
+
+	rx.erase(rx.begin(), rx.begin() + rx_off);
+	rx_off = 0;
+}
+
+
+int
+SerialPort::pump(
+	int timeout_ms
+)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN | (queued() ? POLLOUT : 0);
+	pfd.revents = 0;
+
+	const int rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0)
+		return errno == EINTR ? 0 : -1;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -1;
+
+	if (pfd.revents & POLLOUT)
+	{
+		const ssize_t n = write(fd, tx.data() + tx_off, queued());
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (n > 0)
+			tx_off += n;
+		if (tx_off == tx.size())
+			cancel();
+	}
+
+	if (pfd.revents & POLLIN)
+	{
+		uint8_t buf[65536];
+		const ssize_t n = ::read(fd, buf, sizeof(buf));
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if (n > 0)
+			rx.insert(rx.end(), buf, buf + n);
+	}
+
+	return 0;
+}
+
+
+int
+SerialPort::read(
+	void * const buf,
+	size_t len,
+	int timeout_ms
+)
+{
+	const uint64_t end = now_ms() + timeout_ms;
+
+	while (available() < len)
+	{
+		const int64_t left = end - now_ms();
+		if (left <= 0 || pump(left) < 0)
+			return -1;
+	}
+
+	memcpy(buf, data(), len);
+	consume(len);
+	return 0;
+}
+
+
+void
+SerialPort::drain(
+	int quiet_ms
+)
+{
+	while (1)
+	{
+		consume(available());
+		if (pump(quiet_ms) < 0)
+			return;
+		if (!available() && !queued())
+			return;
+	}
+}
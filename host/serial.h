@@ -0,0 +1,68 @@
+/** \file
+ * Non-blocking serial port with a send queue.
+ *
+ * Everything to be sent is queued and pump() writes as much as the
+ * port will take while collecting whatever has arrived, so the device
+ * never waits for the host to get around to sending the next block.
+ */
+#ifndef _host_serial_h_
+#define _host_serial_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class SerialPort
+{
+public:
+	virtual ~SerialPort();
+
+	/** \return 0, or -1 with errno set */
+	int open(const char * path);
+	virtual void close();
+
+	/** Add bytes to the send queue */
+	void send(const void * buf, size_t len);
+
+	/** Throw away anything that has not been sent yet */
+	void cancel();
+
+	size_t queued() const { return tx.size() - tx_off; }
+
+	/** Write and read for up to timeout_ms.
+	 * \return 0, or -1 if the port has gone away.
+	 */
+	virtual int pump(int timeout_ms);
+
+	/** Bytes that have arrived and not been consumed */
+	const uint8_t * data() const { return rx.data() + rx_off; }
+	size_t available() const { return rx.size() - rx_off; }
+	void consume(size_t n);
+
+	/** Pump until len bytes have arrived, then copy them out.
+	 * \return 0, or -1 on a timeout or error.
+	 */
+	int read(void * buf, size_t len, int timeout_ms);
+
+	/** Discard input until nothing arrives for quiet_ms */
+	void drain(int quiet_ms);
+
+protected:
+	int fd = -1;
+	std::vector<uint8_t> tx;
+	size_t tx_off = 0;
+	std::vector<uint8_t> rx;
+	size_t rx_off = 0;
+};
+
+
+/** Milliseconds from a monotonic clock */
+uint64_t
+now_ms();
+
+/** Replaces the monotonic clock, so that the simulator can run the
+ * timeouts on its own time.
+ */
+extern uint64_t (*now_ms_hook)(void);
+
+#endif
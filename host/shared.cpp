@@ -0,0 +1,13 @@
+/**
+ * \file Sketch code that the host tools share
+ *
+ * The CRC-32 and LZ codecs are plain C, so the sketch files are built
+ * here as they are rather than kept as a second copy.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../crc.ino"
+#include "../lz.ino"
@@ -0,0 +1,189 @@
+/**
+ * \file Teensyduino core calls on top of the simulator backends
+ */
+
+#include "arduino.h"
+
+#include <stdio.h>
+
+#define HAL_PINS		64
+#define HAL_READ_TIMEOUT_MS	1000 // Stream::setTimeout() default
+
+hal_bus_t * hal_bus;
+hal_link_t * hal_link;
+hal_clock_t * hal_clock;
+
+SPIClass SPI;
+usb_serial_class Serial;
+uint32_t ARM_DEMCR;
+uint32_t ARM_DWT_CTRL;
+
+static uint8_t hal_pin_mode[HAL_PINS];
+static uint8_t hal_pin_value[HAL_PINS];
+
+
+/** A chip select is only asserted while it is driven low */
+static void
+hal_pin_update(
+	uint8_t pin,
+	uint8_t old_mode,
+	uint8_t old_value
+)
+{
+	const bool was = old_mode == OUTPUT && old_value == LOW;
+	const bool now = hal_pin_mode[pin] == OUTPUT && hal_pin_value[pin] == LOW;
+	if (was != now)
+		hal_bus->select(pin, now);
+}
+
+
+void
+pinMode(
+	uint8_t pin,
+	uint8_t mode
+)
+{
+	if (pin >= HAL_PINS)
+		return;
+
+	const uint8_t old_mode = hal_pin_mode[pin];
+	hal_pin_mode[pin] = mode;
+	hal_pin_update(pin, old_mode, hal_pin_value[pin]);
+}
+
+
+void
+digitalWrite(
+	uint8_t pin,
+	uint8_t value
+)
+{
+	if (pin >= HAL_PINS)
+		return;
+
+	const uint8_t old_value = hal_pin_value[pin];
+	hal_pin_value[pin] = value ? HIGH : LOW;
+	hal_pin_update(pin, hal_pin_mode[pin], old_value);
+}
+
+
+uint32_t
+millis(void)
+{
+	return hal_clock->now_ns() / 1000000;
+}
+
+
+uint32_t
+micros(void)
+{
+	return hal_clock->now_ns() / 1000;
+}
+
+
+uint32_t
+hal_cycles(void)
+{
+	return hal_clock->now_ns() * (F_CPU / 1000000) / 1000;
+}
+
+
+void
+delay(
+	uint32_t ms
+)
+{
+	hal_clock->wait_ns((uint64_t) ms * 1000000);
+}
+
+
+void
+delayMicroseconds(
+	uint32_t us
+)
+{
+	hal_clock->wait_ns((uint64_t) us * 1000);
+}
+
+
+void
+yield(void)
+{
+	hal_clock->wait_ns(0);
+}
+
+
+size_t
+usb_serial_class::readBytes(
+	char * const buf,
+	size_t len
+)
+{
+	const uint32_t start = millis();
+	size_t count = 0;
+
+	while (count < len)
+	{
+		const int c = read();
+		if (c >= 0)
+		{
+			buf[count++] = c;
+			continue;
+		}
+
+		if (millis() - start >= HAL_READ_TIMEOUT_MS)
+			break;
+	}
+
+	return count;
+}
+
+
+size_t
+usb_serial_class::print(
+	unsigned long n,
+	int base
+)
+{
+	char buf[8 * sizeof(n) + 1];
+	char * p = &buf[sizeof(buf) - 1];
+	*p = '\0';
+
+	if (base < 2)
+		base = 10;
+
+	do {
+		const unsigned digit = n % base;
+		*--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+		n /= base;
+	} while (n);
+
+	return print(p);
+}
+
+
+size_t
+usb_serial_class::print(
+	long n,
+	int base
+)
+{
+	// like the Teensy core, only decimal gets a sign, and a long
+	// is 32 bits there
+	if (n >= 0 || base != DEC)
+		return print((unsigned long) (uint32_t) n, base);
+
+	return print('-') + print((unsigned long) -n, base);
+}
+
+
+size_t
+usb_serial_class::print(
+	double n,
+	int digits
+)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%.*f", digits, n);
+	return print(buf);
+}
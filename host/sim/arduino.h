@@ -0,0 +1,173 @@
+/** \file
+ * The part of the Teensyduino core that the sketch uses (see hal.h),
+ * for running it on the host.
+ *
+ * The calls are passed on to three backends, which the simulator
+ * provides: hal_bus_t is whatever is on the SPI bus and chip selects,
+ * hal_link_t is the far end of the USB serial port, and hal_clock_t
+ * is the time that millis() and friends report.
+ */
+#ifndef _host_sim_arduino_h_
+#define _host_sim_arduino_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define F_CPU		96000000
+#define F_BUS		48000000
+
+#define HIGH		1
+#define LOW		0
+#define INPUT		0
+#define OUTPUT		1
+#define MSBFIRST	1
+#define SPI_MODE0	0
+#define DEC		10
+#define HEX		16
+
+
+/** The SPI bus and the chip select pins */
+class hal_bus_t
+{
+public:
+	virtual ~hal_bus_t() {}
+
+	/** A chip select was driven low (selected) or released */
+	virtual void select(uint8_t pin, bool selected) = 0;
+
+	/** A transaction started at this clock */
+	virtual void clock(uint32_t hz) = 0;
+
+	virtual uint8_t transfer(uint8_t out) = 0;
+
+	/** Back to back transfers; out or in may be NULL */
+	virtual void transfer(const uint8_t * out, uint8_t * in, size_t len) = 0;
+};
+
+
+/** The host end of the USB serial port */
+class hal_link_t
+{
+public:
+	virtual ~hal_link_t() {}
+
+	/** Bytes that have arrived */
+	virtual int available() = 0;
+
+	/** \return the next byte, or -1 if nothing has arrived */
+	virtual int read() = 0;
+
+	/** Blocks while the transmit buffer is full */
+	virtual void write(const uint8_t * buf, size_t len) = 0;
+
+	/** Send what is buffered now (send_now and flush) */
+	virtual void flush() = 0;
+
+	/** The host has the port open */
+	virtual bool dtr() = 0;
+};
+
+
+class hal_clock_t
+{
+public:
+	virtual ~hal_clock_t() {}
+
+	virtual uint64_t now_ns() = 0;
+
+	/** Let time pass, as delay() does */
+	virtual void wait_ns(uint64_t ns) = 0;
+};
+
+
+extern hal_bus_t * hal_bus;
+extern hal_link_t * hal_link;
+extern hal_clock_t * hal_clock;
+
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+static inline void digitalWriteFast(uint8_t pin, uint8_t value) { digitalWrite(pin, value); }
+
+uint32_t millis(void);
+uint32_t micros(void);
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield(void);
+
+// the DWT cycle counter, which cycles_now() reads
+uint32_t hal_cycles(void);
+#define ARM_DWT_CYCCNT		(hal_cycles())
+extern uint32_t ARM_DEMCR;
+extern uint32_t ARM_DWT_CTRL;
+#define ARM_DEMCR_TRCENA	(1 << 24)
+#define ARM_DWT_CTRL_CYCCNTENA	(1 << 0)
+
+
+class SPISettings
+{
+public:
+	SPISettings() : clock(4000000) {}
+	SPISettings(uint32_t clock, uint8_t, uint8_t) : clock(clock) {}
+	uint32_t clock;
+};
+
+
+class SPIClass
+{
+public:
+	void begin() {}
+	void end() {}
+	void beginTransaction(const SPISettings & s) { hal_bus->clock(s.clock); }
+	void endTransaction() {}
+
+	uint8_t transfer(uint8_t out) { return hal_bus->transfer(out); }
+
+	void transfer(void * buf, size_t len)
+	{
+		hal_bus->transfer((const uint8_t*) buf, (uint8_t*) buf, len);
+	}
+
+	void transfer(const void * out, void * in, size_t len)
+	{
+		hal_bus->transfer((const uint8_t*) out, (uint8_t*) in, len);
+	}
+};
+
+extern SPIClass SPI;
+
+
+class usb_serial_class
+{
+public:
+	void begin(long) {}
+	int available() { return hal_link->available(); }
+	int read() { return hal_link->read(); }
+	size_t readBytes(char * buf, size_t len);
+	size_t readBytes(uint8_t * buf, size_t len) { return readBytes((char*) buf, len); }
+	void send_now() { hal_link->flush(); }
+	void flush() { hal_link->flush(); }
+	uint8_t dtr() { return hal_link->dtr(); }
+
+	size_t write(uint8_t c) { return write(&c, 1); }
+	size_t write(const uint8_t * buf, size_t len) { hal_link->write(buf, len); return len; }
+
+	size_t print(const char * s) { return write((const uint8_t*) s, strlen(s)); }
+	size_t print(char c) { return write((uint8_t) c); }
+	size_t print(unsigned long n, int base = DEC);
+	size_t print(long n, int base = DEC);
+	size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+	size_t print(int n, int base = DEC) { return print((long) n, base); }
+	size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+	size_t print(double n, int digits = 2);
+
+	size_t println() { return print("\r\n"); }
+	template <typename T> size_t println(T x) { return print(x) + println(); }
+	template <typename T> size_t println(T x, int base) { return print(x, base) + println(); }
+};
+
+extern usb_serial_class Serial;
+
+#endif
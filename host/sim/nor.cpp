@@ -0,0 +1,271 @@
+/**
+ * \file Simulated SPI NOR flash
+ */
+
+#include "nor.h"
+
+#define NOR_CMD_WRSR		0x01
+#define NOR_CMD_PP		0x02
+#define NOR_CMD_READ		0x03
+#define NOR_CMD_WRDI		0x04
+#define NOR_CMD_RDSR		0x05
+#define NOR_CMD_WREN		0x06
+#define NOR_CMD_FAST_READ	0x0B
+#define NOR_CMD_SE		0x20
+#define NOR_CMD_BE32		0x52
+#define NOR_CMD_CE		0x60
+#define NOR_CMD_RDID		0x9F
+#define NOR_CMD_CE2		0xC7
+#define NOR_CMD_BE		0xD8
+
+#define NOR_WIP			0x01
+#define NOR_WEL			0x02
+
+
+SimFlash::SimFlash(
+	Sim & sim,
+	uint32_t size,
+	uint8_t cs_pin,
+	const nor_timing_t & timing
+) :
+	mem(size, 0xFF),
+	sim(sim),
+	cs_pin(cs_pin),
+	timing(timing)
+{
+	uint8_t cap = 0;
+	while ((1ul << cap) < size)
+		cap++;
+
+	// a Winbond part of the right size
+	id[0] = 0xEF;
+	id[1] = 0x40;
+	id[2] = cap;
+
+	clock(4000000);
+	hal_bus = this;
+}
+
+
+void
+SimFlash::clock(
+	uint32_t hz
+)
+{
+	if (hz > NOR_MAX_CLOCK)
+		hz = NOR_MAX_CLOCK;
+	bit_ns = 1000000000ull / hz;
+}
+
+
+uint8_t
+SimFlash::status() const
+{
+	return status_bits
+		| (busy() ? NOR_WIP : 0)
+		| (wel ? NOR_WEL : 0);
+}
+
+
+void
+SimFlash::start_busy(
+	uint64_t us
+)
+{
+	busy_until = sim.now_ns() + us * 1000;
+	wel = false;
+}
+
+
+void
+SimFlash::select(
+	uint8_t pin,
+	bool now_selected
+)
+{
+	if (pin != cs_pin || now_selected == selected)
+		return;
+
+	selected = now_selected;
+	if (selected)
+	{
+		pos = 0;
+		addr = 0;
+		memset(page, 0xFF, sizeof(page));
+		return;
+	}
+
+	// commands take effect when CS goes high
+	if (pos != 0)
+		finish();
+}
+
+
+/** One byte in each direction, without spending any time */
+uint8_t
+SimFlash::shift(
+	uint8_t out
+)
+{
+	if (!selected)
+		return 0xFF;
+
+	const uint32_t n = pos++;
+
+	if (n == 0)
+	{
+		cmd = out;
+		return 0xFF;
+	}
+
+	if (cmd == NOR_CMD_RDSR)
+		return status();
+
+	// nothing else responds while the part is busy
+	if (busy())
+		return 0xFF;
+
+	switch (cmd)
+	{
+	case NOR_CMD_RDID:
+		return id[(n - 1) % sizeof(id)];
+
+	case NOR_CMD_WRSR:
+		if (n == 1)
+			addr = out;
+		return 0xFF;
+
+	case NOR_CMD_READ:
+	case NOR_CMD_FAST_READ:
+	case NOR_CMD_PP:
+	case NOR_CMD_SE:
+	case NOR_CMD_BE32:
+	case NOR_CMD_BE:
+		if (n <= 3)
+		{
+			addr = (addr << 8) | out;
+			return 0xFF;
+		}
+		break;
+
+	default:
+		return 0xFF;
+	}
+
+	uint32_t offset = n - 4;
+	if (cmd == NOR_CMD_FAST_READ)
+	{
+		if (offset == 0)
+			return 0xFF; // dummy byte
+		offset--;
+	}
+
+	if (cmd == NOR_CMD_READ || cmd == NOR_CMD_FAST_READ)
+	{
+		stats.bytes_read++;
+		return mem[(addr + offset) & (mem.size() - 1)];
+	}
+
+	if (cmd == NOR_CMD_PP)
+		page[(addr + offset) % NOR_PAGE_SIZE] = out;
+
+	return 0xFF;
+}
+
+
+void
+SimFlash::finish()
+{
+	if (busy())
+		return;
+
+	const uint32_t mask = mem.size() - 1;
+
+	switch (cmd)
+	{
+	case NOR_CMD_WREN:
+		wel = true;
+		return;
+
+	case NOR_CMD_WRDI:
+		wel = false;
+		return;
+
+	case NOR_CMD_WRSR:
+		if (!wel || pos < 2)
+			return;
+		status_bits = addr & ~(NOR_WIP | NOR_WEL);
+		start_busy(10000);
+		return;
+
+	case NOR_CMD_PP:
+	{
+		if (!wel || pos < 5)
+			return;
+		const uint32_t base = addr & mask & ~(NOR_PAGE_SIZE - 1);
+		for (uint32_t i = 0 ; i < NOR_PAGE_SIZE ; i++)
+			mem[base + i] &= page[i];
+		stats.programs++;
+		start_busy(timing.page_us);
+		return;
+	}
+
+	case NOR_CMD_SE:
+	case NOR_CMD_BE32:
+	case NOR_CMD_BE:
+	{
+		if (!wel || pos != 4)
+			return;
+		const uint32_t size = cmd == NOR_CMD_SE ? 0x1000
+			: cmd == NOR_CMD_BE32 ? 0x8000 : 0x10000;
+		const uint32_t base = addr & mask & ~(size - 1);
+		memset(&mem[base], 0xFF, size);
+		stats.erases++;
+		start_busy(cmd == NOR_CMD_SE ? timing.erase_4k_us
+			: cmd == NOR_CMD_BE32 ? timing.erase_32k_us
+			: timing.erase_64k_us);
+		return;
+	}
+
+	case NOR_CMD_CE:
+	case NOR_CMD_CE2:
+		if (!wel || pos != 1)
+			return;
+		memset(mem.data(), 0xFF, mem.size());
+		stats.erases++;
+		start_busy((uint64_t) timing.erase_chip_ms * 1000 * (mem.size() >> 20));
+		return;
+
+	default:
+		return;
+	}
+}
+
+
+uint8_t
+SimFlash::transfer(
+	uint8_t out
+)
+{
+	sim.spend(8 * bit_ns + NOR_BYTE_OVERHEAD_NS);
+	return shift(out);
+}
+
+
+void
+SimFlash::transfer(
+	const uint8_t * const out,
+	uint8_t * const in,
+	size_t len
+)
+{
+	for (size_t i = 0 ; i < len ; i++)
+	{
+		const uint8_t c = shift(out ? out[i] : 0xFF);
+		if (in)
+			in[i] = c;
+	}
+
+	// the FIFO keeps the bus busy, so only the bits take time
+	sim.spend(8 * bit_ns * len);
+}
@@ -0,0 +1,85 @@
+/** \file
+ * Simulated SPI NOR flash.
+ *
+ * A 3-byte address part with RDID, RDSR, WRSR, WREN, WRDI, READ,
+ * FAST_READ, page program, 4K/32K/64K and chip erase.  It has no
+ * SFDP, so the sketch sizes it from the RDID capacity byte.  Program
+ * only clears bits, a page program wraps within the page, and
+ * everything but RDSR is ignored while an erase or program is in
+ * progress or when WEL is not set, as on a real part.
+ *
+ * SPI transfers spend simulated time at the bus clock, which the
+ * Teensy 3 can run at up to F_BUS / 2.
+ */
+#ifndef _host_sim_nor_h_
+#define _host_sim_nor_h_
+
+#include "sim.h"
+
+#include <vector>
+
+#define NOR_MAX_CLOCK		(F_BUS / 2)
+#define NOR_BYTE_OVERHEAD_NS	250 // a single SPI.transfer() round trip
+#define NOR_PAGE_SIZE		256
+
+typedef struct
+{
+	// typical times, after the W25Q series datasheets
+	uint32_t page_us;
+	uint32_t erase_4k_us;
+	uint32_t erase_32k_us;
+	uint32_t erase_64k_us;
+	uint32_t erase_chip_ms; // per MB
+} nor_timing_t;
+
+#define NOR_TIMING_DEFAULT { 700, 45000, 120000, 150000, 2500 }
+
+typedef struct
+{
+	uint32_t programs;
+	uint32_t erases;
+	uint64_t bytes_read;
+} nor_stats_t;
+
+
+class SimFlash : public hal_bus_t
+{
+public:
+	/** size must be a power of two; the part answers on cs_pin */
+	SimFlash(Sim & sim, uint32_t size, uint8_t cs_pin, const nor_timing_t & timing);
+
+	void select(uint8_t pin, bool selected) override;
+	void clock(uint32_t hz) override;
+	uint8_t transfer(uint8_t out) override;
+	void transfer(const uint8_t * out, uint8_t * in, size_t len) override;
+
+	std::vector<uint8_t> mem;
+	nor_stats_t stats = {};
+
+private:
+	Sim & sim;
+	const uint8_t cs_pin;
+	const nor_timing_t timing;
+	uint8_t id[3];
+	uint64_t bit_ns;
+
+	// the command in progress
+	bool selected = false;
+	uint8_t cmd;
+	uint32_t pos;
+	uint32_t addr;
+	uint8_t page[NOR_PAGE_SIZE];
+
+	// status
+	bool wel = false;
+	uint8_t status_bits = 0; // the non-volatile bits set by WRSR
+	uint64_t busy_until = 0;
+
+	bool busy() const { return sim.now_ns() < busy_until; }
+	uint8_t status() const;
+	uint8_t shift(uint8_t out);
+	void finish();
+	void start_busy(uint64_t us);
+};
+
+#endif
@@ -0,0 +1,319 @@
+/**
+ * \file Simulated time and serial link
+ */
+
+#include "sim.h"
+
+#include <algorithm>
+
+// the sketch
+void setup(void);
+void loop(void);
+
+// the host is woken for this much data, or for the end of a burst
+#define SIM_HOST_WAKE_BYTES	512
+
+/** Thrown on the sketch's thread to unwind it when the Sim goes away */
+struct sim_stop {};
+
+
+Sim::Sim(
+	const sim_link_config_t & config
+) :
+	config(config)
+{
+	byte_ns = 1000000000ull / config.bytes_per_sec;
+	if (byte_ns == 0)
+		byte_ns = 1;
+}
+
+
+Sim::~Sim()
+{
+	if (!device.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> l(lock);
+		stopping = true;
+		device_turn = true;
+		turn_changed.notify_all();
+	}
+
+	device.join();
+}
+
+
+void
+Sim::start()
+{
+	hal_clock = this;
+	hal_link = this;
+	device = std::thread(&Sim::device_main, this);
+}
+
+
+void
+Sim::device_main()
+{
+	{
+		std::unique_lock<std::mutex> l(lock);
+		turn_changed.wait(l, [this]{ return device_turn; });
+	}
+
+	try {
+		if (!stopping)
+		{
+			setup();
+			while (1)
+				loop();
+		}
+	} catch (const sim_stop &) {
+	}
+
+	std::unique_lock<std::mutex> l(lock);
+	device_turn = false;
+	turn_changed.notify_all();
+}
+
+
+/** The sketch's thread: hand over to the host and wait to be resumed */
+void
+Sim::to_host_turn()
+{
+	std::unique_lock<std::mutex> l(lock);
+	device_turn = false;
+	turn_changed.notify_all();
+	turn_changed.wait(l, [this]{ return device_turn; });
+
+	if (stopping)
+		throw sim_stop();
+}
+
+
+void
+Sim::run_device(
+	uint64_t deadline_ns,
+	bool sending
+)
+{
+	host_deadline = deadline_ns;
+	host_sending = sending;
+
+	std::unique_lock<std::mutex> l(lock);
+	device_turn = true;
+	turn_changed.notify_all();
+	turn_changed.wait(l, [this]{ return !device_turn; });
+}
+
+
+/** Is the host waiting for something that has now happened?  To keep
+ * the threads from trading places on every byte, it waits for half the
+ * window to free up, and for a packet's worth of data or the end of
+ * a burst, the way a USB host collects data.
+ */
+bool
+Sim::host_ready() const
+{
+	if (now >= host_deadline)
+		return true;
+
+	if (host_sending && to_device.size() <= config.rx_window / 2)
+		return true;
+
+	if (!host_has_data())
+		return false;
+
+	return to_host.back().arrive_ns <= now
+		|| to_host.size() < SIM_HOST_WAKE_BYTES
+		|| to_host[SIM_HOST_WAKE_BYTES - 1].arrive_ns <= now;
+}
+
+
+void
+Sim::spend(
+	uint64_t ns
+)
+{
+	now += ns;
+	if (host_ready())
+		to_host_turn();
+}
+
+
+void
+Sim::wait_ns(
+	uint64_t ns
+)
+{
+	const uint64_t end = now + ns;
+
+	// stop at each point where the host might want to run
+	do {
+		uint64_t next = end;
+		if (host_deadline > now && host_deadline < next)
+			next = host_deadline;
+		if (!to_host.empty() && to_host.back().arrive_ns > now && to_host.back().arrive_ns < next)
+			next = to_host.back().arrive_ns;
+
+		spend(next - now);
+	} while (now < end);
+}
+
+
+/** Nothing has arrived for the sketch, so skip ahead a little */
+void
+Sim::idle()
+{
+	uint64_t next = now + SIM_IDLE_STEP_NS;
+	if (!to_device.empty() && to_device.front().arrive_ns < next)
+		next = to_device.front().arrive_ns;
+	if (host_deadline > now && host_deadline < next)
+		next = host_deadline;
+	if (next <= now)
+		next = now + 1;
+
+	spend(next - now);
+}
+
+
+/** Bytes that have reached the sketch */
+size_t
+Sim::arrived() const
+{
+	const uint64_t t = now;
+	const auto end = std::partition_point(to_device.begin(), to_device.end(),
+		[t](const sim_byte_t & b){ return b.arrive_ns <= t; });
+	return end - to_device.begin();
+}
+
+
+int
+Sim::available()
+{
+	spend(SIM_SERIAL_CALL_NS);
+
+	if (arrived() == 0)
+		idle();
+
+	return arrived();
+}
+
+
+int
+Sim::read()
+{
+	spend(SIM_SERIAL_CALL_NS);
+
+	if (arrived() == 0)
+	{
+		idle();
+		return -1;
+	}
+
+	const uint8_t c = to_device.front().c;
+	to_device.pop_front();
+	return c;
+}
+
+
+void
+Sim::write(
+	const uint8_t * const buf,
+	size_t len
+)
+{
+	spend(SIM_SERIAL_CALL_NS);
+
+	// the Teensy throws data away when nothing is listening
+	if (!connected)
+		return;
+
+	const uint64_t buffer_ns = config.tx_buffer * byte_ns;
+
+	for (size_t i = 0 ; i < len ; i++)
+	{
+		to_host_busy = std::max(now, to_host_busy) + byte_ns;
+		to_host.push_back({ to_host_busy + config.rtt_us * 500ull, buf[i] });
+		stats.to_host++;
+
+		// the buffer is full until the link catches up
+		if (to_host_busy > now + buffer_ns)
+			wait_ns(to_host_busy - now - buffer_ns);
+	}
+}
+
+
+void
+Sim::flush()
+{
+	spend(SIM_SERIAL_CALL_NS);
+}
+
+
+bool
+Sim::dtr()
+{
+	spend(SIM_SERIAL_CALL_NS);
+	return connected;
+}
+
+
+void
+Sim::host_send(
+	uint8_t c
+)
+{
+	to_device_busy = std::max(now, to_device_busy) + byte_ns;
+	to_device.push_back({ to_device_busy + config.rtt_us * 500ull, c });
+	stats.to_device++;
+}
+
+
+bool
+Sim::host_has_data() const
+{
+	return !to_host.empty() && to_host.front().arrive_ns <= now;
+}
+
+
+uint8_t
+Sim::host_receive()
+{
+	const uint8_t c = to_host.front().c;
+	to_host.pop_front();
+	return c;
+}
+
+
+int
+SimPort::pump(
+	int timeout_ms
+)
+{
+	const uint64_t deadline = sim.now_ns() + timeout_ms * 1000000ull;
+
+	while (1)
+	{
+		bool moved = false;
+
+		while (queued() && sim.host_can_send())
+		{
+			sim.host_send(tx[tx_off++]);
+			moved = true;
+		}
+		if (tx_off == tx.size())
+			cancel();
+
+		while (sim.host_has_data())
+		{
+			rx.push_back(sim.host_receive());
+			moved = true;
+		}
+
+		if (moved || sim.now_ns() >= deadline)
+			return 0;
+
+		sim.run_device(deadline, queued() != 0);
+	}
+}
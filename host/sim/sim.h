@@ -0,0 +1,133 @@
+/** \file
+ * Simulated time and USB serial link.
+ *
+ * The sketch runs on its own thread, but only one side runs at a
+ * time: the sketch until the host has something to do, then the
+ * host until it waits on the port again.  Time is virtual and only
+ * moves when the sketch spends it, on SPI transfers (see nor.h),
+ * serial calls and delays, so a run is repeatable and does not
+ * depend on how fast the machine is.  CPU time for the sketch's own
+ * computations (CRCs, compression) is not counted.
+ *
+ * Each direction of the link is a queue of bytes stamped with when
+ * they arrive at the other end, from the bandwidth and half the round
+ * trip time.  The host can only have rx_window bytes that the sketch
+ * has not read on the way, as USB flow control would allow.
+ */
+#ifndef _host_sim_sim_h_
+#define _host_sim_sim_h_
+
+#include "arduino.h"
+#include "../serial.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define SIM_SERIAL_CALL_NS	500 // what one Serial call costs the sketch
+#define SIM_IDLE_STEP_NS	10000 // time that passes per empty poll
+
+typedef struct
+{
+	uint32_t bytes_per_sec; // each way
+	uint32_t rtt_us;
+	uint32_t rx_window; // host bytes in flight or in the device buffer
+	uint32_t tx_buffer; // device bytes that can be queued before write() blocks
+} sim_link_config_t;
+
+#define SIM_LINK_DEFAULT { 1000000, 1000, 2048, 4096 }
+
+typedef struct
+{
+	uint64_t to_device;
+	uint64_t to_host;
+} sim_link_stats_t;
+
+
+class Sim : public hal_clock_t, public hal_link_t
+{
+public:
+	Sim(const sim_link_config_t & config);
+	~Sim();
+
+	/** Start the sketch's setup() and loop() */
+	void start();
+
+	// hal_clock_t, for the sketch
+	uint64_t now_ns() override { return now; }
+	void wait_ns(uint64_t ns) override;
+
+	/** Spend sketch time on the SPI bus or elsewhere */
+	void spend(uint64_t ns);
+
+	// hal_link_t, the sketch's end of the serial port
+	int available() override;
+	int read() override;
+	void write(const uint8_t * buf, size_t len) override;
+	void flush() override;
+	bool dtr() override;
+
+	// the host's end
+	void host_open(bool open) { connected = open; }
+	bool host_can_send() const { return to_device.size() < config.rx_window; }
+	void host_send(uint8_t c);
+	bool host_has_data() const;
+	uint8_t host_receive();
+
+	/** Let the sketch run until the host has something to do or
+	 * deadline_ns comes around.
+	 */
+	void run_device(uint64_t deadline_ns, bool host_sending);
+
+	sim_link_stats_t stats = {};
+	sim_link_config_t config;
+
+private:
+	typedef struct
+	{
+		uint64_t arrive_ns;
+		uint8_t c;
+	} sim_byte_t;
+
+	uint64_t now = 0;
+	uint64_t byte_ns;
+	std::deque<sim_byte_t> to_device;
+	std::deque<sim_byte_t> to_host;
+	uint64_t to_device_busy = 0; // when the link is free to send more
+	uint64_t to_host_busy = 0;
+	bool connected = false;
+
+	// what the host is waiting for
+	uint64_t host_deadline = 0;
+	bool host_sending = false;
+
+	std::thread device;
+	std::mutex lock;
+	std::condition_variable turn_changed;
+	bool device_turn = false;
+	bool stopping = false;
+
+	bool host_ready() const;
+	void idle();
+	void to_host_turn();
+	size_t arrived() const;
+	void device_main();
+};
+
+
+/** The host's end of the link, for the host side client code */
+class SimPort : public SerialPort
+{
+public:
+	SimPort(Sim & sim) : sim(sim) { sim.host_open(true); }
+	~SimPort() { close(); }
+
+	void close() override { sim.host_open(false); }
+	int pump(int timeout_ms) override;
+
+private:
+	Sim & sim;
+};
+
+#endif
@@ -0,0 +1,548 @@
+/**
+ * \file End to end benchmarks against the simulated hardware
+ *
+ *	spiflash-bench [-b BYTES_PER_SEC] [-r RTT_US] [-s MB] [-m MODE]
+ *
+ * Runs the sketch in the simulator (see sim/sim.h) with a NOR flash
+ * model on the bus, and times each way of getting an image off and
+ * onto the chip, from the host's first byte to its last reply.  The
+ * times are simulated, so runs are repeatable and can be compared
+ * before and after a change to the sketch or the host code.
+ *
+ * The test image is a quarter erased sectors, a third text-like data
+ * that compresses and the rest random.  Uploads are run "full", over
+ * unrelated data, and "delta", over the same image with a few sectors
+ * changed.  -m only runs the modes whose name contains MODE.
+ */
+
+#include "device.h"
+#include "flash.h"
+#include "crc.h"
+#include "lz.h"
+#include "xmodem.h"
+#include "sim/nor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_CS_PIN		10 // SPI_CS in spiflash.ino
+#define BENCH_TIMEOUT_MS	600000
+#define BENCH_DELTA_PERCENT	5
+
+static Sim * bench_sim;
+
+
+static uint64_t
+bench_now_ms(void)
+{
+	return bench_sim->now_ns() / 1000000;
+}
+
+
+typedef struct
+{
+	Sim & sim;
+	SimFlash & flash;
+	SimPort & port;
+	Device & dev;
+	const std::vector<uint8_t> & image;
+} bench_t;
+
+
+/** Pump until the text s has arrived, and consume up to the end of it */
+static int
+bench_expect(
+	SerialPort & port,
+	const char * const s
+)
+{
+	const size_t len = strlen(s);
+	const uint64_t end = now_ms() + BENCH_TIMEOUT_MS;
+
+	while (1)
+	{
+		const void * const p = memmem(port.data(), port.available(), s, len);
+		if (p)
+		{
+			port.consume((const uint8_t*) p - port.data() + len);
+			return 0;
+		}
+
+		if (now_ms() > end || port.pump(100) < 0)
+			return -1;
+	}
+}
+
+
+static int
+bench_dump_d(
+	bench_t & b,
+	std::vector<uint8_t> & out
+)
+{
+	const uint32_t len = b.image.size();
+	char cmd[64];
+	char reply[64];
+	uint32_t crc;
+
+	snprintf(cmd, sizeof(cmd), "d0 %x\r", len);
+	snprintf(reply, sizeof(reply), "D 0 %X\r\n", len);
+	b.port.send(cmd, strlen(cmd));
+
+	out.resize(len);
+	if (bench_expect(b.port, reply) < 0
+	||  b.port.read(out.data(), len, BENCH_TIMEOUT_MS) < 0
+	||  b.port.read(&crc, sizeof(crc), BENCH_TIMEOUT_MS) < 0
+	||  bench_expect(b.port, ">") < 0)
+		return -1;
+
+	return crc32_update(0, out.data(), len) == crc ? 0 : -1;
+}
+
+
+static uint16_t
+bench_crc16(
+	const uint8_t * const buf,
+	size_t len
+)
+{
+	uint16_t crc = 0;
+	for (size_t i = 0 ; i < len ; i++)
+	{
+		crc ^= buf[i] << 8;
+		for (int j = 0 ; j < 8 ; j++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+
+/** Receive the whole chip by xmodem, asking with start */
+static int
+bench_dump_xmodem(
+	bench_t & b,
+	std::vector<uint8_t> & out,
+	uint8_t start
+)
+{
+	const bool crc_mode = start == XMODEM_C;
+	uint8_t expected = 1;
+
+	out.clear();
+	b.port.send(&start, 1);
+
+	while (1)
+	{
+		uint8_t hdr[3];
+		if (b.port.read(hdr, 1, BENCH_TIMEOUT_MS) < 0)
+			return -1;
+
+		if (hdr[0] == XMODEM_EOT)
+		{
+			const uint8_t ack = XMODEM_ACK;
+			b.port.send(&ack, 1);
+			return bench_expect(b.port, ">");
+		}
+
+		if (hdr[0] != XMODEM_SOH && hdr[0] != XMODEM_STX)
+			continue;
+
+		const size_t len = hdr[0] == XMODEM_STX ? XMODEM_1K_BLOCK_SIZE : XMODEM_BLOCK_SIZE;
+		uint8_t block[XMODEM_1K_BLOCK_SIZE + 2];
+		const size_t cksum_len = crc_mode ? 2 : 1;
+
+		if (b.port.read(&hdr[1], 2, BENCH_TIMEOUT_MS) < 0
+		||  b.port.read(block, len + cksum_len, BENCH_TIMEOUT_MS) < 0)
+			return -1;
+
+		bool ok = hdr[1] == expected && hdr[2] == 0xFF - expected;
+		if (crc_mode)
+		{
+			const uint16_t crc = bench_crc16(block, len);
+			ok = ok && block[len] == (crc >> 8) && block[len+1] == (crc & 0xFF);
+		} else {
+			uint8_t cksum = 0;
+			for (size_t i = 0 ; i < len ; i++)
+				cksum += block[i];
+			ok = ok && block[len] == cksum;
+		}
+
+		const uint8_t reply = ok ? XMODEM_ACK : XMODEM_NAK;
+		b.port.send(&reply, 1);
+		if (!ok)
+			continue;
+
+		out.insert(out.end(), block, block + len);
+		expected++;
+	}
+}
+
+
+static int
+bench_dump_stream(
+	bench_t & b,
+	std::vector<uint8_t> & out,
+	uint8_t window,
+	uint8_t flags
+)
+{
+	Progress progress("read", b.image.size());
+	return b.dev.stream(0, b.image.size(), window, flags, out, progress);
+}
+
+
+static int
+bench_dump_bincmd(
+	bench_t & b,
+	std::vector<uint8_t> & out
+)
+{
+	const uint32_t len = b.image.size();
+	const uint32_t chunk = 0x10000;
+
+	out.resize(len);
+	if (b.dev.enter() < 0)
+		return -1;
+
+	for (uint32_t addr = 0 ; addr < len ; addr += chunk)
+	{
+		bincmd_reply_t r;
+		uint32_t crc;
+
+		if (b.dev.request(BINCMD_READ, 0, addr, chunk, &r) != BINCMD_OK
+		||  b.port.read(&out[addr], chunk, BENCH_TIMEOUT_MS) < 0
+		||  b.port.read(&crc, sizeof(crc), BENCH_TIMEOUT_MS) < 0
+		||  crc32_update(0, &out[addr], chunk) != crc)
+			return -1;
+	}
+
+	return b.dev.exit();
+}
+
+
+/** u, U, z or Z: the command, then every sector as it is taken */
+static int
+bench_upload_text(
+	bench_t & b,
+	char command,
+	bool compressed
+)
+{
+	const uint32_t len = b.image.size();
+	char cmd[64];
+
+	if (command == 'u' || command == 'z')
+		snprintf(cmd, sizeof(cmd), "%c0 %x\r", command, len);
+	else
+		snprintf(cmd, sizeof(cmd), "%c", command);
+
+	b.port.send(cmd, strlen(cmd));
+	if (bench_expect(b.port, "G ") < 0
+	||  bench_expect(b.port, "\r\n") < 0)
+		return -1;
+
+	for (uint32_t offset = 0 ; offset < len ; offset += HOST_SECTOR_SIZE)
+	{
+		const uint8_t * const sector = &b.image[offset];
+		if (!compressed)
+		{
+			b.port.send(sector, HOST_SECTOR_SIZE);
+			continue;
+		}
+
+		uint8_t lz[HOST_SECTOR_SIZE];
+		uint16_t lz_len = lz_compress(sector, HOST_SECTOR_SIZE, lz, sizeof(lz) - 1);
+		const uint8_t * data = lz;
+		if (lz_len == 0)
+		{
+			lz_len = HOST_SECTOR_SIZE;
+			data = sector;
+		}
+
+		b.port.send(&lz_len, sizeof(lz_len));
+		b.port.send(data, lz_len);
+	}
+
+	return bench_expect(b.port, "crc: ") < 0
+		|| bench_expect(b.port, ">") < 0 ? -1 : 0;
+}
+
+
+static int
+bench_upload_bincmd(
+	bench_t & b,
+	bool batch
+)
+{
+	flash_options_t options = {};
+	options.batch = batch;
+
+	if (b.dev.enter() < 0)
+		return -1;
+
+	const int rc = flash_write(b.dev, 0, b.image, options);
+	return b.dev.exit() < 0 ? -1 : rc;
+}
+
+
+typedef enum
+{
+	BENCH_DUMP,
+	BENCH_FULL, // over unrelated data
+	BENCH_DELTA, // over the image with a few sectors changed
+} bench_kind_t;
+
+typedef struct
+{
+	const char * name;
+	bench_kind_t kind;
+	int (*dump)(bench_t & b, std::vector<uint8_t> & out);
+	int (*upload)(bench_t & b);
+} bench_mode_t;
+
+static const bench_mode_t bench_modes[] = {
+	{ "dump d", BENCH_DUMP,
+		bench_dump_d, NULL },
+	{ "dump xmodem", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_xmodem(b, out, XMODEM_NAK); }, NULL },
+	{ "dump xmodem-1k", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_xmodem(b, out, XMODEM_C); }, NULL },
+	{ "dump F win 8", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_stream(b, out, 8, 0); }, NULL },
+	{ "dump F win 32", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_stream(b, out, 32, 0); }, NULL },
+	{ "dump F sparse", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_stream(b, out, 32, STREAM_FLAG_SPARSE); }, NULL },
+	{ "dump F lz", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_stream(b, out, 32, STREAM_FLAG_LZ); }, NULL },
+	{ "dump F sparse+lz", BENCH_DUMP,
+		[](bench_t & b, std::vector<uint8_t> & out) { return bench_dump_stream(b, out, 32, STREAM_FLAG_SPARSE | STREAM_FLAG_LZ); }, NULL },
+	{ "dump bincmd read", BENCH_DUMP,
+		bench_dump_bincmd, NULL },
+
+	{ "full u", BENCH_FULL, NULL,
+		[](bench_t & b) { return bench_upload_text(b, 'u', false); } },
+	{ "full U", BENCH_FULL, NULL,
+		[](bench_t & b) { return bench_upload_text(b, 'U', false); } },
+	{ "full z", BENCH_FULL, NULL,
+		[](bench_t & b) { return bench_upload_text(b, 'z', true); } },
+	{ "full bincmd", BENCH_FULL, NULL,
+		[](bench_t & b) { return bench_upload_bincmd(b, false); } },
+	{ "full bincmd batch", BENCH_FULL, NULL,
+		[](bench_t & b) { return bench_upload_bincmd(b, true); } },
+
+	{ "delta u", BENCH_DELTA, NULL,
+		[](bench_t & b) { return bench_upload_text(b, 'u', false); } },
+	{ "delta z", BENCH_DELTA, NULL,
+		[](bench_t & b) { return bench_upload_text(b, 'z', true); } },
+	{ "delta bincmd", BENCH_DELTA, NULL,
+		[](bench_t & b) { return bench_upload_bincmd(b, false); } },
+	{ "delta bincmd batch", BENCH_DELTA, NULL,
+		[](bench_t & b) { return bench_upload_bincmd(b, true); } },
+};
+
+
+static uint32_t bench_seed = 1;
+
+static uint32_t
+bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 8;
+}
+
+
+static void
+bench_make_image(
+	std::vector<uint8_t> & image,
+	uint32_t size
+)
+{
+	static const char * const words[] = {
+		"setup", "loop", "spi_", "read", "sector", "0x0000",
+		"    ", "\r\n", "BIOS", "_FVH", "return", "uint32_t",
+	};
+
+	image.resize(size);
+	for (uint32_t offset = 0 ; offset < size ; offset += HOST_SECTOR_SIZE)
+	{
+		uint8_t * const p = &image[offset];
+		const uint32_t kind = bench_rand() % 100;
+
+		if (kind < 25)
+		{
+			memset(p, 0xFF, HOST_SECTOR_SIZE);
+			continue;
+		}
+
+		for (uint32_t i = 0 ; i < HOST_SECTOR_SIZE ; )
+		{
+			if (kind >= 60)
+			{
+				p[i++] = bench_rand();
+				continue;
+			}
+
+			const char * const w = words[bench_rand() % (sizeof(words) / sizeof(*words))];
+			for (const char * c = w ; *c && i < HOST_SECTOR_SIZE ; c++)
+				p[i++] = *c;
+		}
+	}
+}
+
+
+/** What is on the chip before the run */
+static void
+bench_prepare(
+	bench_kind_t kind,
+	const std::vector<uint8_t> & image,
+	std::vector<uint8_t> & mem
+)
+{
+	// the same starting point whichever modes are run
+	bench_seed = 2;
+
+	if (kind == BENCH_DUMP)
+	{
+		mem = image;
+		return;
+	}
+
+	if (kind == BENCH_FULL)
+	{
+		for (uint8_t & c : mem)
+			c = bench_rand();
+		return;
+	}
+
+	mem = image;
+	const uint32_t sectors = image.size() / HOST_SECTOR_SIZE;
+	for (uint32_t i = 0 ; i < sectors * BENCH_DELTA_PERCENT / 100 ; i++)
+	{
+		const uint32_t sector = bench_rand() % sectors;
+		for (uint32_t j = 0 ; j < 64 ; j++)
+			mem[sector * HOST_SECTOR_SIZE + bench_rand() % HOST_SECTOR_SIZE] ^= 0x55;
+	}
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: spiflash-bench [options]\n"
+"\n"
+"  -b N       link bytes per second each way (default 1000000)\n"
+"  -r N       link round trip in microseconds (default 1000)\n"
+"  -s N       chip size in MB (default 1)\n"
+"  -m MODE    only run the modes whose name contains MODE\n"
+	);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	sim_link_config_t link = SIM_LINK_DEFAULT;
+	const nor_timing_t timing = NOR_TIMING_DEFAULT;
+	uint32_t size_mb = 1;
+	const char * only = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:r:s:m:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': link.bytes_per_sec = strtoul(optarg, NULL, 0); break;
+		case 'r': link.rtt_us = strtoul(optarg, NULL, 0); break;
+		case 's': size_mb = strtoul(optarg, NULL, 0); break;
+		case 'm': only = optarg; break;
+		default: usage(); return 1;
+		}
+	}
+
+	if (link.bytes_per_sec == 0 || size_mb == 0 || size_mb > 16
+	||  (size_mb & (size_mb - 1)) != 0)
+	{
+		usage();
+		return 1;
+	}
+
+	std::vector<uint8_t> image;
+	bench_make_image(image, size_mb << 20);
+
+	Sim sim(link);
+	SimFlash flash(sim, image.size(), BENCH_CS_PIN, timing);
+	SimPort port(sim);
+	Device dev(port);
+	bench_t b = { sim, flash, port, dev, image };
+
+	bench_sim = &sim;
+	now_ms_hook = bench_now_ms;
+	Progress::quiet = true;
+	sim.start();
+
+	// let the sketch start and probe the chip before the clock starts
+	if (dev.enter() < 0 || dev.exit() < 0)
+	{
+		fprintf(stderr, "sketch did not answer\n");
+		return 1;
+	}
+
+	printf("# link %u B/s rtt %u us, %u MB chip\n",
+		link.bytes_per_sec, link.rtt_us, size_mb);
+	printf("%-20s %8s %10s %10s %8s %8s %s\n",
+		"mode", "seconds", "to_dev", "to_host", "KB/s", "erases", "result");
+
+	int failures = 0;
+
+	for (const bench_mode_t & mode : bench_modes)
+	{
+		if (only && !strstr(mode.name, only))
+			continue;
+
+		bench_prepare(mode.kind, image, flash.mem);
+		port.drain(50);
+
+		const sim_link_stats_t link_start = sim.stats;
+		const nor_stats_t flash_start = flash.stats;
+		const uint64_t start = sim.now_ns();
+		std::vector<uint8_t> out;
+		int rc;
+
+		if (mode.dump)
+			rc = mode.dump(b, out) < 0 || out != flash.mem ? -1 : 0;
+		else
+			rc = mode.upload(b) < 0 || flash.mem != image ? -1 : 0;
+
+		const double secs = (sim.now_ns() - start) / 1e9;
+		printf("%-20s %8.3f %10llu %10llu %8.0f %8u %s\n",
+			mode.name,
+			secs,
+			(unsigned long long) (sim.stats.to_device - link_start.to_device),
+			(unsigned long long) (sim.stats.to_host - link_start.to_host),
+			secs > 0 ? image.size() / 1024.0 / secs : 0,
+			flash.stats.erases - flash_start.erases,
+			rc == 0 ? "ok" : "FAILED"
+		);
+		fflush(stdout);
+
+		if (rc != 0)
+		{
+			failures++;
+
+			// get the sketch back to the menu for the next one
+			port.cancel();
+			port.drain(2000);
+			if (dev.binary())
+				dev.exit();
+		}
+	}
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,327 @@
+/**
+ * \file Host tool for the spiflash sketch
+ *
+ *	spiflash-host [-p port] info
+ *	spiflash-host [-p port] [-s] [-z] [-w window] read ADDR LEN FILE
+ *	spiflash-host [-p port] [-n] [-B] write ADDR FILE
+ *	spiflash-host [-p port] verify ADDR FILE
+ *
+ * read uses the windowed stream protocol, optionally with sparse
+ * fill frames (-s) and LZ compressed frames (-z).
+ *
+ * write only sends the sectors that differ: it fetches the device's
+ * table of sector CRCs, erases and programs the runs that do not
+ * match with requests queued well ahead of their replies, and then
+ * fetches the table again to check them, retrying any that are still
+ * wrong.  An interrupted write is resumed by running it again, since
+ * the sectors that made it are then skipped.  -B sends the runs as
+ * BINCMD_BATCH queues instead; see flash.cpp.
+ */
+
+#include "device.h"
+#include "flash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HOST_DEFAULT_PORT	"/dev/ttyACM0"
+
+
+static int
+read_file(
+	const char * const name,
+	std::vector<uint8_t> & data
+)
+{
+	FILE * const f = fopen(name, "rb");
+	if (!f)
+	{
+		perror(name);
+		return -1;
+	}
+
+	uint8_t buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + n);
+
+	const int err = ferror(f);
+	fclose(f);
+	if (err)
+	{
+		perror(name);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int
+write_file(
+	const char * const name,
+	const std::vector<uint8_t> & data
+)
+{
+	FILE * const f = fopen(name, "wb");
+	if (!f)
+	{
+		perror(name);
+		return -1;
+	}
+
+	const size_t n = fwrite(data.data(), 1, data.size(), f);
+	if (fclose(f) != 0 || n != data.size())
+	{
+		perror(name);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/** Read a file and pad it with 0xFF to whole sectors */
+static int
+read_image(
+	const char * const name,
+	uint32_t addr,
+	std::vector<uint8_t> & image
+)
+{
+	if (read_file(name, image) < 0)
+		return -1;
+
+	if (addr % HOST_SECTOR_SIZE)
+	{
+		fprintf(stderr, "%08x: not sector aligned\n", addr);
+		return -1;
+	}
+
+	while (image.size() % HOST_SECTOR_SIZE)
+		image.push_back(0xFF);
+
+	if (image.empty())
+	{
+		fprintf(stderr, "%s: empty\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/** Ask for the chip size and check that the range fits in it */
+static int
+check_range(
+	Device & dev,
+	uint32_t addr,
+	uint64_t len
+)
+{
+	bincmd_reply_t r;
+	if (dev.request(BINCMD_ID, 0, 0, 0, &r) != BINCMD_OK)
+	{
+		fprintf(stderr, "chip id failed\n");
+		return -1;
+	}
+
+	if (addr + len > r.addr)
+	{
+		fprintf(stderr, "%08x+%llx: past the end of the %08x byte chip\n",
+			addr, (unsigned long long) len, r.addr);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int
+cmd_write(
+	Device & dev,
+	uint32_t addr,
+	const char * const name,
+	const flash_options_t & options
+)
+{
+	std::vector<uint8_t> image;
+	if (read_image(name, addr, image) < 0
+	||  check_range(dev, addr, image.size()) < 0)
+		return -1;
+
+	return flash_write(dev, addr, image, options);
+}
+
+
+static int
+cmd_verify(
+	Device & dev,
+	uint32_t addr,
+	const char * const name
+)
+{
+	std::vector<uint8_t> image;
+	std::vector<uint32_t> dirty;
+
+	if (read_image(name, addr, image) < 0
+	||  check_range(dev, addr, image.size()) < 0
+	||  flash_diff(dev, addr, image, dirty) < 0)
+		return -1;
+
+	for (uint32_t sector : dirty)
+		printf("%08x\n", addr + sector * HOST_SECTOR_SIZE);
+
+	fprintf(stderr, "%zu of %zu sectors differ\n",
+		dirty.size(), image.size() / HOST_SECTOR_SIZE);
+	return dirty.empty() ? 0 : 1;
+}
+
+
+static int
+cmd_info(
+	Device & dev
+)
+{
+	bincmd_reply_t r;
+
+	if (dev.request(BINCMD_ID, 0, 0, 0, &r) != BINCMD_OK)
+		return -1;
+	printf("rdid %06x size %08x\n", r.value, r.addr);
+
+	if (dev.request(BINCMD_READ_STATUS, 0, 0, 0, &r) != BINCMD_OK)
+		return -1;
+	printf("status %02x\n", r.value);
+
+	if (dev.request(BINCMD_RESUME, 0, 0, 0, &r) != BINCMD_OK)
+		return -1;
+	printf("last upload %08x next %08x\n", r.addr, r.value);
+
+	return 0;
+}
+
+
+static int
+cmd_read(
+	Device & dev,
+	uint32_t addr,
+	uint32_t len,
+	const char * const name,
+	uint8_t window,
+	uint8_t flags
+)
+{
+	if (check_range(dev, addr, len) < 0 || dev.exit() < 0)
+		return -1;
+
+	std::vector<uint8_t> data;
+	Progress progress("read", len);
+	if (dev.stream(addr, len, window, flags, data, progress) < 0)
+		return -1;
+
+	fprintf(stderr, "%llu bytes on the wire, %u resent\n",
+		(unsigned long long) dev.wire_bytes, dev.resent);
+
+	return write_file(name, data);
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+"usage: spiflash-host [options] command ...\n"
+"\n"
+"  info                      chip id, status and last upload\n"
+"  read ADDR LEN FILE        dump a range with the stream protocol\n"
+"  write ADDR FILE           program the sectors that differ and verify\n"
+"  verify ADDR FILE          list the sectors that differ\n"
+"\n"
+"  -p PORT    serial port (default " HOST_DEFAULT_PORT ")\n"
+"  -s         read: send erased sectors as fill frames\n"
+"  -z         read: LZ compress the frames\n"
+"  -w N       read: frames in flight (default 32)\n"
+"  -n         write: only list the sectors that would be written\n"
+"  -B         write: send the runs as batches\n"
+	);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * port_name = HOST_DEFAULT_PORT;
+	uint8_t flags = 0;
+	uint8_t window = 32;
+	flash_options_t options = {};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:szw:nBh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p': port_name = optarg; break;
+		case 's': flags |= STREAM_FLAG_SPARSE; break;
+		case 'z': flags |= STREAM_FLAG_LZ; break;
+		case 'w': window = strtoul(optarg, NULL, 0); break;
+		case 'n': options.dry_run = true; break;
+		case 'B': options.batch = true; break;
+		default: usage(); return 1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+	{
+		usage();
+		return 1;
+	}
+
+	const char * const cmd = argv[0];
+	const int want = strcmp(cmd, "info") == 0 ? 1
+		: strcmp(cmd, "read") == 0 ? 4
+		: strcmp(cmd, "write") == 0 || strcmp(cmd, "verify") == 0 ? 3
+		: 0;
+	if (want == 0 || argc != want || window == 0)
+	{
+		usage();
+		return 1;
+	}
+
+	SerialPort port;
+	if (port.open(port_name) < 0)
+	{
+		perror(port_name);
+		return 1;
+	}
+
+	Device dev(port);
+	if (dev.enter() < 0)
+	{
+		fprintf(stderr, "%s: no binary mode reply\n", port_name);
+		return 1;
+	}
+
+	const uint32_t addr = want > 1 ? strtoul(argv[1], NULL, 16) : 0;
+	int rc;
+
+	if (strcmp(cmd, "info") == 0)
+		rc = cmd_info(dev);
+	else
+	if (strcmp(cmd, "read") == 0)
+		rc = cmd_read(dev, addr, strtoul(argv[2], NULL, 16), argv[3], window, flags);
+	else
+	if (strcmp(cmd, "write") == 0)
+		rc = cmd_write(dev, addr, argv[2], options);
+	else
+		rc = cmd_verify(dev, addr, argv[2]);
+
+	dev.exit();
+	return rc < 0 ? 1 : rc;
+}
@@ -0,0 +1,34 @@
+/** \file
+ * Intel Flash Descriptor regions.
+ *
+ * x86 board ROMs start with a descriptor that splits the flash into
+ * regions (descriptor, BIOS, ME, GbE and so on).  The signature
+ * 0x0FF0A55A is at offset 0x10, FLMAP0 after it gives the region
+ * base (FRBA), and each FLREG there has the first and last 4K sector
+ * of one region.  Regions with a base past their limit are unused.
+ */
+#ifndef _ifd_h_
+#define _ifd_h_
+
+#include <stdint.h>
+
+#define IFD_SIGNATURE		0x0FF0A55A
+#define IFD_SIGNATURE_OFFSET	0x10
+#define IFD_REGIONS		16
+
+typedef struct
+{
+	uint32_t base;
+	uint32_t limit; // last byte of the region
+} ifd_region_t;
+
+
+/** I: list the regions.  Id, Ih, IF, Iu and Iz followed by a region
+ * number dump, hash, stream, upload or compressed upload just that
+ * region with the same engines as d, h, F, u and z.  The region
+ * number is required; without one they print "!".
+ */
+void
+ifd_interactive(void);
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * \file Intel Flash Descriptor regions
+ *
+ * See ifd.h.  The descriptor is read fresh for every command, since
+ * an upload may have just replaced it.
+ */
+
+#include "ifd.h"
+
+static const char * const ifd_region_names[IFD_REGIONS] = {
+	"descriptor", "bios", "me", "gbe",
+	"pdr", "devexp", "bios2", "microcode",
+	"ec", "devexp2", "ie", "10gbe1",
+	"10gbe2", "reserved", "reserved", "ptt",
+};
+
+
+/** Read the region table.
+ * \return the number of regions that are in use, or -1 if there is
+ * no descriptor.  Unused regions have a zero limit.
+ */
+static int
+ifd_read(
+	ifd_region_t * const regions
+)
+{
+	uint32_t hdr[2];
+	spi_read_bulk(IFD_SIGNATURE_OFFSET, (uint8_t*) hdr, sizeof(hdr));
+	if (hdr[0] != IFD_SIGNATURE)
+		return -1;
+
+	// FLMAP0 bits 23:16 are FRBA, in units of 16 bytes
+	const uint32_t frba = ((hdr[1] >> 16) & 0xFF) << 4;
+
+	uint32_t flreg[IFD_REGIONS];
+	spi_read_bulk(frba, (uint8_t*) flreg, sizeof(flreg));
+
+	int count = 0;
+	for (uint8_t i = 0 ; i < IFD_REGIONS ; i++)
+	{
+		const uint32_t base = (flreg[i] & 0x7FFF) << 12;
+		const uint32_t limit = (((flreg[i] >> 16) & 0x7FFF) << 12) | 0xFFF;
+
+		// older descriptors have fewer regions, and what
+		// follows them will not look like a sensible range
+		if (base > limit || limit >= spi_chip.size)
+		{
+			regions[i].base = regions[i].limit = 0;
+			continue;
+		}
+
+		regions[i].base = base;
+		regions[i].limit = limit;
+		count++;
+	}
+
+	return count;
+}
+
+
+static void
+ifd_print(
+	const ifd_region_t * const regions
+)
+{
+	for (uint8_t i = 0 ; i < IFD_REGIONS ; i++)
+	{
+		const ifd_region_t * const r = &regions[i];
+		if (r->limit == 0)
+			continue;
+
+		Serial.print("I ");
+		Serial.print(i, HEX);
+		Serial.print(' ');
+		Serial.print(r->base, HEX);
+		Serial.print(' ');
+		Serial.print(r->limit, HEX);
+		Serial.print(' ');
+		Serial.print(ifd_region_names[i]);
+		Serial.print("\r\n");
+	}
+}
+
+
+void
+ifd_interactive(void)
+{
+	// the sub-command, or the end of the line to list the regions
+	const int cmd = usb_serial_getchar_echo();
+	const bool list = cmd == '\r' || cmd == '\n';
+	const uint32_t n = list ? 0 : usb_serial_readhex();
+
+	// every sub-command needs a region; there is no default
+	if (!list && usb_serial_digits == 0)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	ifd_region_t regions[IFD_REGIONS];
+
+	spi_chip_detect();
+	spi_bus_claim();
+	const int count = ifd_read(regions);
+	spi_bus_release();
+
+	if (count < 0)
+	{
+		Serial.print("no descriptor\r\n");
+		return;
+	}
+
+	if (list)
+	{
+		ifd_print(regions);
+		return;
+	}
+
+	if (n >= IFD_REGIONS || regions[n].limit == 0)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	const uint32_t base = regions[n].base;
+	const uint32_t len = regions[n].limit + 1 - base;
+
+	switch (cmd)
+	{
+	case 'd': spi_dump_range(base, len); break;
+	case 'h': spi_hash_map(base, len); break;
+	case 'u': spi_upload(base, len, false, false); break;
+	case 'z': spi_upload(base, len, false, true); break;
+	case 'F':
+		spi_bus_claim();
+		if (stream_send(base, len, STREAM_WINDOW, STREAM_FLAG_SPARSE) < 0)
+			Serial.print("\r\nstream failed\r\n");
+		spi_bus_release();
+		break;
+	default:
+		Serial.print("?\r\n");
+		break;
+	}
+}
@@ -0,0 +1,71 @@
+/** \file
+ * Small LZSS codec for compressed uploads and dumps.
+ *
+ * Each 4 KB sector is compressed on its own, so the window is the
+ * sector itself and back references never reach outside of it.
+ * The stream is groups of a flag byte followed by up to eight items,
+ * least significant flag bit first:
+ *
+ *   1 -- a literal byte
+ *   0 -- a two byte match: the low 8 bits of the distance, then the
+ *        high 4 bits of the distance and the length minus 3 in the
+ *        low 4 bits.  Distances are 1 to 4095, lengths 3 to 18.
+ *
+ * Memory is fixed: the compressor uses a 1 KB hash table (LZ_HASH_SIZE
+ * 16-bit entries) plus the caller's output buffer, which only needs to
+ * be as big as the input since data that does not shrink is sent raw.
+ * The decompressor is a 4 byte state machine that writes straight into
+ * the sector buffer, so a compressed upload needs no RAM beyond the
+ * existing upload buffers.
+ */
+#ifndef _lz_h_
+#define _lz_h_
+
+#include <stdint.h>
+
+#define LZ_MIN_MATCH	3
+#define LZ_MAX_MATCH	(LZ_MIN_MATCH + 15)
+#define LZ_MAX_DIST	4095
+#define LZ_HASH_SIZE	512
+
+typedef struct
+{
+	uint8_t flags; // flag bits for the rest of the group
+	uint8_t count; // items left in the group, 0 for a new flag byte
+	int16_t low; // first byte of a match, or -1
+} lz_decoder_t;
+
+
+/** Compress len bytes.
+ * \return the compressed length, or 0 if it would not fit in out_max
+ * bytes, in which case the data should be sent raw.
+ */
+uint16_t
+lz_compress(
+	const uint8_t * const in,
+	uint16_t len,
+	uint8_t * const out,
+	uint16_t out_max
+);
+
+
+void
+lz_decode_init(
+	lz_decoder_t * const d
+);
+
+
+/** Feed one compressed byte to the decoder.
+ * \return the new output length, or -1 if the data is corrupt or
+ * would overflow out_max.
+ */
+int
+lz_decode(
+	lz_decoder_t * const d,
+	uint8_t c,
+	uint8_t * const out,
+	uint16_t out_len,
+	uint16_t out_max
+);
+
+#endif
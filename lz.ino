@@ -0,0 +1,168 @@
+/**
+ * \file LZSS compression
+ *
+ * See lz.h for the format.  Greedy matching with a single hash probe
+ * per position, which is plenty for firmware images and fast enough
+ * to keep ahead of the USB link.
+ */
+
+#include "lz.h"
+
+// offset + 1 of the last position with each hash, 0 for none
+static uint16_t lz_head[LZ_HASH_SIZE];
+
+
+static inline uint16_t
+lz_hash(
+	const uint8_t * const p
+)
+{
+	const uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - 9);
+}
+
+
+uint16_t
+lz_compress(
+	const uint8_t * const in,
+	uint16_t len,
+	uint8_t * const out,
+	uint16_t out_max
+)
+{
+	uint16_t o = 0;
+	uint16_t i = 0;
+	uint16_t flag_pos = 0;
+	uint8_t bit = 8;
+
+	memset(lz_head, 0, sizeof(lz_head));
+
+	while (i < len)
+	{
+		if (bit == 8)
+		{
+			// start a new group
+			if (o >= out_max)
+				return 0;
+			flag_pos = o;
+			out[o++] = 0;
+			bit = 0;
+		}
+
+		uint16_t match_len = 0;
+		uint16_t match_dist = 0;
+
+		if (i + LZ_MIN_MATCH <= len)
+		{
+			const uint16_t h = lz_hash(&in[i]);
+			const uint16_t cand = lz_head[h];
+			lz_head[h] = i + 1;
+
+			if (cand && i - (cand - 1) <= LZ_MAX_DIST)
+			{
+				const uint16_t c = cand - 1;
+				uint16_t max = len - i;
+				if (max > LZ_MAX_MATCH)
+					max = LZ_MAX_MATCH;
+
+				uint16_t n = 0;
+				while (n < max && in[c + n] == in[i + n])
+					n++;
+
+				if (n >= LZ_MIN_MATCH)
+				{
+					match_len = n;
+					match_dist = i - c;
+				}
+			}
+		}
+
+		if (match_len)
+		{
+			if (o + 2 > out_max)
+				return 0;
+
+			out[o++] = match_dist & 0xFF;
+			out[o++] = ((match_dist >> 8) << 4) | (match_len - LZ_MIN_MATCH);
+
+			// remember the positions inside the match too
+			for (uint16_t k = 1 ; k < match_len ; k++)
+				if (i + k + LZ_MIN_MATCH <= len)
+					lz_head[lz_hash(&in[i + k])] = i + k + 1;
+
+			i += match_len;
+		} else {
+			if (o >= out_max)
+				return 0;
+
+			out[flag_pos] |= 1 << bit;
+			out[o++] = in[i++];
+		}
+
+		bit++;
+	}
+
+	return o;
+}
+
+
+void
+lz_decode_init(
+	lz_decoder_t * const d
+)
+{
+	d->flags = 0;
+	d->count = 0;
+	d->low = -1;
+}
+
+
+int
+lz_decode(
+	lz_decoder_t * const d,
+	uint8_t c,
+	uint8_t * const out,
+	uint16_t out_len,
+	uint16_t out_max
+)
+{
+	if (d->count == 0)
+	{
+		d->flags = c;
+		d->count = 8;
+		return out_len;
+	}
+
+	if (d->flags & 1)
+	{
+		if (out_len >= out_max)
+			return -1;
+
+		out[out_len++] = c;
+		d->flags >>= 1;
+		d->count--;
+		return out_len;
+	}
+
+	if (d->low < 0)
+	{
+		d->low = c;
+		return out_len;
+	}
+
+	const uint16_t dist = d->low | ((uint16_t) (c >> 4) << 8);
+	const uint16_t n = (c & 0xF) + LZ_MIN_MATCH;
+
+	d->low = -1;
+	d->flags >>= 1;
+	d->count--;
+
+	if (dist == 0 || dist > out_len || out_len + n > out_max)
+		return -1;
+
+	// byte at a time, since the match may overlap its own output
+	for (uint16_t k = 0 ; k < n ; k++, out_len++)
+		out[out_len] = out[out_len - dist];
+
+	return out_len;
+}
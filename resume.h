@@ -0,0 +1,64 @@
+/** \file
+ * Map of the sectors that an upload has confirmed, so that an upload
+ * that was cut off can be restarted at the first sector that is not
+ * done rather than sending the whole image again.
+ *
+ * The map is kept in RAM for up to RESUME_SECTORS 4K sectors (64 MB),
+ * which survives the USB link dropping.  With CONFIG_RESUME_EEPROM it
+ * is also kept in the EEPROM, which survives a power cycle, for as
+ * many sectors as fit there (about 8 MB with the 2 KB on a Teensy 3.2).
+ * The map covers the most recent upload; an upload that restarts
+ * inside that range keeps it, so the whole job can still be reported.
+ */
+#ifndef _resume_h_
+#define _resume_h_
+
+#include <stdint.h>
+
+#define RESUME_SECTOR_SHIFT	12
+#define RESUME_SECTORS		16384
+
+//#define CONFIG_RESUME_EEPROM
+#define RESUME_EEPROM_MAGIC	0x314D5352 // "RSM1"
+
+
+/** Restore the map from the EEPROM, if it is configured */
+void
+resume_init(void);
+
+
+/** Start an upload of a range.  Its sectors are marked as not done. */
+void
+resume_begin(
+	uint32_t start,
+	uint32_t len
+);
+
+
+/** Mark the sector at addr as written and verified */
+void
+resume_mark(
+	uint32_t addr
+);
+
+
+/** \return the address of the first sector of the range that is not
+ * done, or the end of the range if they all are.
+ */
+uint32_t
+resume_next(void);
+
+
+/** Report the range, the first sector that is not done, and the map */
+void
+resume_interactive(void);
+
+
+/** The range of the most recent upload */
+uint32_t
+resume_start(void);
+
+uint32_t
+resume_len(void);
+
+#endif
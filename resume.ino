@@ -0,0 +1,239 @@
+/**
+ * \file Resumable upload map
+ *
+ * See resume.h.  Bits are by absolute sector number in RAM, and
+ * relative to the start of the range in the EEPROM.
+ */
+
+#include "resume.h"
+
+#ifdef CONFIG_RESUME_EEPROM
+#include <EEPROM.h>
+
+// magic, start and len, then the bits
+#define RESUME_EEPROM_HEADER	12
+#define RESUME_EEPROM_SECTORS	((E2END + 1 - RESUME_EEPROM_HEADER) * 8)
+#endif
+
+static uint32_t resume_map[RESUME_SECTORS / 32];
+static uint32_t resume_map_start;
+static uint32_t resume_map_len;
+
+
+static inline bool
+resume_get(
+	uint32_t sector
+)
+{
+	if (sector >= RESUME_SECTORS)
+		return false;
+
+	return (resume_map[sector / 32] >> (sector % 32)) & 1;
+}
+
+
+static inline void
+resume_set(
+	uint32_t sector,
+	bool done
+)
+{
+	if (sector >= RESUME_SECTORS)
+		return;
+
+	if (done)
+		resume_map[sector / 32] |= 1ul << (sector % 32);
+	else
+		resume_map[sector / 32] &= ~(1ul << (sector % 32));
+}
+
+
+#ifdef CONFIG_RESUME_EEPROM
+static uint32_t
+resume_eeprom_read32(
+	int offset
+)
+{
+	uint32_t x = 0;
+	for (int i = 0 ; i < 4 ; i++)
+		x |= (uint32_t) EEPROM.read(offset + i) << (8 * i);
+	return x;
+}
+
+
+static void
+resume_eeprom_write32(
+	int offset,
+	uint32_t x
+)
+{
+	for (int i = 0 ; i < 4 ; i++)
+		EEPROM.update(offset + i, x >> (8 * i));
+}
+
+
+/** Copy the byte of the map that holds a sector out to the EEPROM */
+static void
+resume_eeprom_sync(
+	uint32_t sector
+)
+{
+	const uint32_t i = sector - (resume_map_start >> RESUME_SECTOR_SHIFT);
+	if (i >= RESUME_EEPROM_SECTORS)
+		return;
+
+	uint8_t bits = 0;
+	const uint32_t first = sector - (i % 8);
+	for (uint8_t j = 0 ; j < 8 ; j++)
+		if (resume_get(first + j))
+			bits |= 1 << j;
+
+	EEPROM.update(RESUME_EEPROM_HEADER + i / 8, bits);
+}
+#endif
+
+
+void
+resume_init(void)
+{
+#ifdef CONFIG_RESUME_EEPROM
+	if (resume_eeprom_read32(0) != RESUME_EEPROM_MAGIC)
+		return;
+
+	resume_map_start = resume_eeprom_read32(4);
+	resume_map_len = resume_eeprom_read32(8);
+
+	const uint32_t first = resume_map_start >> RESUME_SECTOR_SHIFT;
+	uint32_t count = resume_map_len >> RESUME_SECTOR_SHIFT;
+	if (count > RESUME_EEPROM_SECTORS)
+		count = RESUME_EEPROM_SECTORS;
+
+	for (uint32_t i = 0 ; i < count ; i++)
+	{
+		const uint8_t bits = EEPROM.read(RESUME_EEPROM_HEADER + i / 8);
+		resume_set(first + i, (bits >> (i % 8)) & 1);
+	}
+#endif
+}
+
+
+void
+resume_begin(
+	uint32_t start,
+	uint32_t len
+)
+{
+	// a restart inside the last upload keeps its range
+	if (start < resume_map_start
+	|| start + len > resume_map_start + resume_map_len)
+	{
+		memset(resume_map, 0, sizeof(resume_map));
+		resume_map_start = start;
+		resume_map_len = len;
+	}
+
+	const uint32_t first = start >> RESUME_SECTOR_SHIFT;
+	const uint32_t count = len >> RESUME_SECTOR_SHIFT;
+	for (uint32_t i = 0 ; i < count ; i++)
+		resume_set(first + i, false);
+
+#ifdef CONFIG_RESUME_EEPROM
+	resume_eeprom_write32(0, RESUME_EEPROM_MAGIC);
+	resume_eeprom_write32(4, resume_map_start);
+	resume_eeprom_write32(8, resume_map_len);
+
+	const uint32_t map_first = resume_map_start >> RESUME_SECTOR_SHIFT;
+	const uint32_t map_count = resume_map_len >> RESUME_SECTOR_SHIFT;
+	for (uint32_t i = 0 ; i < map_count && i < RESUME_EEPROM_SECTORS ; i += 8)
+		resume_eeprom_sync(map_first + i);
+#endif
+}
+
+
+void
+resume_mark(
+	uint32_t addr
+)
+{
+	const uint32_t sector = addr >> RESUME_SECTOR_SHIFT;
+	resume_set(sector, true);
+
+#ifdef CONFIG_RESUME_EEPROM
+	resume_eeprom_sync(sector);
+#endif
+}
+
+
+uint32_t
+resume_next(void)
+{
+	const uint32_t first = resume_map_start >> RESUME_SECTOR_SHIFT;
+	const uint32_t count = resume_map_len >> RESUME_SECTOR_SHIFT;
+
+	for (uint32_t i = 0 ; i < count ; i++)
+		if (!resume_get(first + i))
+			return (first + i) << RESUME_SECTOR_SHIFT;
+
+	return resume_map_start + resume_map_len;
+}
+
+
+uint32_t
+resume_start(void)
+{
+	return resume_map_start;
+}
+
+
+uint32_t
+resume_len(void)
+{
+	return resume_map_len;
+}
+
+
+/** Print "O start len next", then the map with one hex digit for
+ * every four sectors, lowest sector in bit 0, 256 KB to a line.
+ */
+void
+resume_interactive(void)
+{
+	Serial.print("O ");
+	Serial.print(resume_map_start, HEX);
+	Serial.print(' ');
+	Serial.print(resume_map_len, HEX);
+	Serial.print(' ');
+	Serial.print(resume_next(), HEX);
+	Serial.print("\r\n");
+
+	const uint32_t first = resume_map_start >> RESUME_SECTOR_SHIFT;
+	const uint32_t count = resume_map_len >> RESUME_SECTOR_SHIFT;
+
+	char line[24];
+	uint8_t off = 0;
+
+	for (uint32_t i = 0 ; i < count ; i += 4)
+	{
+		if (i % 64 == 0)
+		{
+			Serial.print((first + i) << RESUME_SECTOR_SHIFT, HEX);
+			Serial.print(": ");
+		}
+
+		uint8_t nibble = 0;
+		for (uint8_t j = 0 ; j < 4 && i + j < count ; j++)
+			if (resume_get(first + i + j))
+				nibble |= 1 << j;
+
+		line[off++] = hexdigit(nibble);
+
+		if (i % 64 != 60 && i + 4 < count)
+			continue;
+
+		line[off++] = '\r';
+		line[off++] = '\n';
+		line[off++] = '\0';
+		Serial.print(line);
+		off = 0;
+	}
+}
@@ -0,0 +1,57 @@
+/** \file
+ * Multi-pattern search of the flash.
+ *
+ * All of the patterns are packed into one 64-bit shift-and (bitap)
+ * state, with a table of which pattern bits each byte value matches,
+ * so every pattern is checked with a shift, an or and an and per byte
+ * of flash.  The state carries on from one read to the next, which
+ * finds matches that cross a block boundary.  The pattern lengths add
+ * up to at most SEARCH_BITS bytes; the table costs 2 KB of RAM.
+ */
+#ifndef _search_h_
+#define _search_h_
+
+#include <stdint.h>
+
+#define SEARCH_BITS		64
+#define SEARCH_PATTERNS		8
+
+typedef struct
+{
+	uint64_t mask[256]; // bits of the pattern bytes that match each value
+	uint64_t first; // first bit of each pattern
+	uint64_t last; // last bit of each pattern
+	uint64_t state;
+	uint8_t count;
+	uint8_t bits; // used so far
+	uint8_t end_bit[SEARCH_PATTERNS]; // to find which pattern matched
+	uint8_t len[SEARCH_PATTERNS];
+} search_t;
+
+
+void
+search_init(
+	search_t * const s
+);
+
+
+/** Add a pattern.
+ * \return its index, or -1 if there is no room left.
+ */
+int
+search_add(
+	search_t * const s,
+	const uint8_t * const pattern,
+	uint8_t len
+);
+
+
+/** Search parse "ADDR LEN [HEX...]" and print "M index addr" for each
+ * match of the built in patterns and any given as hex bytes, then
+ * "S count", or "S count abort" if the host sent anything before
+ * the end of the range.
+ */
+void
+search_interactive(void);
+
+#endif
@@ -0,0 +1,204 @@
+/**
+ * \file Multi-pattern search
+ *
+ * See search.h.  Pattern byte i of a pattern that starts at bit b is
+ * bit b + i of the state, so after each byte the state has bit b + i
+ * set for every pattern whose first i + 1 bytes match the flash just
+ * read, and a pattern matches when its last bit is set.
+ */
+
+#include "search.h"
+
+// built in patterns, always searched for first
+static const uint8_t search_ifd[] = { 0x5A, 0xA5, 0xF0, 0x0F }; // 0x0FF0A55A
+static const uint8_t search_fvh[] = { '_', 'F', 'V', 'H' };
+
+static search_t search_state;
+
+// how long to wait for the \n of a \r\n after the command line
+#define SEARCH_LF_MS	10
+
+
+void
+search_init(
+	search_t * const s
+)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+
+int
+search_add(
+	search_t * const s,
+	const uint8_t * const pattern,
+	uint8_t len
+)
+{
+	if (len == 0 || s->count == SEARCH_PATTERNS || s->bits + len > SEARCH_BITS)
+		return -1;
+
+	const uint8_t b = s->bits;
+	for (uint8_t i = 0 ; i < len ; i++)
+		s->mask[pattern[i]] |= 1ull << (b + i);
+
+	s->first |= 1ull << b;
+	s->last |= 1ull << (b + len - 1);
+	s->end_bit[s->count] = b + len - 1;
+	s->len[s->count] = len;
+	s->bits += len;
+
+	return s->count++;
+}
+
+
+/** Run the matcher over a buffer of flash read from addr.
+ * \return the number of matches.
+ */
+static uint32_t
+search_block(
+	search_t * const s,
+	uint32_t addr,
+	const uint8_t * const buf,
+	size_t len
+)
+{
+	uint64_t state = s->state;
+	const uint64_t first = s->first;
+	const uint64_t last = s->last;
+	uint32_t matches = 0;
+
+	for (size_t i = 0 ; i < len ; i++)
+	{
+		state = ((state << 1) | first) & s->mask[buf[i]];
+		if ((state & last) == 0)
+			continue;
+
+		for (uint8_t p = 0 ; p < s->count ; p++)
+		{
+			if ((state & (1ull << s->end_bit[p])) == 0)
+				continue;
+
+			Serial.print("M ");
+			Serial.print(p);
+			Serial.print(' ');
+			Serial.print(addr + i + 1 - s->len[p], HEX);
+			Serial.print("\r\n");
+			matches++;
+		}
+	}
+
+	s->state = state;
+	return matches;
+}
+
+
+/** Read a pattern as pairs of hex digits.
+ * \return the length, or -1 if it has an odd number of digits or is
+ * longer than max, with the character that ended it in usb_serial_term.
+ */
+static int
+search_readpattern(
+	uint8_t * const buf,
+	uint8_t max
+)
+{
+	uint8_t len = 0;
+	uint8_t digits = 0;
+	bool too_long = false;
+
+	while (1)
+	{
+		const int c = usb_serial_getchar_echo();
+		uint8_t x;
+		if ('0' <= c && c <= '9')
+			x = c - '0';
+		else
+		if ('A' <= c && c <= 'F')
+			x = c - 'A' + 0xA;
+		else
+		if ('a' <= c && c <= 'f')
+			x = c - 'a' + 0xA;
+		else {
+			usb_serial_term = c;
+			return too_long || (digits & 1) ? -1 : len;
+		}
+
+		if (digits == 2 * max)
+		{
+			too_long = true;
+			continue;
+		}
+
+		if (digits++ & 1)
+			buf[len++] |= x;
+		else
+			buf[len] = x << 4;
+	}
+}
+
+
+
+void
+search_interactive(void)
+{
+	const uint32_t start = usb_serial_readhex();
+	const uint32_t len = usb_serial_readhex();
+	search_t * const s = &search_state;
+
+	search_init(s);
+	search_add(s, search_ifd, sizeof(search_ifd));
+	search_add(s, search_fvh, sizeof(search_fvh));
+
+	bool fail = false;
+	while (usb_serial_term == ' ')
+	{
+		uint8_t pattern[SEARCH_BITS];
+		const int n = search_readpattern(pattern, sizeof(pattern));
+		if (n < 0 || (n && search_add(s, pattern, n) < 0))
+			fail = true;
+	}
+
+	// eat the \n of a \r\n, which would otherwise look like the host
+	// asking to stop.  anything else is a real request to stop.
+	bool stop = false;
+	if (usb_serial_term == '\r')
+	{
+		const uint32_t lf_start = millis();
+		while (!Serial.available() && millis() - lf_start < SEARCH_LF_MS)
+			;
+		if (Serial.available() && Serial.read() != '\n')
+			stop = true;
+	}
+
+	spi_chip_detect();
+	if (fail || len == 0 || start >= spi_chip.size || len > spi_chip.size - start)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	uint8_t buf[SPI_PAGE_SIZE];
+	uint32_t matches = 0;
+
+	spi_bus_claim();
+
+	for (uint32_t offset = 0 ; offset < len && !stop ; offset += sizeof(buf))
+	{
+		const uint32_t n = len - offset < sizeof(buf) ? len - offset : sizeof(buf);
+		spi_read_bulk(start + offset, buf, n);
+		matches += search_block(s, start + offset, buf, n);
+
+		// stop if the host sends anything
+		if (Serial.available() && offset + n < len)
+			stop = true;
+	}
+
+	spi_bus_release();
+
+	Serial.print("S ");
+	Serial.print(matches, HEX);
+	if (stop)
+		Serial.print(" abort");
+	Serial.print("\r\n");
+}
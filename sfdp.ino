@@ -0,0 +1,468 @@
+/**
+ * \file Chip detection from RDID and the JEDEC SFDP tables
+ *
+ * The Serial Flash Discoverable Parameters are read with command 0x5A,
+ * a 3-byte address and one dummy byte.  The header points to a list of
+ * parameter tables; the JEDEC Basic Flash Parameter table (JESD216)
+ * has the density, erase types, page size and fast read modes.
+ */
+
+#include "chip.h"
+
+#define SPI_CMD_RDSFDP		0x5A // Read SFDP tables
+
+#define SFDP_SIGNATURE		0x50444653 // "SFDP"
+#define SFDP_BASIC_DWORDS	16
+#define SFDP_4BAIT_ID		0x84 // 4-byte address instruction table
+
+spi_chip_t spi_chip;
+
+
+static void
+spi_chip_default_erase(void)
+{
+	memset(spi_chip.erase, 0, sizeof(spi_chip.erase));
+
+	spi_chip.erase[0].shift = 12;
+	spi_chip.erase[0].opcode = SPI_CMD_SE;
+	spi_chip.erase[0].timeout_ms = SPI_TIMEOUT_4K_MS;
+	spi_chip.erase[1].shift = 15;
+	spi_chip.erase[1].opcode = SPI_CMD_BE32;
+	spi_chip.erase[1].timeout_ms = SPI_TIMEOUT_32K_MS;
+	spi_chip.erase[2].shift = 16;
+	spi_chip.erase[2].opcode = SPI_CMD_BE;
+	spi_chip.erase[2].timeout_ms = SPI_TIMEOUT_64K_MS;
+}
+
+
+void
+spi_chip_default(void)
+{
+	memset(&spi_chip, 0, sizeof(spi_chip));
+
+	spi_chip.size = 8ul << 20;
+	spi_chip.page_size = 256;
+	spi_chip.addr_mode = SPI_ADDR_3;
+	spi_chip.page_timeout_ms = SPI_TIMEOUT_PAGE_MS;
+	spi_chip.chip_erase_timeout_ms = SPI_TIMEOUT_CHIP_MS;
+
+	spi_chip_default_erase();
+	spi_profile_select();
+}
+
+
+static void
+spi_read_id(
+	uint8_t * const id
+)
+{
+	spi_cs(1);
+	spi_send(SPI_CMD_RDID);
+	id[0] = spi_send(0);
+	id[1] = spi_send(0);
+	id[2] = spi_send(0);
+	spi_cs(0);
+}
+
+
+static void
+spi_sfdp_read(
+	uint32_t addr,
+	uint8_t * const buf,
+	size_t len
+)
+{
+	spi_cs(1);
+	spi_send(SPI_CMD_RDSFDP);
+	spi_send(addr >> 16);
+	spi_send(addr >>  8);
+	spi_send(addr >>  0);
+	spi_send(0); // dummy byte
+	SPI.transfer(buf, len);
+	spi_cs(0);
+}
+
+
+static inline uint32_t
+sfdp_dword(
+	const uint8_t * const p
+)
+{
+	return ((uint32_t) p[0] <<  0)
+	     | ((uint32_t) p[1] <<  8)
+	     | ((uint32_t) p[2] << 16)
+	     | ((uint32_t) p[3] << 24);
+}
+
+
+/** Opcode and dummy clocks from one half of an SFDP fast read DWORD */
+static void
+sfdp_fast_read(
+	spi_fast_read_t * const mode,
+	uint16_t bits
+)
+{
+	mode->opcode = bits >> 8;
+	mode->dummy = ((bits >> 0) & 0x1F) + ((bits >> 5) & 0x7);
+}
+
+
+/** Timeout for a typical time from the SFDP tables.
+ * The tables give the typical time and a multiplier for the
+ * worst case; this allows twice the worst case.
+ */
+static uint32_t
+sfdp_timeout_ms(
+	uint32_t typical_us,
+	uint8_t multiplier
+)
+{
+	const uint32_t max_us = 2 * (multiplier + 1) * typical_us;
+	return (2 * max_us + 999) / 1000;
+}
+
+
+/** Guess the size from the RDID capacity byte.
+ * Most vendors use log2 of the size in bytes; Micron continues
+ * from 0x20 for 64 MB and up.
+ */
+static void
+spi_chip_guess(void)
+{
+	const uint8_t cap = spi_chip.id[2];
+
+	if (0x10 <= cap && cap <= 0x1F)
+		spi_chip.size = 1ul << cap;
+	else
+	if (0x20 <= cap && cap <= 0x22)
+		spi_chip.size = 1ul << (cap - 0x20 + 26);
+
+	// parts above 16 MB need 4-byte addresses for the top half
+	if (spi_chip.size > (1ul << 24))
+		spi_chip.addr_mode = SPI_ADDR_3OR4;
+}
+
+
+/** Parse the JEDEC basic flash parameter table.
+ * \return 0 if it was found, -1 if the chip has no SFDP.
+ */
+static int
+spi_chip_sfdp(void)
+{
+	uint8_t hdr[8];
+	spi_sfdp_read(0, hdr, sizeof(hdr));
+
+	if (sfdp_dword(hdr) != SFDP_SIGNATURE)
+		return -1;
+
+	// the first parameter header is always the JEDEC basic table.
+	// a 4-byte address instruction table means the part has the
+	// 4-byte opcodes even if it is too old to say so in DWORD 16.
+	const uint8_t headers = hdr[6] + 1;
+	uint8_t ph[8];
+	uint8_t basic[8];
+	bool found = false;
+	uint8_t i;
+
+	for (i = 0 ; i < headers ; i++)
+	{
+		spi_sfdp_read(8 + 8 * i, ph, sizeof(ph));
+		if (ph[7] != 0xFF)
+			continue;
+
+		if (ph[0] == SFDP_4BAIT_ID)
+			spi_chip.addr_enter |= SFDP_ENTER_4OP;
+
+		if (ph[0] == 0x00 && !found)
+		{
+			memcpy(basic, ph, sizeof(basic));
+			found = true;
+		}
+	}
+
+	if (!found)
+		return -1;
+
+	uint8_t dwords = basic[3];
+	if (dwords > SFDP_BASIC_DWORDS)
+		dwords = SFDP_BASIC_DWORDS;
+	if (dwords < 2)
+		return -1;
+
+	const uint32_t ptr = sfdp_dword(&basic[4]) & 0xFFFFFF;
+	uint8_t raw[SFDP_BASIC_DWORDS * 4];
+	uint32_t dw[SFDP_BASIC_DWORDS];
+
+	memset(raw, 0, sizeof(raw));
+	spi_sfdp_read(ptr, raw, dwords * 4);
+	for (i = 0 ; i < SFDP_BASIC_DWORDS ; i++)
+		dw[i] = sfdp_dword(&raw[4 * i]);
+
+	// DWORD 2: density in bits
+	if (dw[1] & 0x80000000)
+		spi_chip.size = 1ul << ((dw[1] & 0x7FFFFFFF) - 3);
+	else
+		spi_chip.size = (dw[1] + 1) / 8;
+
+	// DWORD 1: address bytes and which fast reads are supported
+	spi_chip.addr_mode = (dw[0] >> 17) & 0x3;
+
+	if (dw[0] & (1ul << 16))
+		sfdp_fast_read(&spi_chip.read_112, dw[3] >>  0);
+	if (dw[0] & (1ul << 20))
+		sfdp_fast_read(&spi_chip.read_122, dw[3] >> 16);
+	if (dw[0] & (1ul << 21))
+		sfdp_fast_read(&spi_chip.read_144, dw[2] >>  0);
+	if (dw[0] & (1ul << 22))
+		sfdp_fast_read(&spi_chip.read_114, dw[2] >> 16);
+
+	// DWORD 1 bits 4 and 3: the status register is volatile, and
+	// written after 0x50 or 0x06.  DWORD 16 says it in more detail.
+	if (dw[0] & (1ul << 4))
+		spi_chip.sr_volatile_wren = (dw[0] & (1ul << 3)) ? SPI_CMD_WREN : SPI_CMD_WREN_VSR;
+
+	// DWORDs 8 and 9: erase types.  Before those, DWORD 1 only
+	// says if there is a 4K erase.  Keep the defaults if the
+	// table does not list any.
+	memset(spi_chip.erase, 0, sizeof(spi_chip.erase));
+
+	if (dwords >= 9)
+	{
+		for (i = 0 ; i < SPI_CHIP_ERASE_TYPES ; i++)
+		{
+			const uint16_t type = dw[7 + i / 2] >> (16 * (i % 2));
+			spi_chip.erase[i].shift = type & 0xFF;
+			spi_chip.erase[i].opcode = type >> 8;
+			spi_chip.erase[i].timeout_ms = SPI_TIMEOUT_64K_MS;
+		}
+	} else
+	if ((dw[0] & 0x3) == 0x1)
+	{
+		spi_chip.erase[0].shift = 12;
+		spi_chip.erase[0].opcode = dw[0] >> 8;
+		spi_chip.erase[0].timeout_ms = SPI_TIMEOUT_4K_MS;
+	}
+
+	// DWORD 10: typical erase times for each type, in
+	// units of 1 ms, 16 ms, 128 ms or 1 s
+	if (dwords >= 10)
+	{
+		static const uint32_t units_us[] = { 1000, 16000, 128000, 1000000 };
+
+		for (i = 0 ; i < SPI_CHIP_ERASE_TYPES ; i++)
+		{
+			const uint8_t field = dw[9] >> (4 + 7 * i);
+			const uint32_t typical_us = ((field & 0x1F) + 1) * units_us[(field >> 5) & 0x3];
+			spi_chip.erase[i].timeout_ms = sfdp_timeout_ms(typical_us, dw[9] & 0xF);
+		}
+	}
+
+	// DWORD 11: page size, typical page program time in units of
+	// 8 or 64 us, and chip erase time in units of 16 ms, 256 ms, 4 s
+	// or 64 s.  The chip erase uses the erase multiplier from DWORD 10.
+	if (dwords >= 11)
+	{
+		static const uint32_t chip_units_ms[] = { 16, 256, 4000, 64000 };
+		const uint8_t mult = dw[10] & 0xF;
+
+		spi_chip.page_size = 1u << ((dw[10] >> 4) & 0xF);
+
+		const uint8_t pp = dw[10] >> 8;
+		const uint32_t pp_us = ((pp & 0x1F) + 1) * ((pp & 0x20) ? 64 : 8);
+		spi_chip.page_timeout_ms = sfdp_timeout_ms(pp_us, mult);
+
+		const uint8_t ce = dw[10] >> 24;
+		const uint32_t ce_ms = ((ce & 0x1F) + 1) * chip_units_ms[(ce >> 5) & 0x3];
+		spi_chip.chip_erase_timeout_ms = 2 * 2 * ((dw[9] & 0xF) + 1) * ce_ms;
+	}
+
+	// DWORD 15: quad enable requirements
+	if (dwords >= 15)
+	{
+		static const uint8_t qe[8] = {
+			SPI_QE_NONE, SPI_QE_UNKNOWN, SPI_QE_SR1_BIT6, SPI_QE_UNKNOWN,
+			SPI_QE_SR2_BIT1, SPI_QE_SR2_BIT1, SPI_QE_SR2_BIT1_31, SPI_QE_UNKNOWN,
+		};
+		spi_chip.quad_enable = qe[(dw[14] >> 20) & 0x7];
+	}
+
+	// DWORD 16: how to get to 4-byte addresses, and bits 6:0 for
+	// how status register 1 is written.  Bits 2 and 3 have a volatile
+	// copy written after 0x50, bit 1 is a volatile register written
+	// after 0x06; anything else is nonvolatile only.
+	if (dwords >= 16)
+	{
+		spi_chip.addr_enter |= dw[15] >> 24;
+
+		if (dw[15] & 0xC)
+			spi_chip.sr_volatile_wren = SPI_CMD_WREN_VSR;
+		else
+		if (dw[15] & 0x2)
+			spi_chip.sr_volatile_wren = SPI_CMD_WREN;
+		else
+		if (dw[15] & 0x7F)
+			spi_chip.sr_volatile_wren = 0;
+	}
+
+	// sort the erase types by size, with unused ones at the end
+	for (i = 1 ; i < SPI_CHIP_ERASE_TYPES ; i++)
+	{
+		const spi_erase_type_t e = spi_chip.erase[i];
+		uint8_t j = i;
+
+		while (j > 0 && e.shift != 0
+		&& (spi_chip.erase[j-1].shift == 0 || spi_chip.erase[j-1].shift > e.shift))
+		{
+			spi_chip.erase[j] = spi_chip.erase[j-1];
+			j--;
+		}
+
+		spi_chip.erase[j] = e;
+	}
+
+	if (spi_chip.erase[0].shift == 0)
+		spi_chip_default_erase();
+
+	return 0;
+}
+
+
+void
+spi_chip_addr_auto(void)
+{
+	const uint8_t enter = spi_chip.addr_enter;
+	uint8_t method;
+
+	// out of 4-byte mode and back to bank 0 with the old method,
+	// so that the new one starts from what the chip really has
+	spi_addr_restore();
+
+	if (spi_chip.size <= SPI_BANK_SIZE)
+		method = SPI_ADDR_METHOD_3;
+	else
+	if (enter & (SFDP_ENTER_4OP | SFDP_ENTER_ALWAYS))
+		method = SPI_ADDR_METHOD_4OP;
+	else
+	if (enter & (SFDP_ENTER_4B | SFDP_ENTER_4B_WREN))
+		method = SPI_ADDR_METHOD_EN4B;
+	else
+	if (enter & SFDP_ENTER_BANK)
+		method = SPI_ADDR_METHOD_BANK;
+	else
+		// nothing known; most large parts have the 4-byte opcodes
+		method = SPI_ADDR_METHOD_4OP;
+
+	spi_chip.addr_method = method;
+}
+
+
+int
+spi_chip_probe(void)
+{
+	// the defaults forget the address method, so undo it first
+	spi_addr_restore();
+	spi_chip_default();
+	spi_read_id(spi_chip.id);
+
+	const uint8_t * const id = spi_chip.id;
+	if ((id[0] == 0xFF && id[1] == 0xFF && id[2] == 0xFF)
+	||  (id[0] == 0x00 && id[1] == 0x00 && id[2] == 0x00))
+		return -1;
+
+	spi_chip_guess();
+	spi_chip.sfdp = spi_chip_sfdp() == 0;
+	spi_chip.valid = 1;
+	spi_chip_addr_auto();
+	spi_profile_select();
+
+	return 0;
+}
+
+
+void
+spi_chip_detect(void)
+{
+	if (!spi_chip.valid)
+		spi_chip_probe();
+}
+
+
+const spi_erase_type_t *
+spi_chip_erase_type(
+	uint32_t size
+)
+{
+	for (uint8_t i = 0 ; i < SPI_CHIP_ERASE_TYPES ; i++)
+	{
+		const spi_erase_type_t * const e = &spi_chip.erase[i];
+		if (spi_erase_usable(e) && (1ul << e->shift) == size)
+			return e;
+	}
+
+	return NULL;
+}
+
+
+static void
+spi_chip_print_read(
+	const char * const name,
+	const spi_fast_read_t * const mode
+)
+{
+	if (!mode->opcode)
+		return;
+
+	Serial.print(name);
+	Serial.print(mode->opcode, HEX);
+	Serial.print('/');
+	Serial.print(mode->dummy);
+}
+
+
+void
+spi_chip_print(void)
+{
+	Serial.print("id ");
+	for (uint8_t i = 0 ; i < 3 ; i++)
+	{
+		Serial.print(hexdigit(spi_chip.id[i] >> 4));
+		Serial.print(hexdigit(spi_chip.id[i] >> 0));
+	}
+
+	Serial.print(spi_chip.sfdp ? " sfdp" : spi_chip.valid ? " rdid" : " none");
+	Serial.print(" size ");
+	Serial.print(spi_chip.size, HEX);
+	Serial.print(" page ");
+	Serial.print(spi_chip.page_size, HEX);
+	Serial.print(" addr ");
+	Serial.print(spi_chip.addr_mode == SPI_ADDR_3 ? "3"
+		: spi_chip.addr_mode == SPI_ADDR_4 ? "4" : "3/4");
+	Serial.print(' ');
+	Serial.print(spi_addr_method_names[spi_chip.addr_method]);
+
+	Serial.print(" erase");
+	for (uint8_t i = 0 ; i < SPI_CHIP_ERASE_TYPES ; i++)
+	{
+		const spi_erase_type_t * const e = &spi_chip.erase[i];
+		if (e->shift == 0)
+			continue;
+		Serial.print(' ');
+		Serial.print(1ul << e->shift, HEX);
+		Serial.print(':');
+		Serial.print(e->opcode, HEX);
+	}
+
+	Serial.print(" read");
+	spi_chip_print_read(" 112:", &spi_chip.read_112);
+	spi_chip_print_read(" 122:", &spi_chip.read_122);
+	spi_chip_print_read(" 114:", &spi_chip.read_114);
+	spi_chip_print_read(" 144:", &spi_chip.read_144);
+	Serial.print(" qe ");
+	Serial.print(spi_chip.quad_enable);
+	if (spi_chip.sr_volatile_wren)
+	{
+		Serial.print(" vsr:");
+		Serial.print(spi_chip.sr_volatile_wren, HEX);
+	}
+	Serial.print("\r\n");
+}
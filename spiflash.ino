@@ -1,7 +1,9 @@
 /**
- * \file SPI Flash reader for the Teensy 3.
+ * \file SPI Flash reader for the Teensy 3 and 4.
  *
- * Fast reader for SPI flashes, using the native SPI hardware of the Teensy 3.
+ * Fast reader for SPI flashes, using the native SPI hardware of the Teensy 3,
+ * or LPSPI on the Teensy 4.  The Teensy 4.1 can also read with FlexSPI2 two
+ * or four bits at a time if WP# and HOLD# are wired up; see flexspi.h.
  * Build this with the Teensyduino environment and flash it to the
  * microcontroller.
  *
@@ -47,44 +49,82 @@ SPI (spd ckp ske smp csl hiz)=( 4 0 1 0 1 0 )
  * {0x95,0,0]
  *
  */
-#include <SPI.h>
+#include "hal.h"
 #include "xmodem.h"
+#include "stream.h"
+#include "crc.h"
+#include "chip.h"
+#include "bench.h"
+#include "lz.h"
+#include "bincmd.h"
+#include "resume.h"
+#include "gang.h"
+#include "search.h"
+#include "ifd.h"
+#include "flexspi.h"
 
 #ifdef CONFIG_SKETCHSAVER
 #include "SketchSaver/SketchSaver.h"
 #endif
 
-#if 1
-// teensy 3 pins
-#define SPI_CS   10 // white or yellow
-#define SPI_SCLK 13 // green
-#define SPI_MOSI 11 // blue or purple
-#define SPI_MISO 12 // brown
-#else
+#if defined(__AVR__)
 // teensy 2 pins
 #define SPI_CS   0 // white or yellow
 #define SPI_SCLK 1 // green
 #define SPI_MOSI 3 // blue or purple
 #define SPI_MISO 4 // brown
+#define SPI_CS_GANG { SPI_CS }
+#else
+// teensy 3 and teensy 4 pins, which are the same.  LPSPI4 on the
+// teensy 4 reaches the faster read profiles that the teensy 3 rounds
+// down.
+#define SPI_CS   10 // white or yellow
+#define SPI_SCLK 13 // green
+#define SPI_MOSI 11 // blue or purple
+#define SPI_MISO 12 // brown
+
+// chip selects for gang programming, sharing SCLK, MOSI and MISO
+#define SPI_CS_GANG { SPI_CS, 9, 8, 7 }
 #endif
 
+static const uint8_t spi_cs_pins[] = SPI_CS_GANG;
+#define SPI_CS_COUNT (sizeof(spi_cs_pins) / sizeof(*spi_cs_pins))
+
+// the chip that commands go to; see spi_cs_select()
+static uint8_t spi_cs_pin = SPI_CS;
+static uint8_t spi_cs_index;
+
+// the other chip selects are left alone until a gang chip is selected
+static bool spi_cs_gang;
+
 #define SPI_PAGE_SIZE	4096
 #define SPI_PAGE_MASK	(SPI_PAGE_SIZE - 1)
 
 // Flash commands
 #define SPI_CMD_WREN		0x06 // Write Enable
+#define SPI_CMD_WREN_VSR	0x50 // Write Enable for Volatile Status Register
 #define SPI_CMD_RDID		0x9F // Read ID
 #define SPI_CMD_RDSR		0x05 // Read status register
 #define SPI_CMD_WRSR		0x01 // Write status register
 #define SPI_CMD_READ		0x03 // Read data bytes
 #define SPI_CMD_READ4		0x13 // Read data bytes with 4-byte address
 #define SPI_CMD_FAST_READ	0x0B // Read at higher speed
+#define SPI_CMD_FAST_READ4	0x0C // Fast read with 4-byte address
 #define SPI_CMD_SE		0x20 // Sector erase
 #define SPI_CMD_SE4		0x21 // Sector erase with 4-byte address
+#define SPI_CMD_BE32		0x52 // 32K block erase
+#define SPI_CMD_BE32_4		0x5C // 32K block erase with 4-byte address
+#define SPI_CMD_BE		0xD8 // 64K block erase
+#define SPI_CMD_BE4		0xDC // 64K block erase with 4-byte address
+#define SPI_CMD_CE		0xC7 // Chip erase
 #define SPI_CMD_PP		0x02 // Page Program (write to flash)
 #define SPI_CMD_PP4		0x12 // Page Program with 4-byte address
 #define SPI_CMD_BRRD		0x16 // Read bank address register
 #define SPI_CMD_BRWR		0x17 // Write bank address register
+#define SPI_CMD_EN4B		0xB7 // Enter 4-byte address mode
+#define SPI_CMD_EX4B		0xE9 // Exit 4-byte address mode
+
+#define SPI_BANK_SIZE		(1ul << 24) // reach of a 3-byte address
 
 
 // Status Register bits
@@ -93,26 +133,171 @@ SPI (spd ckp ske smp csl hiz)=( 4 0 1 0 1 0 )
 #define SPI_WEL			0x02 // Write Enable
 
 
-static unsigned long chip_size; // in MB
-
-// 40 MHz for teensy 3
+// Conservative clock for program, erase and status commands
 static SPISettings spi_settings(10000000, MSBFIRST, SPI_MODE0);
 
+// Clock profiles for reads.  Most parts only allow the plain READ
+// command up to 25-50 MHz, so the faster profiles use FAST_READ,
+// which adds a dummy byte after the address.  The SPI library
+// rounds the clock down to what the Teensy can generate.
+typedef struct
+{
+	uint32_t clock;
+	uint8_t fast;
+} spi_read_profile_t;
+
+static const spi_read_profile_t spi_read_profiles[] = {
+	{  4000000, 0 },
+	{ 10000000, 0 },
+	{ 20000000, 1 },
+	{ 30000000, 1 },
+	{ 40000000, 1 },
+	{ 60000000, 1 },
+};
+
+#define SPI_READ_PROFILES (sizeof(spi_read_profiles) / sizeof(*spi_read_profiles))
+
+// 10 MHz READ, the speed that every clip and part has been fine
+// with; 'a' finds a faster profile that the wiring can take
+#define SPI_READ_PROFILE_DEFAULT 1
+
+// all three are set by spi_read_profile_set(), starting from setup()
+static uint8_t spi_read_profile;
+static uint8_t spi_read_fast; // from the profile, unless benchmarking
+static SPISettings spi_read_settings;
+
+// While an engine holds the bus with spi_bus_claim(), the SPI
+// transaction stays open between commands and chip select is only a
+// GPIO write.  The transaction is only restarted if a command needs
+// different settings.
+static uint8_t spi_bus_held;
+static bool spi_bus_ready; // pins are outputs and SPI.begin() has run
+static const SPISettings * spi_bus_settings; // open transaction
+
+
+static void
+spi_read_profile_set(
+	uint8_t profile
+)
+{
+	if (profile >= SPI_READ_PROFILES)
+		profile = SPI_READ_PROFILES - 1;
+
+	// the open transaction has the old clock
+	if (spi_bus_settings == &spi_read_settings)
+	{
+		SPI.endTransaction();
+		spi_bus_settings = NULL;
+	}
+
+	spi_read_profile = profile;
+	spi_read_fast = spi_read_profiles[profile].fast;
+	spi_read_settings = SPISettings(
+		spi_read_profiles[profile].clock,
+		MSBFIRST,
+		SPI_MODE0
+	);
+}
+
+
+/** Set the mode of the chip selects in use: only SPI_CS, or all of
+ * them once gang mode has selected another chip.  As outputs they are
+ * driven high, so that only the selected chip ever sees a command.
+ */
+static void
+spi_cs_pins_mode(
+	int mode
+)
+{
+	const uint8_t count = spi_cs_gang ? SPI_CS_COUNT : 1;
+
+	for (uint8_t n = 0 ; n < count ; n++)
+	{
+		if (mode == OUTPUT)
+			digitalWrite(spi_cs_pins[n], HIGH);
+		pinMode(spi_cs_pins[n], mode);
+		if (mode != OUTPUT)
+			digitalWrite(spi_cs_pins[n], 0);
+	}
+}
+
+
 static inline void
-spi_cs(int i)
+spi_cs_settings(
+	int i,
+	const SPISettings & settings
+)
 {
+	if (spi_bus_held)
+	{
+		if (!i)
+		{
+			digitalWriteFast(spi_cs_pin, HIGH);
+			return;
+		}
+
+		if (spi_bus_settings != &settings)
+		{
+			if (spi_bus_settings)
+				SPI.endTransaction();
+			SPI.beginTransaction(settings);
+			spi_bus_settings = &settings;
+		}
+
+		digitalWriteFast(spi_cs_pin, LOW);
+		return;
+	}
+
 	// switch out of tristate mode, if we're in it
 
 	if (i)
 	{
-		pinMode(SPI_CS, OUTPUT);
+		spi_cs_pins_mode(OUTPUT);
 		SPI.begin();
-		SPI.beginTransaction(spi_settings);
+		spi_bus_ready = true;
+		SPI.beginTransaction(settings);
 	} else {
 		SPI.endTransaction();
 	}
 
-	digitalWrite(SPI_CS, !i);
+	digitalWrite(spi_cs_pin, !i);
+}
+
+
+static inline void
+spi_cs(int i)
+{
+	spi_cs_settings(i, spi_settings);
+}
+
+
+/** Hold the bus for the length of an operation.
+ * Calls nest, and each one must be paired with spi_bus_release().
+ */
+static void
+spi_bus_claim(void)
+{
+	if (!spi_bus_ready)
+	{
+		// switch out of tristate mode, if we're in it
+		spi_cs_pins_mode(OUTPUT);
+		SPI.begin();
+		spi_bus_ready = true;
+	}
+
+	spi_bus_held++;
+}
+
+
+static void
+spi_bus_release(void)
+{
+	if (spi_bus_held == 0 || --spi_bus_held != 0)
+		return;
+
+	if (spi_bus_settings)
+		SPI.endTransaction();
+	spi_bus_settings = NULL;
 }
 
 
@@ -121,17 +306,34 @@ spi_cs(int i)
 void
 setup()
 {
+#if defined(__IMXRT1062__)
+	// the startup code's PSRAM probe leaves the memory pads as
+	// FlexSPI2 outputs, which are wired to the LPSPI pins too
+	flexspi_end();
+#endif
+
 	Serial.begin(115200);
 	SPI.begin();
 	
 	// keep the SPI flash unselected until we talk to it
-	pinMode(SPI_CS, OUTPUT);
+	spi_cs_pins_mode(OUTPUT);
 	spi_cs(0);
 
-	chip_size = 8;
+	spi_read_profile_set(SPI_READ_PROFILE_DEFAULT);
+	spi_chip_default();
+	cycles_init();
+	resume_init();
 }
 
 
+// the character that ended the last usb_serial_readhex(),
+// so that commands can take optional trailing arguments
+static int usb_serial_term;
+
+// how many hex digits it read, to tell a missing argument from a 0
+static uint8_t usb_serial_digits;
+
+
 static int
 usb_serial_getchar_echo()
 {
@@ -151,7 +353,9 @@ usb_serial_getchar_echo()
 }
 
 
-static xmodem_block_t xmodem_block;
+// Two blocks so that the next one can be read from the flash
+// while the host is still checking the previous one.
+static xmodem_block_t xmodem_blocks[2];
 
 
 static char
@@ -176,7 +380,164 @@ spi_send(
 }
 
 
-// Select a 4-byte or 3-byte address for the read command
+static const char * const spi_addr_method_names[SPI_ADDR_METHODS] = {
+	"3byte", "4op", "en4b", "bank",
+};
+
+// Addressing state for parts above 16 MB; see spi_addr_prepare().
+// Each chip of a gang has its own, since switching chips does not
+// change what mode each one is in.
+typedef struct
+{
+	uint8_t bank; // only if bank_known
+	bool bank_known;
+	bool mode_4b; // EN4B has been sent
+} spi_addr_state_t;
+
+static spi_addr_state_t spi_addr_states[SPI_CS_COUNT];
+static spi_addr_state_t * spi_addr = &spi_addr_states[0];
+
+
+/** Forget the bank and 4-byte mode, after the chip may have been
+ * reset or the bank register was written by hand.  Before changing
+ * the address method use spi_addr_restore(), which also puts the
+ * chip back.
+ */
+static void
+spi_addr_reset(void)
+{
+	memset(spi_addr, 0, sizeof(*spi_addr));
+}
+
+
+/** Get the chip ready for a command at addr, with the address method
+ * that was picked at detect time.  In 4-byte mode the chip is put into
+ * it the first time; with the bank register, BRWR is only sent when
+ * the bank changes.  Must be called with the chip deselected.
+ * \return 1 if a command was sent, which may have cleared WEL.
+ */
+static int
+spi_addr_prepare(
+	uint32_t addr
+)
+{
+	if (spi_chip.addr_method == SPI_ADDR_METHOD_EN4B && !spi_addr->mode_4b)
+	{
+		if (spi_chip.addr_enter & SFDP_ENTER_4B_WREN)
+		{
+			spi_cs(1);
+			spi_send(SPI_CMD_WREN);
+			spi_cs(0);
+		}
+
+		spi_cs(1);
+		spi_send(SPI_CMD_EN4B);
+		spi_cs(0);
+		spi_addr->mode_4b = true;
+		return 1;
+	}
+
+	if (spi_chip.addr_method == SPI_ADDR_METHOD_BANK)
+	{
+		const uint8_t bank = addr >> 24;
+		if (spi_addr->bank_known && bank == spi_addr->bank)
+			return 0;
+
+		spi_cs(1);
+		spi_send(SPI_CMD_BRWR);
+		spi_send(bank);
+		spi_cs(0);
+		spi_addr->bank = bank;
+		spi_addr->bank_known = true;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/** Put the chip back in 3-byte mode with bank 0 before the bus is
+ * handed back, since that is what the target will expect at boot.
+ */
+static void
+spi_addr_restore(void)
+{
+	if (spi_addr->mode_4b)
+	{
+		spi_cs(1);
+		spi_send(SPI_CMD_EX4B);
+		spi_cs(0);
+	}
+
+	if (spi_chip.addr_method == SPI_ADDR_METHOD_BANK
+	&& (!spi_addr->bank_known || spi_addr->bank != 0))
+	{
+		spi_cs(1);
+		spi_send(SPI_CMD_BRWR);
+		spi_send(0);
+		spi_cs(0);
+	}
+
+	spi_addr_reset();
+}
+
+
+/** Send commands to chip n of the gang, with the address state that
+ * was kept for it.  The first time another chip is selected, all of
+ * the chip selects are driven from then on.
+ */
+static void
+spi_cs_select(
+	uint8_t n
+)
+{
+	if (n && !spi_cs_gang)
+	{
+		spi_cs_gang = true;
+		if (spi_bus_ready)
+			spi_cs_pins_mode(OUTPUT);
+	}
+
+	spi_cs_pin = spi_cs_pins[n];
+	spi_cs_index = n;
+	spi_addr = &spi_addr_states[n];
+}
+
+
+/** Release the bus and tristate the pins so that something else
+ * (like the motherboard) can drive the flash.
+ */
+static void
+spi_bus_tristate(void)
+{
+	if (spi_bus_ready)
+	{
+		// every chip of a gang, not just the selected one, has to
+		// be back in 3-byte mode for the target
+		const uint8_t selected = spi_cs_index;
+		const uint8_t count = spi_cs_gang ? SPI_CS_COUNT : 1;
+
+		for (uint8_t n = 0 ; n < count ; n++)
+		{
+			spi_cs_select(n);
+			spi_addr_restore();
+		}
+
+		spi_cs_select(selected);
+	}
+
+	spi_bus_held = 1;
+	spi_bus_release();
+
+	spi_cs_pins_mode(INPUT);
+	SPI.end();
+	spi_bus_ready = false;
+}
+
+
+// Send a command and its address, with the opcode and address
+// length for the address method.  spi_addr_prepare() must have
+// been called for this address first.
 static void
 spi_choose(
 	uint32_t addr,
@@ -184,12 +545,20 @@ spi_choose(
 	uint8_t cmd4
 )
 {
-	if ((addr >> 24) != 0x00)
+	switch (spi_chip.addr_method)
 	{
+	case SPI_ADDR_METHOD_4OP:
 		spi_send(cmd4);
 		spi_send(addr >> 24);
-	} else {
+		break;
+	case SPI_ADDR_METHOD_EN4B:
+		spi_send(cmd3);
+		spi_send(addr >> 24);
+		break;
+	default:
+		// 3-byte, or the bank register has the top bits
 		spi_send(cmd3);
+		break;
 	}
 
 	spi_send(addr >> 16);
@@ -198,12 +567,64 @@ spi_choose(
 }
 
 
+/** Send the read command for the current read profile.
+ * FAST_READ needs a dummy byte before the data starts.
+ */
 static void
 spi_read_command(
 	uint32_t addr
 )
 {
-	spi_choose(addr, SPI_CMD_READ, SPI_CMD_READ4);
+	if (!spi_read_fast)
+	{
+		spi_choose(addr, SPI_CMD_READ, SPI_CMD_READ4);
+		return;
+	}
+
+	spi_choose(addr, SPI_CMD_FAST_READ, SPI_CMD_FAST_READ4);
+	spi_send(0);
+}
+
+
+/** Read a block of the flash into RAM.
+ *
+ * The whole block is clocked in with one buffer transfer so that the
+ * SPI library can keep the FIFO full, rather than stalling on every
+ * byte like the spi_send() loop does.  The buffer contents are shifted
+ * out on MOSI while the data is read, which the flash ignores once the
+ * read command and address have been sent.
+ *
+ * Reads use their own clock profile; see spi_read_profile_set().
+ * With the bank register a read stops at the end of the bank, so
+ * reads that cross a 16 MB boundary are split there.
+ */
+static void
+spi_read_bulk(
+	uint32_t addr,
+	uint8_t * buf,
+	size_t len
+)
+{
+	while (len)
+	{
+		size_t n = len;
+		if (spi_chip.addr_method == SPI_ADDR_METHOD_BANK)
+		{
+			const uint32_t room = SPI_BANK_SIZE - (addr & (SPI_BANK_SIZE - 1));
+			if (n > room)
+				n = room;
+		}
+
+		spi_addr_prepare(addr);
+		spi_cs_settings(1, spi_read_settings);
+		spi_read_command(addr);
+		SPI.transfer(buf, n);
+		spi_cs_settings(0, spi_read_settings);
+
+		addr += n;
+		buf += n;
+		len -= n;
+	}
 }
 
 
@@ -215,12 +636,49 @@ spi_write_command(
 	spi_choose(addr, SPI_CMD_PP, SPI_CMD_PP4);
 }
 
+/** 4-byte address form of an erase opcode from the chip descriptor.
+ * \return 0 if there is no known one.
+ */
+static uint8_t
+spi_erase_opcode4(
+	uint8_t cmd
+)
+{
+	switch (cmd)
+	{
+	case SPI_CMD_SE: return SPI_CMD_SE4;
+	case SPI_CMD_BE32: return SPI_CMD_BE32_4;
+	case SPI_CMD_BE: return SPI_CMD_BE4;
+	default: return 0;
+	}
+}
+
+
+/** Can this erase type be sent with the current address method?
+ * With the 4-byte opcodes, a type without a 4-byte form would be
+ * sent as its 3-byte opcode with a 4-byte address and erase the
+ * wrong place, so it is skipped.
+ */
+static bool
+spi_erase_usable(
+	const spi_erase_type_t * const erase
+)
+{
+	if (erase->shift == 0)
+		return false;
+	if (spi_chip.addr_method != SPI_ADDR_METHOD_4OP)
+		return true;
+	return spi_erase_opcode4(erase->opcode) != 0;
+}
+
+
 static void
 spi_erase_command(
-	uint32_t addr
+	uint32_t addr,
+	const spi_erase_type_t * const erase
 )
 {
-	spi_choose(addr, SPI_CMD_SE, SPI_CMD_SE4);
+	spi_choose(addr, erase->opcode, spi_erase_opcode4(erase->opcode));
 }
 
 
@@ -316,6 +774,19 @@ spi_write_status(uint8_t sr)
 }
 
 
+static void
+spi_read_profile_interactive(void)
+{
+	const spi_read_profile_t * const p = &spi_read_profiles[spi_read_profile];
+
+	Serial.print("read ");
+	Serial.print(spi_read_profile);
+	Serial.print(": ");
+	Serial.print(p->clock);
+	Serial.println(p->fast ? " Hz FAST_READ" : " Hz READ");
+}
+
+
 static void
 spi_bank_address_register_interactive(void)
 {
@@ -338,6 +809,7 @@ static uint32_t
 usb_serial_readhex(void)
 {
 	uint32_t val = 0;
+	uint8_t digits = 0;
 
 	while (1)
 	{
@@ -350,9 +822,70 @@ usb_serial_readhex(void)
 		else
 		if ('a' <= c && c <= 'f')
 			val = (val << 4) | (c - 'a' + 0xA);
-		else
+		else {
+			usb_serial_term = c;
+			usb_serial_digits = digits;
 			return val;
+		}
+
+		if (digits != 0xFF)
+			digits++;
+	}
+}
+
+
+/** Called while waiting for the flash to finish a program or erase,
+ * so that other work (like receiving the next part of an upload)
+ * can go on in the meantime.
+ */
+static void (*spi_wait_hook)(void);
+
+
+/** Wait for a program or erase to finish.
+ *
+ * RDSR is sent once and the status register is then clocked out
+ * continuously under the same chip select, which the flash allows,
+ * rather than paying for a new command on every poll.  The wait hook
+ * runs between status bytes; it must not touch the SPI bus.
+ *
+ * \return 0 once WIP clears, -1 if it is still set after timeout_ms.
+ */
+static int
+spi_wait(
+	uint32_t timeout_ms
+)
+{
+	const uint32_t start = millis();
+	int rc = 0;
+
+	spi_cs(1);
+	spi_send(SPI_CMD_RDSR);
+
+	while (spi_send(0x00) & SPI_WIP)
+	{
+		if (spi_wait_hook)
+			spi_wait_hook();
+
+		if (millis() - start <= timeout_ms)
+			continue;
+
+		rc = -1;
+		break;
 	}
+
+	spi_cs(0);
+	return rc;
+}
+
+
+static void
+spi_timeout_interactive(
+	uint32_t addr
+)
+{
+	Serial.print("\r\ntimeout ");
+	Serial.print(addr, HEX);
+	Serial.print("\r\n");
 }
 
 
@@ -393,24 +926,71 @@ spi_write_enable_interactive(void)
 
 
 
-static void
-spi_erase_sector(
-	uint32_t addr
+/** Erase a sector or block with one of the chip's erase types.
+ * WEL must already be set.
+ * \return 0 on success, -1 if the erase timed out.
+ */
+static int
+spi_erase(
+	uint32_t addr,
+	const spi_erase_type_t * const erase
 )
 {
+	if (!spi_erase_usable(erase))
+		return -1;
+
+	if (spi_addr_prepare(addr))
+		spi_write_enable();
+
 	spi_cs(1);
-	spi_erase_command(addr);
+	spi_erase_command(addr, erase);
 	spi_cs(0);
 
-	while (spi_status() & SPI_WIP)
-		;
+	return spi_wait(erase->timeout_ms);
 }
 
 
-static void
-spi_erase_sector_interactive(void)
+/** The erase type for one SPI_PAGE_SIZE sector */
+static const spi_erase_type_t *
+spi_sector_erase_type(void)
 {
-	uint32_t addr = usb_serial_readhex();
+	static const spi_erase_type_t fallback = { 12, SPI_CMD_SE, SPI_TIMEOUT_4K_MS };
+	const spi_erase_type_t * const erase = spi_chip_erase_type(SPI_PAGE_SIZE);
+	return erase ? erase : &fallback;
+}
+
+
+/** Erase one SPI_PAGE_SIZE sector, using the opcode for that size
+ * from the chip descriptor.
+ */
+static int
+spi_erase_sector(
+	uint32_t addr
+)
+{
+	return spi_erase(addr, spi_sector_erase_type());
+}
+
+
+/** Erase the entire chip.  WEL must already be set. */
+static int
+spi_erase_chip(void)
+{
+	spi_cs(1);
+	spi_send(SPI_CMD_CE);
+	spi_cs(0);
+
+	return spi_wait(spi_chip.chip_erase_timeout_ms);
+}
+
+
+static void
+spi_erase_sector_interactive(void)
+{
+	uint32_t addr = usb_serial_readhex();
+
+	// above 16 MB the address method has to be known
+	spi_chip_detect();
 
 	if ((spi_status() & SPI_WEL) == 0)
 	{
@@ -418,7 +998,11 @@ spi_erase_sector_interactive(void)
 		return;
 	}
 
-	spi_erase_sector(addr);
+	if (spi_erase_sector(addr) < 0)
+	{
+		spi_timeout_interactive(addr);
+		return;
+	}
 
 	char buf[16];
 	uint8_t off = 0;
@@ -435,132 +1019,1272 @@ spi_erase_sector_interactive(void)
 	buf[off++] = '\n';
 	buf[off++] = '\0';
 
-	Serial.print(buf);
+	Serial.print(buf);
+}
+	
+static void
+spi_read(
+	uint32_t addr
+)
+{
+	//delay(2);
+	spi_chip_detect();
+
+	// read a page
+	uint8_t data[16];
+	spi_read_bulk(addr, data, sizeof(data));
+
+	char buf[16*3+8+2+3];
+	uint8_t off = 0;
+	buf[off++] = hexdigit(addr >> 28);
+	buf[off++] = hexdigit(addr >> 24);
+	buf[off++] = hexdigit(addr >> 20);
+	buf[off++] = hexdigit(addr >> 16);
+	buf[off++] = hexdigit(addr >> 12);
+	buf[off++] = hexdigit(addr >>  8);
+	buf[off++] = hexdigit(addr >>  4);
+	buf[off++] = hexdigit(addr >>  0);
+	buf[off++] = ':';
+	buf[off++] = ' ';
+
+	for (int i = 0 ; i < 16 ; i++)
+	{
+		buf[off++] = hexdigit(data[i] >> 4);
+		buf[off++] = hexdigit(data[i] >> 0);
+		buf[off++] = ' ';
+	}
+	buf[off++] = '\r';
+	buf[off++] = '\n';
+	buf[off++] = '\0';
+
+	Serial.print(buf);
+}
+
+
+/** CRC-32 of a region of the flash at the current read profile.
+ * Also reports if the region is all one value, in which case it
+ * is no good for checking the read path.
+ */
+static uint32_t
+spi_region_crc(
+	uint32_t addr,
+	uint32_t len,
+	bool * const blank
+)
+{
+	uint8_t buf[256];
+	uint32_t crc = 0;
+	uint8_t first = 0;
+
+	if (blank)
+		*blank = true;
+
+	for (uint32_t offset = 0 ; offset < len ; offset += sizeof(buf))
+	{
+		uint32_t n = len - offset;
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+
+		spi_read_bulk(addr + offset, buf, n);
+		crc = crc32_update(crc, buf, n);
+
+		if (offset == 0)
+			first = buf[0];
+
+		if (!blank || !*blank)
+			continue;
+
+		for (uint32_t i = 0 ; i < n ; i++)
+		{
+			if (buf[i] == first)
+				continue;
+			*blank = false;
+			break;
+		}
+	}
+
+	return crc;
+}
+
+
+// Number of reads that each clock profile must get right
+#define SPI_CALIBRATE_PASSES	4
+
+/** Find the fastest read clock that reads a region reliably.
+ *
+ * The region is read at the slowest profile to get the reference
+ * CRC, then each faster profile reads it SPI_CALIBRATE_PASSES times.
+ * The search stops at the first profile that reads it wrong, and the
+ * one two steps below that is kept so there is some margin.  If every
+ * profile passes, the same margin is kept below the fastest one, as
+ * if the profile after it had failed.
+ */
+static void
+spi_calibrate(void)
+{
+	const uint32_t addr = usb_serial_readhex();
+	uint32_t len = 0x10000;
+
+	if (usb_serial_term == ' ')
+		len = usb_serial_readhex();
+
+	spi_chip_detect();
+	const uint8_t old_profile = spi_read_profile;
+
+	spi_read_profile_set(0);
+	bool blank;
+	const uint32_t ref = spi_region_crc(addr, len, &blank);
+
+	if (blank)
+	{
+		Serial.println("blank region; pick one with data");
+		spi_read_profile_set(old_profile);
+		return;
+	}
+
+	uint8_t fail = SPI_READ_PROFILES;
+
+	for (uint8_t profile = 1 ; profile < SPI_READ_PROFILES ; profile++)
+	{
+		spi_read_profile_set(profile);
+
+		uint8_t pass;
+		for (pass = 0 ; pass < SPI_CALIBRATE_PASSES ; pass++)
+			if (spi_region_crc(addr, len, NULL) != ref)
+				break;
+
+		Serial.print(spi_read_profiles[profile].clock);
+		Serial.println(pass == SPI_CALIBRATE_PASSES ? " ok" : " fail");
+
+		if (pass == SPI_CALIBRATE_PASSES)
+			continue;
+
+		fail = profile;
+		break;
+	}
+
+	spi_read_profile_set(fail < 2 ? 0 : fail - 2);
+	spi_read_profile_interactive();
+}
+
+
+/** Read len bytes of the ROM from start out to the serial port.
+ * \return the CRC-32 of what was sent.
+ */
+static uint32_t
+spi_dump(
+	uint32_t start,
+	uint32_t len
+)
+{
+	uint8_t buf[SPI_PAGE_SIZE];
+	uint32_t crc = 0;
+
+	spi_bus_claim();
+
+	while (len)
+	{
+		const uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+		spi_read_bulk(start, buf, n);
+		Serial.write(buf, n);
+		crc = crc32_update(crc, buf, n);
+
+		start += n;
+		len -= n;
+	}
+
+	spi_bus_release();
+	return crc;
+}
+
+
+/** Read the entire ROM out to the serial port. */
+static void
+spi_dump_all(void)
+{
+	spi_chip_detect();
+	delay(1);
+	spi_dump(0, spi_chip.size);
+}
+
+
+/** Send a range of the ROM in binary.
+ *
+ * The reply is a "D start len" line, or "!" if the range does not fit
+ * in the chip, then the raw bytes and the CRC-32 of the range, little
+ * endian, so that the host can check it without the framing of F.
+ */
+static void
+spi_dump_range(
+	uint32_t start,
+	uint32_t len
+)
+{
+	spi_chip_detect();
+	if (len == 0 || start >= spi_chip.size || len > spi_chip.size - start)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	Serial.print("D ");
+	Serial.print(start, HEX);
+	Serial.print(' ');
+	Serial.print(len, HEX);
+	Serial.print("\r\n");
+
+	const uint32_t crc = spi_dump(start, len);
+	Serial.write((const uint8_t*) &crc, sizeof(crc));
+	Serial.send_now();
+}
+
+
+static void
+spi_dump_range_interactive(void)
+{
+	const uint32_t start = usb_serial_readhex();
+	const uint32_t len = usb_serial_readhex();
+	spi_dump_range(start, len);
+}
+
+
+static void
+prom_send_blocks(
+	int start
+)
+{
+	spi_chip_detect();
+	const uint32_t end_addr = spi_chip.size;
+	xmodem_block_t * block = &xmodem_blocks[0];
+
+	if (start)
+	{
+		// We have already received the first nak.
+		// Fire it up!
+		if (xmodem_init(block, start) < 0)
+			return;
+	} else {
+		if (ymodem_init(block, "spiflash.bin", end_addr) < 0)
+			return;
+	}
+
+	const size_t block_size = xmodem_block_size(block);
+
+	//delay(1);
+
+	uint32_t addr = 0;
+	spi_read_bulk(addr, block->data, block_size);
+
+	while (1)
+	{
+		xmodem_block_t * const next = (block == &xmodem_blocks[0])
+			? &xmodem_blocks[1]
+			: &xmodem_blocks[0];
+
+		xmodem_send_start(block);
+
+		// read the next block from the flash while the host
+		// is busy with this one.  it continues the numbering
+		// from the block that is in flight.
+		addr += block_size;
+		const int more = addr < end_addr;
+		if (more)
+		{
+			next->soh = block->soh;
+			next->crc = block->crc;
+			next->block_num = block->block_num;
+			spi_read_bulk(addr, next->data, block_size);
+		}
+
+		if (xmodem_send_finish(block, 1) < 0)
+			return;
+
+		if (!more)
+			break;
+
+		block = next;
+	}
+
+
+	if (xmodem_fini(block) < 0)
+		return;
+
+	if (!start)
+		ymodem_fini(block);
+}
+
+
+/** Send the ROM with xmodem, xmodem-1k or ymodem.
+ *
+ * \param start is the NAK or 'C' that the receiver has already sent,
+ * or 0 to run a ymodem batch with the file size in the header
+ * so that the receiver does not pad the output.
+ */
+static void
+prom_send(
+	int start
+)
+{
+	spi_bus_claim();
+	prom_send_blocks(start);
+	spi_bus_release();
+}
+
+
+/** Send a table of the CRC-32 of every sector in a range.
+ *
+ * The reply is a text line "H ADDR COUNT", then COUNT little endian
+ * CRC-32s (the zlib polynomial, one per SPI_PAGE_SIZE sector), then
+ * the CRC-32 of the table itself.  The host can compare it against
+ * its image and only upload the sectors that differ.  The reply is
+ * "!" if the range is not whole sectors or does not fit in the chip.
+ */
+static void
+spi_hash_map(
+	uint32_t start,
+	uint32_t len
+)
+{
+	spi_chip_detect();
+	if (((start | len) & SPI_PAGE_MASK) != 0
+	|| len == 0 || start >= spi_chip.size || len > spi_chip.size - start)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	const uint32_t count = len / SPI_PAGE_SIZE;
+
+	spi_bus_claim();
+
+	Serial.print("H ");
+	Serial.print(start, HEX);
+	Serial.print(' ');
+	Serial.print(count, HEX);
+	Serial.print("\r\n");
+
+	uint32_t table[64];
+	uint32_t table_crc = 0;
+	uint8_t n = 0;
+
+	for (uint32_t i = 0 ; i < count ; i++)
+	{
+		table[n++] = spi_region_crc(start + i * SPI_PAGE_SIZE, SPI_PAGE_SIZE, NULL);
+		if (n < sizeof(table) / sizeof(*table) && i != count - 1)
+			continue;
+
+		Serial.write((const uint8_t*) table, n * sizeof(*table));
+		table_crc = crc32_update(table_crc, (const uint8_t*) table, n * sizeof(*table));
+		n = 0;
+	}
+
+	Serial.write((const uint8_t*) &table_crc, sizeof(table_crc));
+	Serial.print("\r\n");
+
+	spi_bus_release();
+}
+
+
+static void
+spi_hash_map_interactive(void)
+{
+	const uint32_t start = usb_serial_readhex();
+	const uint32_t len = usb_serial_readhex();
+	spi_hash_map(start, len);
+}
+
+
+/** Send a range of the ROM with the windowed stream protocol. */
+static void
+stream_dump(void)
+{
+	const uint32_t start = usb_serial_readhex();
+	const uint32_t len = usb_serial_readhex();
+	uint8_t window = STREAM_WINDOW;
+	uint8_t flags = 0;
+
+	if (usb_serial_term == ' ')
+		window = usb_serial_readhex();
+	if (usb_serial_term == ' ')
+		flags = usb_serial_readhex();
+
+	// past the end the reads would wrap inside the chip, and the
+	// frames would still have good CRCs
+	spi_chip_detect();
+	if (len == 0 || start >= spi_chip.size || len > spi_chip.size - start)
+	{
+		Serial.print("!\r\n");
+		return;
+	}
+
+	spi_bus_claim();
+	const int rc = stream_send(start, len, window, flags);
+	spi_bus_release();
+
+	if (rc < 0)
+		Serial.print("\r\nstream failed\r\n");
+}
+
+
+// Sectors are compared in 256-byte chunks, with one bit per chunk
+// in a uint16_t mask, independent of the chip's program page size.
+#define SPI_CHUNK_SIZE		256
+#define SPI_CHUNK_ALL		((uint16_t) 0xFFFF)
+
+
+/** Mask of the chunks in a sector that are not all 0xFF */
+static uint16_t
+spi_chunk_mask_used(
+	const uint8_t * const buf
+)
+{
+	uint16_t mask = 0;
+
+	for (uint16_t i = 0 ; i < SPI_PAGE_SIZE ; i += SPI_CHUNK_SIZE)
+	{
+		for (uint16_t j = 0 ; j < SPI_CHUNK_SIZE ; j++)
+		{
+			if (buf[i+j] == 0xFF)
+				continue;
+			mask |= 1 << (i / SPI_CHUNK_SIZE);
+			break;
+		}
+	}
+
+	return mask;
+}
+
+
+/** Chunks of a sector that a program page at offset i overlaps */
+static constexpr uint16_t
+spi_page_mask(
+	uint16_t i,
+	uint16_t page_size
+)
+{
+	return ((2u << ((i + page_size - 1) / SPI_CHUNK_SIZE)) - 1)
+		& ~((1u << (i / SPI_CHUNK_SIZE)) - 1);
+}
+
+
+/** Program a sector for page sizes that have no chip profile below.
+ * Same as spi_engine<>::write_sector(), with the geometry from the
+ * chip descriptor at run time.
+ */
+static int
+spi_write_sector_generic(
+	uint32_t addr,
+	const uint8_t * const buf,
+	uint16_t mask
+)
+{
+	const uint16_t page_size = spi_chip.page_size;
+
+	for (uint16_t i = 0 ; i < SPI_PAGE_SIZE ; i += page_size)
+	{
+		if ((mask & spi_page_mask(i, page_size)) == 0)
+			continue;
+
+		spi_addr_prepare(addr + i);
+		spi_write_enable();
+		uint8_t r2 = spi_status();
+		(void) r2; // unused
+
+		spi_cs(1);
+		spi_write_command(addr+i);
+
+		for (uint16_t j = 0 ; j < page_size ; j++)
+			spi_send(buf[i+j]);
+
+		spi_cs(0);
+
+		// wait for write to finish
+		if (spi_wait(spi_chip.page_timeout_ms) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/** Send WREN without the settling delay and status read of
+ * spi_write_enable(), for use right after spi_wait() has seen
+ * the chip go idle.
+ */
+static inline void
+spi_write_enable_fast(void)
+{
+	spi_cs(1);
+	spi_send(SPI_CMD_WREN);
+	spi_cs(0);
+}
+
+
+// Chip profiles with the geometry known at compile time.  The program
+// engine is instantiated for each one, so the page loop, chunk masks
+// and transfer length are all constants.  Erase sizes and opcodes stay
+// in the chip descriptor, since each erase is a single command.  To
+// support another page size, add it here and to spi_profile_write.
+typedef struct
+{
+	uint16_t page_size;
+} spi_profile_t;
+
+static constexpr spi_profile_t spi_profiles[] = {
+	{ 256 }, // nearly everything
+	{ 512 }, // Spansion S25FL-S and S25FS with the 512 byte buffer
+};
+
+#define SPI_PROFILES (sizeof(spi_profiles) / sizeof(*spi_profiles))
+
+
+template<uint8_t N>
+struct spi_engine
+{
+	static constexpr uint16_t page_size = spi_profiles[N].page_size;
+
+	static_assert(SPI_PAGE_SIZE % page_size == 0, "page must divide a sector");
+
+	/** Program a SPI_PAGE_SIZE sector, one program page at a time.
+	 * Only the pages that overlap a chunk in the mask are programmed;
+	 * the rest are either already correct or erased and meant to be
+	 * left that way.
+	 * \return 0 on success, -1 if a page program timed out.
+	 */
+	static int
+	write_sector(
+		uint32_t addr,
+		const uint8_t * const buf,
+		uint16_t mask
+	)
+	{
+		// wait for anything still running, like an erase,
+		// so that the fast WREN is safe
+		if (spi_wait(spi_chip.page_timeout_ms) < 0)
+			return -1;
+
+		for (uint16_t i = 0 ; i < SPI_PAGE_SIZE ; i += page_size)
+		{
+			if ((mask & spi_page_mask(i, page_size)) == 0)
+				continue;
+
+			if (spi_addr_prepare(addr + i))
+				spi_wait(spi_chip.page_timeout_ms);
+			spi_write_enable_fast();
+
+			spi_cs(1);
+			spi_write_command(addr + i);
+			SPI.transfer(&buf[i], NULL, page_size);
+			spi_cs(0);
+
+			if (spi_wait(spi_chip.page_timeout_ms) < 0)
+				return -1;
+		}
+
+		return 0;
+	}
+};
+
+
+typedef int (*spi_write_sector_t)(uint32_t, const uint8_t *, uint16_t);
+
+static const spi_write_sector_t spi_profile_write[] = {
+	spi_engine<0>::write_sector,
+	spi_engine<1>::write_sector,
+};
+
+static_assert(sizeof(spi_profile_write) / sizeof(*spi_profile_write) == SPI_PROFILES,
+	"every chip profile needs an engine");
+
+// selected by spi_profile_select() when the chip is detected
+static spi_write_sector_t spi_write_sector_engine = spi_write_sector_generic;
+
+
+/** Pick the engine for the page size that the probe found */
+static void
+spi_profile_select(void)
+{
+	spi_write_sector_engine = spi_write_sector_generic;
+
+	for (uint8_t i = 0 ; i < SPI_PROFILES ; i++)
+	{
+		if (spi_profiles[i].page_size != spi_chip.page_size)
+			continue;
+
+		spi_write_sector_engine = spi_profile_write[i];
+		break;
+	}
+}
+
+
+/** Program a SPI_PAGE_SIZE sector with the engine for this chip.
+ * \return 0 on success, -1 if a page program timed out.
+ */
+static inline int
+spi_write_sector(
+	uint32_t addr,
+	const uint8_t * const buf,
+	uint16_t mask
+)
+{
+	return spi_write_sector_engine(addr, buf, mask);
+}
+
+
+/** A sector buffer for the upload, filled from the serial port */
+typedef struct
+{
+	uint8_t data[SPI_PAGE_SIZE];
+	uint16_t fill;
+	bool all_ff;
+
+	// compressed uploads only
+	uint8_t hdr_len; // bytes of the length prefix received
+	uint16_t lz_len; // compressed bytes still to come
+	bool lz_raw; // the host sent this sector uncompressed
+	bool error; // bad length or corrupt compressed data
+	lz_decoder_t lz;
+
+	// filled in by upload_compare() in spi_upload()
+	uint8_t plan; // UPLOAD_PLAN_*
+	uint16_t dirty; // chunks that differ from the flash
+} upload_buf_t;
+
+// What a received sector needs, from comparing it with the flash
+#define UPLOAD_PLAN_NONE	0 // not compared yet
+#define UPLOAD_PLAN_MATCH	1 // the flash already has it
+#define UPLOAD_PLAN_PROGRAM	2 // it only clears bits; no erase needed
+#define UPLOAD_PLAN_ERASE	3
+
+// At least two buffers, so that the next sector can be received while
+// the current one is being erased and programmed.  Boards with the
+// RAM for it get 64K of them, so that spi_upload() can see a whole
+// block ahead before it picks a block erase.
+#if defined(__MK64FX512__) || defined(__MK66FX1M0__) \
+ || defined(__IMXRT1062__) || defined(SPIFLASH_HOST)
+#define UPLOAD_BUFS		16
+#else
+#define UPLOAD_BUFS		2
+#endif
+
+static upload_buf_t upload_bufs[UPLOAD_BUFS];
+static upload_buf_t * upload_rx;
+
+// The upload is LZ compressed: each sector is sent as a 16-bit little
+// endian length and then that many bytes of lz.h data, or exactly
+// SPI_PAGE_SIZE raw bytes if it did not compress.
+static bool upload_compressed;
+static uint32_t upload_wire_bytes;
+
+// An upload gives up when the host stops sending for this long while
+// the device is waiting for data.  Not every host raises DTR, so this
+// is how a dropped link is noticed; the resume map has what was done.
+#define UPLOAD_RX_TIMEOUT_MS	5000
+static uint32_t upload_rx_heard;
+
+
+static void
+upload_buf_reset(
+	upload_buf_t * const ub
+)
+{
+	ub->fill = 0;
+	ub->all_ff = true;
+	ub->hdr_len = 0;
+	ub->lz_len = 0;
+	ub->lz_raw = false;
+	ub->error = false;
+	lz_decode_init(&ub->lz);
+	ub->plan = UPLOAD_PLAN_NONE;
+	ub->dirty = 0;
+}
+
+
+/** Check if a buffer has everything the host will send for it */
+static bool
+upload_buf_done(
+	const upload_buf_t * const ub
+)
+{
+	if (ub->error)
+		return true;
+	if (!upload_compressed)
+		return ub->fill == SPI_PAGE_SIZE;
+	return ub->hdr_len == 2 && ub->lz_len == 0;
+}
+
+
+/** Receive part of a compressed sector and expand it into the buffer */
+static void
+upload_rx_lz(
+	upload_buf_t * const ub,
+	int avail
+)
+{
+	while (avail > 0 && !upload_buf_done(ub))
+	{
+		if (ub->hdr_len < 2)
+		{
+			const uint8_t c = Serial.read();
+			avail--;
+			upload_wire_bytes++;
+
+			ub->lz_len |= (uint16_t) c << (8 * ub->hdr_len++);
+			if (ub->hdr_len < 2)
+				continue;
+
+			if (ub->lz_len == 0 || ub->lz_len > SPI_PAGE_SIZE)
+				ub->error = true;
+			ub->lz_raw = ub->lz_len == SPI_PAGE_SIZE;
+			continue;
+		}
+
+		int n = avail;
+		if (n > ub->lz_len)
+			n = ub->lz_len;
+
+		if (ub->lz_raw)
+		{
+			Serial.readBytes((char*) &ub->data[ub->fill], n);
+			ub->fill += n;
+		} else {
+			uint8_t tmp[64];
+			if (n > (int) sizeof(tmp))
+				n = sizeof(tmp);
+			Serial.readBytes((char*) tmp, n);
+
+			for (int i = 0 ; i < n ; i++)
+			{
+				const int fill = lz_decode(&ub->lz, tmp[i],
+					ub->data, ub->fill, SPI_PAGE_SIZE);
+				if (fill < 0)
+				{
+					ub->error = true;
+					break;
+				}
+				ub->fill = fill;
+			}
+		}
+
+		avail -= n;
+		ub->lz_len -= n;
+		upload_wire_bytes += n;
+
+		// the data must expand to exactly one sector
+		if (ub->lz_len == 0 && ub->fill != SPI_PAGE_SIZE)
+			ub->error = true;
+	}
+}
+
+
+/** Move whatever has arrived on the serial port into the buffer that
+ * is being received, without blocking.  This is the spi_wait_hook
+ * during uploads.
+ */
+static void
+upload_rx_poll(void)
+{
+	upload_buf_t * const ub = upload_rx;
+	if (!ub || upload_buf_done(ub))
+		return;
+
+	int avail = Serial.available();
+	if (avail <= 0)
+		return;
+
+	upload_rx_heard = millis();
+	const uint16_t start = ub->fill;
+
+	if (upload_compressed)
+	{
+		upload_rx_lz(ub, avail);
+	} else {
+		if (avail > SPI_PAGE_SIZE - ub->fill)
+			avail = SPI_PAGE_SIZE - ub->fill;
+
+		Serial.readBytes((char*) &ub->data[ub->fill], avail);
+		ub->fill += avail;
+	}
+
+	// keep track if this is an empty page (all 0xff)
+	if (!ub->all_ff)
+		return;
+
+	for (uint16_t i = start ; i < ub->fill ; i++)
+	{
+		if (ub->data[i] == 0xff)
+			continue;
+		ub->all_ff = false;
+		break;
+	}
+}
+
+
+/** Start timing a wait for upload data */
+static void
+upload_rx_wait_begin(void)
+{
+	upload_rx_heard = millis();
+}
+
+
+/** \return true if the host has sent nothing for UPLOAD_RX_TIMEOUT_MS
+ * since upload_rx_wait_begin() or the last data that arrived.
+ */
+static bool
+upload_rx_timeout(void)
+{
+	return millis() - upload_rx_heard > UPLOAD_RX_TIMEOUT_MS;
+}
+
+
+/** Throw away serial input until the host has been quiet for a while,
+ * so that the rest of an aborted upload is not taken as commands.
+ */
+static void
+upload_drain(void)
+{
+	uint32_t last = millis();
+	while (millis() - last < 100)
+	{
+		if (Serial.read() != -1)
+			last = millis();
+	}
+}
+
+
+// Cumulative time spent in each phase of an upload, so that a slow
+// upload shows if the host, the USB link or the flash is the problem.
+// The receive phase only counts time spent stalled waiting for data,
+// not data that arrived in the background during erase and program.
+// Short samples are timed with the DWT cycle counter.  Erases and rx
+// stalls can run longer than the counter's wrap (about 44 seconds at
+// 96 MHz, 7 seconds at 600 MHz), so they are timed with micros()
+// instead and converted to cycles when they are added.
+enum {
+	UPLOAD_RX,
+	UPLOAD_COMPARE,
+	UPLOAD_ERASE,
+	UPLOAD_PROGRAM,
+	UPLOAD_CONSOLE,
+	UPLOAD_VERIFY,
+	UPLOAD_PHASES
+};
+
+static const char * const upload_phase_names[UPLOAD_PHASES] = {
+	"rx", "compare", "erase", "program", "console", "verify",
+};
+
+typedef struct
+{
+	uint64_t cycles;
+	uint32_t bytes;
+} upload_phase_t;
+
+static upload_phase_t upload_phases[UPLOAD_PHASES];
+
+
+static inline void
+upload_phase_add(
+	uint8_t phase,
+	uint32_t start,
+	uint32_t bytes
+)
+{
+	upload_phases[phase].cycles += cycles_now() - start;
+	upload_phases[phase].bytes += bytes;
+}
+
+
+/** Add a sample that was started with micros() */
+static void
+upload_phase_add_us(
+	uint8_t phase,
+	uint32_t start_us,
+	uint32_t bytes
+)
+{
+	upload_phases[phase].cycles += (uint64_t) (micros() - start_us) * (F_CPU / 1000000);
+	upload_phases[phase].bytes += bytes;
+}
+
+
+static void
+upload_phase_print(void)
+{
+	for (uint8_t i = 0 ; i < UPLOAD_PHASES ; i++)
+	{
+		const upload_phase_t * const ph = &upload_phases[i];
+		const uint32_t ms = ph->cycles / (F_CPU / 1000);
+
+		Serial.print("phase ");
+		Serial.print(upload_phase_names[i]);
+		Serial.print(" ms=");
+		Serial.print(ms);
+		Serial.print(" bytes=");
+		Serial.print(ph->bytes);
+
+		if (ph->bytes && ph->cycles)
+		{
+			Serial.print(" Bps=");
+			Serial.print((uint32_t) ((uint64_t) ph->bytes * F_CPU / ph->cycles));
+		}
+
+		Serial.print("\r\n");
+	}
 }
-	
+
+
+/** Print an upload progress character, counted as console time */
 static void
-spi_read(
-	uint32_t addr
+upload_log(
+	char c
 )
 {
-	//delay(2);
+	const uint32_t start = cycles_now();
+	Serial.print(c);
+	upload_phase_add(UPLOAD_CONSOLE, start, 1);
+}
 
-	spi_cs(1);
-	//delay(1);
 
-	// read a page
-	spi_read_command(addr);
+static int
+upload_erase(
+	uint32_t addr,
+	const spi_erase_type_t * const erase
+)
+{
+	const uint32_t start = micros();
+	spi_write_enable();
+	const int rc = spi_erase(addr, erase);
+	upload_phase_add_us(UPLOAD_ERASE, start, 1ul << erase->shift);
+	return rc;
+}
 
-	uint8_t data[16];
 
-	for (int i = 0 ; i < 16 ; i++)
-		data[i] = spi_send(0);
+static int
+upload_write(
+	uint32_t addr,
+	const uint8_t * const buf,
+	uint16_t mask
+)
+{
+	const uint32_t start = cycles_now();
+	const int rc = spi_write_sector(addr, buf, mask);
 
-	spi_cs(0);
+	uint32_t bytes = 0;
+	for (uint16_t m = mask ; m ; m >>= 1)
+		if (m & 1)
+			bytes += SPI_CHUNK_SIZE;
 
-	char buf[16*3+8+2+3];
-	uint8_t off = 0;
-	buf[off++] = hexdigit(addr >> 28);
-	buf[off++] = hexdigit(addr >> 24);
-	buf[off++] = hexdigit(addr >> 20);
-	buf[off++] = hexdigit(addr >> 16);
-	buf[off++] = hexdigit(addr >> 12);
-	buf[off++] = hexdigit(addr >>  8);
-	buf[off++] = hexdigit(addr >>  4);
-	buf[off++] = hexdigit(addr >>  0);
-	buf[off++] = ':';
-	buf[off++] = ' ';
+	upload_phase_add(UPLOAD_PROGRAM, start, bytes);
+	return rc;
+}
 
-	for (int i = 0 ; i < 16 ; i++)
+
+// Sectors are read back after they are written, while the data is
+// still in the buffer, and erased and written again if they differ.
+#define UPLOAD_RETRIES		2
+#define UPLOAD_BAD_MAX		8
+
+typedef struct
+{
+	uint32_t ok;
+	uint32_t retried;
+	uint32_t bad;
+	uint32_t bad_addr[UPLOAD_BAD_MAX];
+} upload_verify_t;
+
+
+/** Check that a sector that was just erased or programmed reads back
+ * as buf, retrying with a sector erase and program if it does not.
+ * A sector that is still wrong is counted as bad, but the upload
+ * carries on.
+ * \return 0, or -1 if the flash timed out.
+ */
+static int
+upload_verify(
+	uint32_t addr,
+	const uint8_t * const buf,
+	upload_verify_t * const v
+)
+{
+	const uint32_t start = cycles_now();
+	const uint32_t crc = crc32_update(0, buf, SPI_PAGE_SIZE);
+	upload_phase_add(UPLOAD_VERIFY, start, 0);
+
+	for (uint8_t attempt = 0 ; ; attempt++)
 	{
-		buf[off++] = hexdigit(data[i] >> 4);
-		buf[off++] = hexdigit(data[i] >> 0);
-		buf[off++] = ' ';
+		const uint32_t read_start = cycles_now();
+		const uint32_t rom_crc = spi_region_crc(addr, SPI_PAGE_SIZE, NULL);
+		upload_phase_add(UPLOAD_VERIFY, read_start, SPI_PAGE_SIZE);
+
+		if (rom_crc == crc)
+		{
+			resume_mark(addr);
+			if (attempt)
+				v->retried++;
+			else
+				v->ok++;
+			return 0;
+		}
+
+		if (attempt == UPLOAD_RETRIES)
+			break;
+
+		upload_log('!');
+		if (upload_erase(addr, spi_sector_erase_type()) < 0)
+			return -1;
+		if (upload_write(addr, buf, spi_chunk_mask_used(buf)) < 0)
+			return -1;
 	}
-	buf[off++] = '\r';
-	buf[off++] = '\n';
-	buf[off++] = '\0';
 
-	Serial.print(buf);
+	upload_log('X');
+	if (v->bad < UPLOAD_BAD_MAX)
+		v->bad_addr[v->bad] = addr;
+	v->bad++;
+	return 0;
 }
 
 
-/** Read the entire ROM out to the serial port. */
-static void
-spi_dump(void)
+// spi_upload() receives into upload_bufs as a ring, up to
+// UPLOAD_BUFS sectors ahead of the one that is being written.
+// Sector n of the upload is in upload_bufs[n % UPLOAD_BUFS].
+static uint32_t upload_ring_rx; // sector that upload_rx is receiving
+static uint32_t upload_ring_end; // sectors that may be received for now
+
+
+static inline upload_buf_t *
+upload_ring_buf(
+	uint32_t n
+)
 {
-	const uint32_t end_addr = chip_size << 20;
+	return &upload_bufs[n % UPLOAD_BUFS];
+}
 
-	delay(1);
 
-	uint32_t addr = 0;
-	uint8_t buf[64];
+/** The spi_wait_hook for spi_upload(): receive whatever has arrived,
+ * moving on to the next buffer in the ring as each one fills.  It
+ * stops at a corrupt sector, since the rest of the stream can not
+ * be trusted.
+ */
+static void
+upload_ring_poll(void)
+{
+	upload_rx_poll();
 
-	while (1)
+	while (upload_rx
+	&& upload_buf_done(upload_rx)
+	&& !upload_rx->error
+	&& upload_ring_rx + 1 < upload_ring_end)
 	{
-		spi_cs(1);
-		spi_read_command(addr);
-
-		for (uint8_t off = 0 ; off < sizeof(buf) ; off++)
-			buf[off] = spi_send(0);
+		upload_rx = upload_ring_buf(++upload_ring_rx);
+		upload_buf_reset(upload_rx);
+		upload_rx_poll();
+	}
+}
 
-		spi_cs(0);
 
-		Serial.write(buf, sizeof(buf));
+/** Receive until sector n of the upload is in, or until the stream
+ * stops short of it at a corrupt sector or the host stops sending.
+ * \return true if sector n has been received.
+ */
+static bool
+upload_ring_wait(
+	uint32_t n,
+	uint32_t bytes
+)
+{
+	const uint32_t start = micros();
+	upload_rx_wait_begin();
 
-		addr += sizeof(buf);
-		if (addr >= end_addr)
+	while (upload_ring_rx < n || !upload_buf_done(upload_rx))
+	{
+		if (upload_buf_done(upload_rx) && upload_rx->error)
+			break;
+		if (upload_rx_timeout())
 			break;
+		upload_ring_poll();
 	}
 
+	upload_phase_add_us(UPLOAD_RX, start, bytes);
+	return upload_ring_rx > n || (upload_ring_rx == n && upload_buf_done(upload_rx));
 }
 
-static void
-prom_send(void)
+
+/** Compare a received sector with the flash, one chunk at a time,
+ * and keep track of which chunks differ and if the new data only
+ * clears bits, since flash can be programmed from 1 to 0 without an
+ * erase.  This is done once per sector, when it is written or when
+ * the erase planner looks ahead at it.
+ * \return the UPLOAD_PLAN_* for the sector.
+ */
+static uint8_t
+upload_compare(
+	uint32_t addr,
+	upload_buf_t * const ub
+)
 {
-	// We have already received the first nak.
-	// Fire it up!
-	if (xmodem_init(&xmodem_block, 1) < 0)
-		return;
+	if (ub->plan != UPLOAD_PLAN_NONE)
+		return ub->plan;
 
-	const uint32_t end_addr = chip_size << 20;
+	uint8_t rom[SPI_CHUNK_SIZE];
+	const uint8_t * const buf = ub->data;
+	uint16_t dirty = 0;
+	bool programmable = true;
+	const uint32_t start = cycles_now();
 
-	//delay(1);
+	for (uint16_t i = 0 ; i < SPI_PAGE_SIZE ; i += SPI_CHUNK_SIZE)
+	{
+		spi_read_bulk(addr + i, rom, sizeof(rom));
+		if (memcmp(rom, &buf[i], sizeof(rom)) == 0)
+			continue;
 
-	uint32_t addr = 0;
+		dirty |= 1 << (i / SPI_CHUNK_SIZE);
 
-	while (1)
+		for (uint16_t j = 0 ; programmable && j < SPI_CHUNK_SIZE ; j++)
+			if ((rom[j] & buf[i+j]) != buf[i+j])
+				programmable = false;
+	}
+
+	upload_phase_add(UPLOAD_COMPARE, start, SPI_PAGE_SIZE);
+
+	ub->dirty = dirty;
+	ub->plan = dirty == 0 ? UPLOAD_PLAN_MATCH
+		: programmable ? UPLOAD_PLAN_PROGRAM
+		: UPLOAD_PLAN_ERASE;
+	return ub->plan;
+}
+
+
+/** The largest erase type that fits at addr and inside the range.
+ * For ranges that are to be erased completely.
+ */
+static const spi_erase_type_t *
+spi_erase_plan_range(
+	uint32_t addr,
+	uint32_t end_addr
+)
+{
+	for (int i = SPI_CHIP_ERASE_TYPES - 1 ; i >= 0 ; i--)
 	{
-		spi_cs(1);
-		spi_read_command(addr);
+		const spi_erase_type_t * const erase = &spi_chip.erase[i];
+		if (!spi_erase_usable(erase))
+			continue;
 
-		for (uint8_t off = 0 ; off < sizeof(xmodem_block.data) ; off++)
-			xmodem_block.data[off] = spi_send(0);
+		const uint32_t size = 1ul << erase->shift;
+		if (size <= SPI_PAGE_SIZE)
+			continue;
+		if ((addr & (size - 1)) != 0)
+			continue;
+		if (addr + size > end_addr)
+			continue;
 
-		spi_cs(0);
+		return erase;
+	}
 
-		if (xmodem_send(&xmodem_block, 1) < 0)
-			return;
+	return spi_sector_erase_type();
+}
 
-		addr += sizeof(xmodem_block.data);
-		if (addr >= end_addr)
-			break;
+
+/** Check the sectors after sector n of the upload, which needs an
+ * erase, to see if a block erase of count sectors would do only the
+ * work that sector erases would: every one of them must need an erase
+ * as well, or be all 0xFF in the upload so that it is not programmed
+ * either way.  The sectors are received first if they are not in yet.
+ */
+static bool
+upload_block_worth_erasing(
+	uint32_t n,
+	uint32_t addr,
+	uint32_t count
+)
+{
+	if (count > UPLOAD_BUFS || !upload_ring_wait(n + count - 1, 0))
+		return false;
+
+	for (uint32_t i = 1 ; i < count ; i++)
+	{
+		upload_buf_t * const ub = upload_ring_buf(n + i);
+		if (ub->error)
+			return false;
+
+		const uint8_t plan = upload_compare(addr + i * SPI_PAGE_SIZE, ub);
+		if (plan == UPLOAD_PLAN_ERASE)
+			continue;
+		if (plan == UPLOAD_PLAN_MATCH && ub->all_ff)
+			continue;
+		return false;
 	}
 
+	return true;
+}
+
+
+/** Choose how to erase sector n of the upload, at addr, which does
+ * not match the flash and can not just be programmed.
+ *
+ * A larger block is erased only if it starts here, lies inside the
+ * upload and upload_block_worth_erasing() says that every sector in it
+ * needs the erase anyway.  A block with even one sector that matches
+ * or only needs programming gets sector erases instead, since a
+ * block erase would have to rewrite that sector as well.
+ */
+static const spi_erase_type_t *
+spi_upload_plan_erase(
+	uint32_t n,
+	uint32_t addr,
+	uint32_t end_addr
+)
+{
+	for (int i = SPI_CHIP_ERASE_TYPES - 1 ; i >= 0 ; i--)
+	{
+		const spi_erase_type_t * const erase = &spi_chip.erase[i];
+		if (!spi_erase_usable(erase))
+			continue;
+
+		const uint32_t size = 1ul << erase->shift;
+		if (size <= SPI_PAGE_SIZE)
+			continue;
+		if ((addr & (size - 1)) != 0)
+			continue;
+		if (addr + size > end_addr)
+			continue;
+
+		if (upload_block_worth_erasing(n, addr, size / SPI_PAGE_SIZE))
+			return erase;
+	}
 
-	xmodem_fini(&xmodem_block);
+	return spi_sector_erase_type();
 }
 
 
-/** Write some number of pages into the PROM. */
+/** Write some number of pages into the PROM.
+ *
+ * Every sector that is erased or programmed is read back and checked
+ * against the upload with a CRC-32; see upload_verify().  The summary
+ * has the verify counts and the CRC-32 of the whole upload.
+ *
+ * \param whole_chip rewrites the entire chip from addr 0 to len,
+ * which must be the chip size: it is erased with a
+ * single chip erase and then every non-empty sector is programmed,
+ * with no compare pass.
+ * \param compressed has each sector sent as a length prefix and
+ * lz.h data; see upload_compressed.
+ */
 static void
-spi_upload(void)
+spi_upload(
+	uint32_t addr,
+	uint32_t len,
+	bool whole_chip,
+	bool compressed
+)
 {
-	uint32_t addr = usb_serial_readhex();
-	uint32_t len = usb_serial_readhex();
+	spi_chip_detect();
+	const uint16_t page_size = spi_chip.page_size;
 
 	// addr and len must be 4k aligned
-	const int fail = ((len & SPI_PAGE_MASK) != 0) || ((addr & SPI_PAGE_MASK) != 0);
+	const int fail = ((len & SPI_PAGE_MASK) != 0) || ((addr & SPI_PAGE_MASK) != 0)
+		|| page_size == 0 || page_size > SPI_PAGE_SIZE;
 
 	char outbuf[32];
 	uint8_t off = 0;
@@ -593,8 +2317,8 @@ spi_upload(void)
 
 	uint32_t offset = 0;
 #if 0
-	const size_t chunk_size = sizeof(xmodem_block.data);
-	uint8_t * const buf = xmodem_block.data;
+	const size_t chunk_size = XMODEM_BLOCK_SIZE;
+	uint8_t * const buf = xmodem_blocks[0].data;
 
 	for (offset = 0 ; offset < len ; offset += chunk_size)
 	{
@@ -652,15 +2376,58 @@ spi_upload(void)
 
 	Serial.print("\r\ndone!\r\n");
 #else
-	// read an entire page, then compare it to what is in the ROM
+	// read an entire page, then compare it to what is in the ROM.
+	// the next pages are received while this one is programmed.
 	const size_t chunk_size = SPI_PAGE_SIZE;
-	uint8_t buf[SPI_PAGE_SIZE];
+	const uint32_t sectors = len / chunk_size;
+	upload_verify_t verify;
+	uint32_t stream_crc = 0;
 	int empty_count = 0;
 	int match_count = 0;
 	int write_count = 0;
+	int program_count = 0;
+
+	// sectors before erased_end were erased by a block or chip erase
+	// during this upload, so they only need to be programmed
+	const uint32_t end_addr = addr + len;
+	uint32_t erased_end = 0;
+
+	// once the flash stops responding the rest of the upload is
+	// still received, so that it is not taken as commands
+	bool failed = false;
+	bool bad_data = false;
+	bool rx_timeout = false;
+
+	spi_bus_claim();
+	memset(upload_phases, 0, sizeof(upload_phases));
+	upload_compressed = compressed;
+	upload_wire_bytes = 0;
+	memset(&verify, 0, sizeof(verify));
+	resume_begin(addr, len);
+
+	if (whole_chip)
+	{
+		Serial.print("chip erase");
+		Serial.flush();
+
+		const uint32_t start = micros();
+		spi_write_enable();
+		if (spi_erase_chip() < 0)
+			failed = true;
+		upload_phase_add_us(UPLOAD_ERASE, start, len);
+		erased_end = end_addr;
+	}
+
+	upload_ring_rx = 0;
+	upload_ring_end = 1;
+	upload_rx = upload_ring_buf(0);
+	upload_buf_reset(upload_rx);
+	spi_wait_hook = upload_ring_poll;
 
 	for (offset = 0 ; offset < len ; offset += chunk_size, addr += chunk_size)
 	{
+		const uint32_t n = offset / chunk_size;
+
 		// print the address every 256 KB
 		if ((addr & ((64 * SPI_PAGE_SIZE) - 1)) == 0)
 		{
@@ -678,112 +2445,242 @@ spi_upload(void)
 			outbuf[off++] = ':';
 			outbuf[off++] = ' ';
 			outbuf[off++] = '\0';
+
+			const uint32_t start = cycles_now();
 			Serial.print(outbuf);
 			Serial.flush();
+			upload_phase_add(UPLOAD_CONSOLE, start, off - 1);
 		}
 			
-		// read a chunk of data from the serial port
-		// keeping track if this is an empty page (all 0xff)
-		bool all_ff = true;
-		for (uint16_t i = 0 ; i < chunk_size; i++)
+		// finish receiving this chunk from the serial port, with
+		// the ones after it received in the background.  the buffer
+		// of the one before it is free now.
+		upload_ring_end = n + UPLOAD_BUFS < sectors ? n + UPLOAD_BUFS : sectors;
+		upload_buf_t * const cur = upload_ring_buf(n);
+
+		if (!upload_ring_wait(n, chunk_size))
 		{
-			int c;
-			while ((c = Serial.read()) == -1)
-				;
-			buf[i] = c;
-			if (c != 0xff)
-				all_ff = false;
+			// the host has stopped sending; the resume
+			// map has what was done so far
+			rx_timeout = true;
+			break;
 		}
 
-		// read the flash and compare it to the buffer
-		bool matched = true;
-		spi_cs(1);
-		spi_read_command(addr);
-
-		for (uint16_t i = 0 ; i < chunk_size; i++)
+		if (cur->error)
 		{
-			uint8_t rom = spi_send(0);
+			// there is no way to find the next sector
+			// in a corrupt stream, so give up
+			upload_rx = NULL;
+			upload_drain();
+			bad_data = true;
+			break;
+		}
+
+		const uint8_t * const buf = cur->data;
+		const bool all_ff = cur->all_ff;
+
+		// the host can check this against the crc of its image
+		const uint32_t crc_start = cycles_now();
+		stream_crc = crc32_update(stream_crc, buf, chunk_size);
+		upload_phase_add(UPLOAD_VERIFY, crc_start, 0);
 
-			if (buf[i] == rom)
+		if (failed)
+			continue;
+
+		if (addr < erased_end)
+		{
+			// already erased; write it unless it is empty
+			if (all_ff)
+			{
+				upload_log('e');
+				empty_count++;
+				if (upload_verify(addr, buf, &verify) < 0)
+					failed = true;
 				continue;
+			}
 
-			matched = false;
-			break;
+			upload_log('w');
+			write_count++;
+			if (upload_write(addr, buf, spi_chunk_mask_used(buf)) < 0
+			|| upload_verify(addr, buf, &verify) < 0)
+				failed = true;
+			continue;
 		}
-		spi_cs(0);
 
-		if (matched)
+		// the planner may already have compared it
+		const uint8_t plan = upload_compare(addr, cur);
+
+		if (plan == UPLOAD_PLAN_PROGRAM)
+		{
+			// no erase needed; program just the chunks
+			// that are different
+			upload_log('p');
+			program_count++;
+			if (upload_write(addr, buf, cur->dirty) < 0
+			|| upload_verify(addr, buf, &verify) < 0)
+				failed = true;
+			continue;
+		}
+
+		if (plan == UPLOAD_PLAN_MATCH)
 		{
 			// everything mached, no need to touch this page
-			Serial.print('.');
+			upload_log('.');
 			match_count++;
+			resume_mark(addr);
 			continue;
-		} else
-		if (all_ff)
+		}
+
+		// there was a mismatch. erase the page, or the entire
+		// block if every sector in it needs it, and write it
+		const spi_erase_type_t * const erase
+			= spi_upload_plan_erase(n, addr, end_addr);
+		if ((1ul << erase->shift) > SPI_PAGE_SIZE)
+			upload_log('B');
+
+		if (upload_erase(addr, erase) < 0)
 		{
-			Serial.print('e');
-			empty_count++;
-		} else {
-			Serial.print('w');
-			write_count++;
+			failed = true;
+			continue;
 		}
 
-		// there was a mismatch. erase the page and write it
-		spi_write_enable();
-		spi_erase_sector(addr);
+		erased_end = addr + (1ul << erase->shift);
 
 		// if the source was all 0xff, we do not need to write
 		// after the erase has completed
 		if (all_ff)
+		{
+			upload_log('e');
+			empty_count++;
+			if (upload_verify(addr, buf, &verify) < 0)
+				failed = true;
 			continue;
+		}
 
-		// write the 4K page in 256 byte chunks
-		for (uint16_t i = 0 ; i < chunk_size ; i += 256)
-		{
-			spi_write_enable();
-			uint8_t r2 = spi_status();
-			(void) r2; // unused
+		upload_log('w');
+		write_count++;
+		if (upload_write(addr, buf, spi_chunk_mask_used(buf)) < 0
+		|| upload_verify(addr, buf, &verify) < 0)
+			failed = true;
+	}
 
-			spi_cs(1);
-			spi_write_command(addr+i);
-			
-			for (uint16_t j = 0 ; j < 256 ; j++)
-				spi_send(buf[i+j]);
+	spi_wait_hook = NULL;
+	upload_rx = NULL;
+	upload_compressed = false;
 
-			spi_cs(0);
+	spi_bus_release();
 
-			// wait for write to finish
-			while (spi_status() & SPI_WIP)
-				;
-		}
+	if (rx_timeout)
+	{
+		Serial.print("\r\nrx timeout\r\n");
+		return;
 	}
 
+	if (bad_data)
+		Serial.print("\r\nbad compressed data");
+	else if (failed)
+		Serial.print("\r\nflash timeout");
+
 	Serial.print("\r\nmatch: ");
 	Serial.print(match_count);
 	Serial.print(" empty: ");
 	Serial.print(empty_count);
 	Serial.print(" write: ");
-	Serial.println(write_count);
+	Serial.print(write_count);
+	Serial.print(" program: ");
+	Serial.println(program_count);
+
+	Serial.print("verify ok: ");
+	Serial.print(verify.ok);
+	Serial.print(" retried: ");
+	Serial.print(verify.retried);
+	Serial.print(" bad: ");
+	Serial.println(verify.bad);
+	for (uint32_t i = 0 ; i < verify.bad && i < UPLOAD_BAD_MAX ; i++)
+	{
+		Serial.print("bad ");
+		Serial.println(verify.bad_addr[i], HEX);
+	}
+
+	Serial.print("crc: ");
+	Serial.println(stream_crc, HEX);
+
+	if (compressed)
+	{
+		Serial.print("wire: ");
+		Serial.println(upload_wire_bytes);
+	}
+	upload_phase_print();
 #endif
 }
 
+
+/** Parse the range for u and z, or use the whole chip for U and Z */
+static void
+spi_upload_interactive(
+	bool whole_chip,
+	bool compressed
+)
+{
+	uint32_t addr = 0;
+	uint32_t len;
+
+	if (whole_chip)
+	{
+		spi_chip_detect();
+		len = spi_chip.size;
+	} else {
+		addr = usb_serial_readhex();
+		len = usb_serial_readhex();
+	}
+
+	spi_upload(addr, len, whole_chip, compressed);
+}
+
 static const char usage[] =
 "Commands:\r\n"
 " i           Read RDID from the flash chip\r\n"
 " rADDR       Read 16 bytes from address\r\n"
 " .           Read the next 16 bytes\r\n"
 " R           SPI dump\r\n"
+" dADDR LEN   Binary dump of a range, followed by its CRC-32\r\n"
+" QADDR LEN [MODE] Binary dump with FlexSPI2 (Teensy 4.1),\r\n"
+"             MODE 2 1-1-2, 4 1-1-4 (default), 44 1-4-4\r\n"
+" FADDR LEN [WIN [FLAGS]] Framed dump with CRC and retransmit\r\n"
+"             FLAGS 1 sends erased sectors as fill markers,\r\n"
+"             2 LZ compresses the frames\r\n"
+" hADDR LEN   Binary table of the CRC-32 of each 4K sector\r\n"
+" I           List the Intel Flash Descriptor regions\r\n"
+" IdN IhN IFN IuN IzN  d, h, F, u or z for just region N\r\n"
+" /ADDR LEN [HEX..] Search for the IFD signature (0), _FVH (1)\r\n"
+"             and any patterns given as hex bytes (2 and up)\r\n"
 " w           Enable writes (interactive)\r\n"
 " eADDR       Erase a sector\r\n"
 " uADDR LEN   Upload new code for a section of the ROM\r\n"
-" sNN         Chip size in MB (in hex)\r\n"
+" U           Upload a whole ROM image, with a chip erase\r\n"
+" o           Show the sectors the last upload confirmed\r\n"
+" zADDR LEN   Upload with each sector LZ compressed (see lz.h)\r\n"
+" Z           Whole ROM upload, LZ compressed\r\n"
+" p           Probe the chip with RDID and SFDP\r\n"
+" gN          Select chip N of the gang for the other commands\r\n"
+" GADDR LEN   Upload to every chip of the gang at once\r\n"
+" sNN         Chip size in MB (in hex), overriding the probe\r\n"
+" mN          Address method: 1 3-byte, 2 4-byte opcodes,\r\n"
+"             3 enter 4-byte mode, 4 bank register, 0 auto\r\n"
+" cN          Select read clock profile N\r\n"
+" aADDR [LEN] Calibrate the read clock against a region\r\n"
+" kMASK [ADDR] Benchmark: 1 read, 2 usb tx, 4 usb rx,\r\n"
+"             8 program/erase (destroys the 64K block at ADDR)\r\n"
 " x           Read the status register\r\n"
 " XNN         Write the status register (in hex)\r\n"
 " t           Tri-state the pins to release the bus\r\n"
 " b           Read the bank address register\r\n"
 " BX          Write the bank address register\r\n"
+" y           Send the ROM with ymodem (run rb)\r\n"
 "\r\n"
 "To read the entire ROM, start an x-modem transfer.\r\n"
+"Receivers that ask for CRC mode get 1K blocks.\r\n"
+"Host tools can send 0xFE for binary commands (see bincmd.h).\r\n"
 "\r\n";
 
 static uint32_t addr;
@@ -804,7 +2701,66 @@ loop()
 		break;
 
 	case 's':
-		chip_size = usb_serial_readhex();
+		// override the detected size
+		spi_chip.size = usb_serial_readhex() << 20;
+		spi_chip.valid = 1;
+		spi_chip_addr_auto();
+		break;
+
+	case 'm':
+	{
+		// override the address method, or m0 to go back to
+		// what was detected
+		const uint32_t method = usb_serial_readhex();
+		spi_chip_detect();
+		if (method == 0 || method > SPI_ADDR_METHODS)
+		{
+			spi_chip_addr_auto();
+		} else {
+			spi_addr_restore();
+			spi_chip.addr_method = method - 1;
+		}
+
+		Serial.print("addr ");
+		Serial.println(spi_addr_method_names[spi_chip.addr_method]);
+		break;
+	}
+
+	case 'p':
+		spi_chip_probe();
+		spi_chip_print();
+		break;
+
+	case 'g':
+	{
+		// pick the chip for all other commands
+		const uint32_t n = usb_serial_readhex();
+		if (n >= SPI_CS_COUNT)
+		{
+			Serial.println("!");
+			break;
+		}
+
+		spi_cs_select(n);
+		spi_chip.valid = 0;
+		Serial.print("chip ");
+		Serial.print(n);
+		Serial.print(" cs ");
+		Serial.println(spi_cs_pin);
+		break;
+	}
+
+	case 'c':
+		spi_read_profile_set(usb_serial_readhex());
+		spi_read_profile_interactive();
+		break;
+
+	case 'a':
+		spi_calibrate();
+		break;
+
+	case 'k':
+		bench();
 		break;
 
 	case '.':
@@ -841,6 +2797,7 @@ loop()
 		spi_send(SPI_CMD_BRWR);
 		spi_send(brac);
 		spi_cs(0);
+		spi_addr_reset();
 
 		spi_bank_address_register_interactive();
 		break;
@@ -853,20 +2810,38 @@ loop()
 #endif
 
 	case 't':
-		pinMode(SPI_CS, INPUT);
-		digitalWrite(SPI_CS, 0);
-		SPI.end();
+		spi_bus_tristate();
 		Serial.println("TRISTATE");
 		break;
 
-	case 'R': spi_dump(); break;
+	case 'R': spi_dump_all(); break;
+	case 'd': spi_dump_range_interactive(); break;
+	case 'Q': quad_dump_interactive(); break;
+	case 'F': stream_dump(); break;
+	case 'h': spi_hash_map_interactive(); break;
+	case 'o': resume_interactive(); break;
+	case '/': search_interactive(); break;
+	case 'I': ifd_interactive(); break;
 	case 'w': spi_write_enable_interactive(); break;
 	case 'e': spi_erase_sector_interactive(); break;
-	case 'u': spi_upload(); break;
+	case 'u': spi_upload_interactive(false, false); break;
+	case 'U': spi_upload_interactive(true, false); break;
+	case 'G': gang_upload(); break;
+	case 'z': spi_upload_interactive(false, true); break;
+	case 'Z': spi_upload_interactive(true, true); break;
+	case 'y':
+		// wait for the ymodem receiver to start
+		prom_send(0);
+		Serial.print("ymodem done\r\n");
+		break;
 	case XMODEM_NAK:
-		prom_send();
+	case XMODEM_C:
+		prom_send(c);
 		Serial.print("xmodem done\r\n");
 		break;
+	case BINCMD_MAGIC:
+		bincmd_loop();
+		break;
 	case '?': Serial.print(usage);
 		break;
 	default:
@@ -0,0 +1,93 @@
+/** \file
+ * Windowed stream protocol for dumping a range of the flash.
+ *
+ * The device sends the range as a sequence of frames without waiting
+ * for each one to be acknowledged, up to a window of unacknowledged
+ * frames.  Every frame carries its sequence number and a CRC-32, so
+ * the host can check each one and ask for just the bad or missing
+ * frames to be sent again.  Frames are re-read from the flash when
+ * they are resent, so the window does not cost any RAM.
+ *
+ * Device to host, all fields little endian:
+ *
+ *   uint8_t  magic;  // STREAM_MAGIC
+ *   uint8_t  type;   // STREAM_DATA, STREAM_FILL, STREAM_LZ or STREAM_END
+ *   uint16_t len;    // bytes of data that follow the header
+ *   uint32_t seq;    // frame number, starting at 0
+ *   uint32_t addr;   // flash address of the data
+ *   uint8_t  data[len];
+ *   uint32_t crc;    // CRC-32 of the header and the data
+ *
+ * The STREAM_END frame has seq equal to the number of data frames
+ * and carries the CRC-32 of the whole range as its four data bytes.
+ *
+ * With STREAM_FLAG_SPARSE, a frame whose data is entirely 0xFF or
+ * entirely 0x00 is sent as a STREAM_FILL frame instead, with the fill
+ * byte as its only data byte.  It stands for the full frame length
+ * (STREAM_FRAME_SIZE, or whatever is left of the range for the last
+ * frame), so erased regions cost a few bytes per sector rather than
+ * the whole sector.  The range CRC is over the expanded data.
+ *
+ * With STREAM_FLAG_LZ, a frame that compresses is sent as a STREAM_LZ
+ * frame whose data is the lz.h compressed form of the full frame
+ * length; frames that do not shrink are still sent as STREAM_DATA.
+ * The frame CRC is over the compressed data as sent, the range CRC
+ * over the expanded data.  This costs a second 4 KB frame buffer and
+ * the 1 KB compressor hash table.
+ *
+ * Host to device, five bytes each:
+ *
+ *   'A' seq32  -- every frame before seq has been received
+ *   'N' seq32  -- resend frame seq
+ *
+ * or a single CAN to abort.  The end frame is resent until the host
+ * acknowledges it with 'A' and the number of data frames plus one.
+ * If the device hears nothing for STREAM_TIMEOUT_MS it goes back to
+ * the oldest unacknowledged frame and resends from there.
+ */
+#ifndef _stream_h_
+#define _stream_h_
+
+#include <stdint.h>
+
+#define STREAM_MAGIC		0xA5
+#define STREAM_DATA		'D'
+#define STREAM_FILL		'F'
+#define STREAM_LZ		'Z'
+#define STREAM_END		'E'
+
+#define STREAM_FLAG_SPARSE	0x01
+#define STREAM_FLAG_LZ		0x02
+
+#define STREAM_ACK		'A'
+#define STREAM_NAK		'N'
+
+#define STREAM_FRAME_SIZE	4096
+#define STREAM_WINDOW		8
+#define STREAM_TIMEOUT_MS	1000
+#define STREAM_RETRIES		10
+
+typedef struct
+{
+	uint8_t magic;
+	uint8_t type;
+	uint16_t len;
+	uint32_t seq;
+	uint32_t addr;
+} __attribute__((__packed__))
+stream_header_t;
+
+
+/** Send len bytes of the flash starting at start.
+ * \return 0 once the host has acknowledged every frame, -1 if it
+ * cancelled or stopped responding.
+ */
+int
+stream_send(
+	uint32_t start,
+	uint32_t len,
+	uint8_t window,
+	uint8_t flags
+);
+
+#endif
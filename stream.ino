@@ -0,0 +1,242 @@
+/**
+ * \file Windowed stream protocol
+ *
+ * See stream.h for the frame format.
+ */
+
+#include "stream.h"
+#include "crc.h"
+#include "xmodem.h"
+#include "lz.h"
+
+static uint8_t stream_buf[STREAM_FRAME_SIZE];
+
+
+/** Write one frame, with the CRC over the header and data. */
+static void
+stream_write_frame(
+	uint8_t type,
+	uint32_t seq,
+	uint32_t addr,
+	const uint8_t * const data,
+	uint16_t len
+)
+{
+	stream_header_t hdr;
+	hdr.magic = STREAM_MAGIC;
+	hdr.type = type;
+	hdr.len = len;
+	hdr.seq = seq;
+	hdr.addr = addr;
+
+	uint32_t crc = crc32_update(0, (const uint8_t*) &hdr, sizeof(hdr));
+	crc = crc32_update(crc, data, len);
+
+	Serial.write((const uint8_t*) &hdr, sizeof(hdr));
+	Serial.write(data, len);
+	Serial.write((const uint8_t*) &crc, sizeof(crc));
+	Serial.send_now();
+}
+
+
+/** Check if a frame is all 0xFF or all 0x00.
+ * \return 1 and set the fill byte if it is, 0 if not.
+ */
+static int
+stream_is_fill(
+	const uint8_t * const buf,
+	uint16_t len,
+	uint8_t * const fill
+)
+{
+	const uint8_t c = buf[0];
+	if (c != 0xFF && c != 0x00)
+		return 0;
+
+	for (uint16_t i = 1 ; i < len ; i++)
+		if (buf[i] != c)
+			return 0;
+
+	*fill = c;
+	return 1;
+}
+
+
+/** Read data frame seq from the flash and send it.
+ * \return the number of data bytes in the frame, which are
+ * left in stream_buf.
+ */
+static uint16_t
+stream_send_frame(
+	uint32_t start,
+	uint32_t len,
+	uint32_t seq,
+	uint8_t flags
+)
+{
+	const uint32_t offset = seq * STREAM_FRAME_SIZE;
+	uint32_t frame_len = len - offset;
+	if (frame_len > STREAM_FRAME_SIZE)
+		frame_len = STREAM_FRAME_SIZE;
+
+	spi_read_bulk(start + offset, stream_buf, frame_len);
+
+	uint8_t fill;
+	if ((flags & STREAM_FLAG_SPARSE) && stream_is_fill(stream_buf, frame_len, &fill))
+	{
+		stream_write_frame(STREAM_FILL, seq, start + offset, &fill, 1);
+		return frame_len;
+	}
+
+	if (flags & STREAM_FLAG_LZ)
+	{
+		// a stream and an upload never run at the same time, so the
+		// compressed frame borrows an upload buffer
+		static_assert(sizeof(upload_bufs[0].data) >= STREAM_FRAME_SIZE,
+			"an upload buffer must hold a stream frame");
+		uint8_t * const lz_buf = upload_bufs[0].data;
+
+		// only worth it if the frame gets smaller
+		const uint16_t lz_len = lz_compress(stream_buf, frame_len,
+			lz_buf, frame_len - 1);
+		if (lz_len)
+		{
+			stream_write_frame(STREAM_LZ, seq, start + offset, lz_buf, lz_len);
+			return frame_len;
+		}
+	}
+
+	stream_write_frame(STREAM_DATA, seq, start + offset, stream_buf, frame_len);
+	return frame_len;
+}
+
+
+/** Collect a host message without blocking.
+ * \return the message type once all five bytes have arrived,
+ * XMODEM_CAN for a cancel, or 0 if there is nothing yet.
+ */
+static int
+stream_poll(
+	uint8_t * const msg,
+	uint8_t * const msg_len,
+	uint32_t * const seq
+)
+{
+	while (1)
+	{
+		const int c = Serial.read();
+		if (c == -1)
+			return 0;
+
+		if (*msg_len == 0)
+		{
+			if (c == XMODEM_CAN)
+				return XMODEM_CAN;
+			if (c != STREAM_ACK && c != STREAM_NAK)
+				continue; // resync on junk
+		}
+
+		msg[(*msg_len)++] = c;
+		if (*msg_len < 5)
+			continue;
+
+		*msg_len = 0;
+		*seq = ((uint32_t) msg[1] <<  0)
+		     | ((uint32_t) msg[2] <<  8)
+		     | ((uint32_t) msg[3] << 16)
+		     | ((uint32_t) msg[4] << 24);
+		return msg[0];
+	}
+}
+
+
+int
+stream_send(
+	uint32_t start,
+	uint32_t len,
+	uint8_t window,
+	uint8_t flags
+)
+{
+	const uint32_t frames = (len + STREAM_FRAME_SIZE - 1) / STREAM_FRAME_SIZE;
+
+	if (window == 0)
+		window = 1;
+
+	uint32_t base = 0; // oldest unacknowledged frame
+	uint32_t next = 0; // next new frame to send
+	uint32_t range_crc = 0;
+	uint32_t crc_frames = 0; // frames included in range_crc
+	uint8_t retries = 0;
+	uint32_t last_heard = millis();
+
+	uint8_t msg[5];
+	uint8_t msg_len = 0;
+
+	// data frames, then the end frame as frame number "frames"
+	while (base <= frames)
+	{
+		uint32_t seq;
+		const int c = stream_poll(msg, &msg_len, &seq);
+
+		if (c == XMODEM_CAN)
+			return -1;
+
+		if (c == STREAM_ACK)
+		{
+			if (seq > base && seq <= next)
+				base = seq;
+			last_heard = millis();
+			retries = 0;
+			continue;
+		}
+
+		if (c == STREAM_NAK)
+		{
+			// only frames that are in flight can be resent
+			if (base <= seq && seq < next && seq < frames)
+				stream_send_frame(start, len, seq, flags);
+			last_heard = millis();
+			continue;
+		}
+
+		if (next < frames && next - base < window)
+		{
+			const uint16_t frame_len = stream_send_frame(start, len, next, flags);
+
+			// the range crc follows the first transmission of
+			// each frame, which is always in order
+			if (next == crc_frames)
+			{
+				range_crc = crc32_update(range_crc, stream_buf, frame_len);
+				crc_frames++;
+			}
+
+			next++;
+			continue;
+		}
+
+		if (next == frames && base == frames)
+		{
+			// everything has been acknowledged; send the end frame
+			stream_write_frame(STREAM_END, frames, start + len,
+				(const uint8_t*) &range_crc, sizeof(range_crc));
+			Serial.send_now();
+			next++;
+			last_heard = millis();
+			continue;
+		}
+
+		if (millis() - last_heard < STREAM_TIMEOUT_MS)
+			continue;
+
+		// nothing heard; go back to the oldest frame in flight
+		if (++retries > STREAM_RETRIES)
+			return -1;
+
+		next = base;
+		last_heard = millis();
+	}
+
+	return 0;
+}
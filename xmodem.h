@@ -1,24 +1,35 @@
 /** \file
  * xmodem file transfer protocol.
+ *
+ * Supports classic 128-byte xmodem with the additive checksum,
+ * xmodem-1k with CRC-16 when the receiver starts with 'C',
+ * and the ymodem batch header so that the receiver knows the
+ * name and size of the file.
  */
 #ifndef _xmodem_h_
 #define _xmodem_h_
 
-#include <avr/io.h>
 #include <stdint.h>
 
+#define XMODEM_BLOCK_SIZE	128
+#define XMODEM_1K_BLOCK_SIZE	1024
+
 
 typedef struct
 {
-	uint8_t soh;
+	uint8_t soh; // SOH for 128-byte blocks, STX for 1K blocks
 	uint8_t block_num;
 	uint8_t block_num_complement;
-	uint8_t data[128];
-	uint8_t cksum;
+	uint8_t data[XMODEM_1K_BLOCK_SIZE];
+	uint8_t cksum[2]; // checksum, or CRC-16 high byte first
+
+	// not sent; set by xmodem_init() from the receiver's start byte
+	uint8_t crc;
 } __attribute__((__packed__))
 xmodem_block_t;
 
 #define XMODEM_SOH 0x01
+#define XMODEM_STX 0x02
 #define XMODEM_EOT 0x04
 #define XMODEM_ACK 0x06
 #define XMODEM_CAN 0x18
@@ -26,10 +37,55 @@ xmodem_block_t;
 #define XMODEM_NAK 0x15
 #define XMODEM_EOF 0x1a
 
+
+/** Number of data bytes carried by a block */
+static inline uint16_t
+xmodem_block_size(
+	const xmodem_block_t * const block
+)
+{
+	return block->soh == XMODEM_STX
+		? XMODEM_1K_BLOCK_SIZE
+		: XMODEM_BLOCK_SIZE;
+}
+
+
+/** Start an xmodem transfer.
+ *
+ * \param start is the byte that the receiver has already sent to
+ * start the transfer (XMODEM_NAK or XMODEM_C), or 0 to wait for it.
+ * A NAK selects 128-byte blocks with the checksum, a 'C' selects
+ * 1K blocks with CRC-16.
+ */
 int
 xmodem_init(
 	xmodem_block_t * const block,
-	int already_received_first_nak
+	int start
+);
+
+
+/** Start a ymodem transfer: wait for the receiver's 'C', send the
+ * block 0 header with the file name and size, then wait for the
+ * 'C' that starts the data blocks.
+ */
+int
+ymodem_init(
+	xmodem_block_t * const block,
+	const char * const name,
+	uint32_t size
+);
+
+
+void
+xmodem_send_start(
+	xmodem_block_t * const block
+);
+
+
+int
+xmodem_send_finish(
+	xmodem_block_t * const block,
+	int wait_for_ack
 );
 
 
@@ -44,4 +100,12 @@ int xmodem_fini(
 	xmodem_block_t * const block
 );
 
+
+/** End a ymodem batch after xmodem_fini() by sending the empty
+ * block 0 header.
+ */
+int ymodem_fini(
+	xmodem_block_t * const block
+);
+
 #endif
@@ -4,56 +4,120 @@
  * Using USB serial
  */
 
+#include "hal.h"
 #include "xmodem.h"
 
 
 
-/** Send a block.
- * Compute the checksum and complement.
+/** CRC-16/XMODEM: polynomial 0x1021, initial value 0 */
+static uint16_t
+xmodem_crc16(
+	const uint8_t * const buf,
+	uint16_t len
+)
+{
+	uint16_t crc = 0;
+
+	for (uint16_t i = 0 ; i < len ; i++)
+	{
+		crc ^= (uint16_t) buf[i] << 8;
+		for (uint8_t bit = 0 ; bit < 8 ; bit++)
+		{
+			if (crc & 0x8000)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc = crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+
+/** Write the header, data and checksum of a block.
+ * The trailer is not contiguous with the data for 128-byte blocks,
+ * so it is written separately.
+ */
+static void
+xmodem_write(
+	const xmodem_block_t * const block
+)
+{
+	Serial.write((const uint8_t*) block, 3 + xmodem_block_size(block));
+	Serial.write(block->cksum, block->crc ? 2 : 1);
+	Serial.send_now();
+}
+
+
+/** Start sending a block.
+ * Compute the checksum and complement, bump the block number and
+ * write the block to the host without waiting for a response.
+ * The caller must follow this with xmodem_send_finish() before
+ * the block is reused.
+ */
+void
+xmodem_send_start(
+	xmodem_block_t * const block
+)
+{
+	const uint16_t len = xmodem_block_size(block);
+
+	// Compute the checksum and complement
+	if (block->crc)
+	{
+		const uint16_t crc = xmodem_crc16(block->data, len);
+		block->cksum[0] = crc >> 8;
+		block->cksum[1] = crc >> 0;
+	} else {
+		uint8_t cksum = 0;
+		for (uint16_t i = 0 ; i < len ; i++)
+			cksum += block->data[i];
+		block->cksum[0] = cksum;
+	}
+
+	block->block_num++;
+	block->block_num_complement = 0xFF - block->block_num;
+
+	xmodem_write(block);
+}
+
+
+/** Wait for the host to acknowledge a block started with
+ * xmodem_send_start(), resending it if the host NAKs.
  *
  * \return 0 if all is ok, -1 if a cancel is requested or more
  * than 10 retries occur.
  */
 int
-xmodem_send(
+xmodem_send_finish(
 	xmodem_block_t * const block,
 	int wait_for_ack
 )
 {
-	// Compute the checksum and complement
-	uint8_t cksum = 0;
-	uint8_t i;
-	for (i = 0 ; i < sizeof(block->data) ; i++)
-		cksum += block->data[i];
-
-	block->cksum = cksum;
-	block->block_num++;
-	block->block_num_complement = 0xFF - block->block_num;
-
-	// Send the block, and wait for an ACK
 	uint8_t retry_count = 0;
 
-	while (retry_count++ < 10)
+	while (1)
 	{
-		Serial.write((const uint8_t*) block, sizeof(*block));
-		Serial.send_now();
 		// Wait for an ACK (done), CAN (abort) or NAK (retry)
-		while (1)
-		{
-			const int c = Serial.read();
-			if (c == -1)
-				continue;
+		const int c = Serial.read();
+		if (c == -1)
+			continue;
 
-			if (c == XMODEM_ACK)
-				return 0;
-			if (c == XMODEM_CAN)
-				return -1;
-			if (c == XMODEM_NAK)
+		if (c == XMODEM_ACK)
+			return 0;
+		if (c == XMODEM_CAN)
+			return -1;
+		if (c == XMODEM_NAK)
+		{
+			if (++retry_count >= 10)
 				break;
 
-			if (!wait_for_ack)
-				return 0;
+			xmodem_write(block);
+			continue;
 		}
+
+		if (!wait_for_ack)
+			return 0;
 	}
 
 	// Failure or cancel
@@ -61,38 +125,136 @@ xmodem_send(
 }
 
 
+/** Send a block and wait for the host to acknowledge it.
+ *
+ * \return 0 if all is ok, -1 if a cancel is requested or more
+ * than 10 retries occur.
+ */
 int
-xmodem_init(
+xmodem_send(
 	xmodem_block_t * const block,
-	int already_received_first_nak
+	int wait_for_ack
 )
 {
-	block->soh = 0x01;
-	block->block_num = 0x00;
+	xmodem_send_start(block);
+	return xmodem_send_finish(block, wait_for_ack);
+}
 
-	if (already_received_first_nak)
-		return 0;
 
-	// wait for initial nak
+/** Wait for the receiver to send NAK or 'C' to start a transfer.
+ * \return the start byte, or -1 if a cancel is requested.
+ */
+static int
+xmodem_wait_start(void)
+{
 	while (1)
 	{
 		const int c = Serial.read();
 		if (c == -1)
 			continue;
 
-		if (c == XMODEM_NAK)
-			return 0;
+		if (c == XMODEM_NAK || c == XMODEM_C)
+			return c;
 		if (c == XMODEM_CAN)
 			return -1;
 	}
 }
 
 
+int
+xmodem_init(
+	xmodem_block_t * const block,
+	int start
+)
+{
+	if (!start)
+		start = xmodem_wait_start();
+	if (start < 0)
+		return -1;
+
+	block->crc = start == XMODEM_C;
+	block->soh = block->crc ? XMODEM_STX : XMODEM_SOH;
+	block->block_num = 0x00;
+
+	return 0;
+}
+
+
+/** Send a 128-byte ymodem block 0, either the file header
+ * or the empty one that ends the batch.
+ */
+static int
+ymodem_send_header(
+	xmodem_block_t * const block,
+	const char * const name,
+	uint32_t size
+)
+{
+	const uint8_t data_soh = block->soh;
+
+	memset(block->data, 0, XMODEM_BLOCK_SIZE);
+	if (name)
+	{
+		// "name\0size\0", with the size in decimal
+		char * p = (char*) block->data;
+		strcpy(p, name);
+		p += strlen(name) + 1;
+
+		char digits[12];
+		uint8_t off = 0;
+		do {
+			digits[off++] = '0' + size % 10;
+			size /= 10;
+		} while (size);
+
+		while (off)
+			*p++ = digits[--off];
+	}
+
+	block->soh = XMODEM_SOH;
+	block->block_num = 0xFF; // incremented to 0 by the send
+
+	const int rc = xmodem_send(block, 1);
+
+	block->soh = data_soh;
+	return rc;
+}
+
+
+int
+ymodem_init(
+	xmodem_block_t * const block,
+	const char * const name,
+	uint32_t size
+)
+{
+	// ymodem receivers always ask for CRC mode
+	const int start = xmodem_wait_start();
+	if (start != XMODEM_C)
+		return -1;
+
+	if (xmodem_init(block, start) < 0)
+		return -1;
+
+	if (ymodem_send_header(block, name, size) < 0)
+		return -1;
+
+	// the receiver sends another 'C' when it is ready for the data
+	if (xmodem_wait_start() != XMODEM_C)
+		return -1;
+
+	// the first data block is number 1
+	block->block_num = 0x00;
+	return 0;
+}
+
+
 int
 xmodem_fini(
 	xmodem_block_t * const block
 )
 {
+	(void) block; // only used by the EOF block below
 #if 0
 /* Don't send EOF?  rx adds it to the file? */
 	block->block_num++;
@@ -102,10 +264,12 @@ xmodem_fini(
 #endif
 
 	// File transmission complete.  send an EOT
-	// wait for an ACK or CAN
+	// wait for an ACK or CAN.  Some receivers NAK the first EOT
+	// to make sure that it was not line noise, so resend on NAK.
 	while (1)
 	{
 		Serial.print((char) XMODEM_EOT);
+		Serial.send_now();
 
 		while (1)
 		{
@@ -116,6 +280,21 @@ xmodem_fini(
 				return 0;
 			if (c == XMODEM_CAN)
 				return -1;
+			if (c == XMODEM_NAK)
+				break;
 		}
 	}
 }
+
+
+int
+ymodem_fini(
+	xmodem_block_t * const block
+)
+{
+	// the receiver asks for the next file in the batch
+	if (xmodem_wait_start() != XMODEM_C)
+		return -1;
+
+	return ymodem_send_header(block, NULL, 0);
+}